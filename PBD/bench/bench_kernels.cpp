@@ -0,0 +1,141 @@
+// ----------------------------------------------------------------------------
+// bench_kernels.cpp
+//
+// Description: Agreement and cost of the AVX2 batch kernels of the stretch
+//   and bend constraints against the scalar project(). The constraints share
+//   no vertex, so that each result is one evaluation of either path and
+//   nothing compounds: random edges and random hinges (dihedral and rest
+//   angles in [0, pi), masses in [0.5, 1.5]) are projected once by each path.
+//   The difference of a particle, relative to 1 + the largest correction of
+//   its constraint, must stay within the tolerance of the kind; exits with
+//   EXIT_FAILURE otherwise. Hinges whose only free vertices are on one side
+//   are left out: both float paths are then off the exact correction by up
+//   to a few percent (see ConstraintKernels.hpp).
+//
+// Usage: bench_kernels [<constraints per kind>]
+// ----------------------------------------------------------------------------
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+
+#include "../src/ConstraintKernels.hpp"
+
+namespace {
+
+const tReal kPi = 3.14159265f;
+const int kReps = 20;
+
+std::mt19937 gRng(1);
+tReal uniform(const tReal a, const tReal b) { return std::uniform_real_distribution<tReal>(a, b)(gRng); }
+glm::vec3 uniformVec() { return glm::vec3(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1)); }
+
+// k disjoint constraints of C over the particles of x
+template<typename C> struct Problem {
+  ParticleStore x;
+  tMassInv w;
+  std::vector<C> cs;
+};
+
+Problem<ConstraintStretch> stretches(const tUint n)
+{
+  Problem<ConstraintStretch> p;
+  p.x.resize(2*n);
+  p.w.assign(p.x.paddedSize(), 0);
+  for(tUint k=0; k<n; ++k) {
+    p.x.set(2*k, uniformVec());
+    p.x.set(2*k + 1, uniformVec());
+    for(int v=0; v<2; ++v) p.w[2*k + v] = uniform(0.5f, 1.5f);
+    p.cs.push_back(ConstraintStretch(2*k, 2*k + 1, uniform(0.1f, 2), uniform(0.1f, 1)));
+  }
+  return p;
+}
+
+Problem<ConstraintBend> bends(const tUint n)
+{
+  Problem<ConstraintBend> p;
+  p.x.resize(4*n);
+  p.w.assign(p.x.paddedSize(), 0);
+  for(tUint k=0; k<n; ++k) {
+    // hinge along e, wings at the angle th around it
+    const glm::vec3 p1 = uniformVec(), e = glm::normalize(uniformVec());
+    const glm::vec3 a = glm::normalize(glm::cross(e, uniformVec())), b = glm::cross(e, a);
+    const glm::vec3 m = p1 + e*uniform(0.1f, 0.9f);
+    const tReal th = uniform(0, kPi);
+    p.x.set(4*k, p1);
+    p.x.set(4*k + 1, p1 + e*uniform(0.5f, 1));
+    p.x.set(4*k + 2, m + a*uniform(0.2f, 0.8f));
+    p.x.set(4*k + 3, m + (a*std::cos(th) + b*std::sin(th))*uniform(0.2f, 0.8f));
+    for(int v=0; v<4; ++v) p.w[4*k + v] = uniform(0.5f, 1.5f);
+    p.cs.push_back(ConstraintBend(4*k, 4*k + 1, 4*k + 2, 4*k + 3, uniform(0, kPi), uniform(0.1f, 1)));
+  }
+  return p;
+}
+
+// x after one projection at level l, and the ms it took
+template<typename C>
+double project(const Problem<C> &p, const pbd::SimdLevel l, ParticleStore &x)
+{
+  pbd::setSimdLevel(l);
+  double ms = 0;
+  for(int r=0; r<kReps; ++r) {
+    x = p.x;
+    const auto t0 = std::chrono::steady_clock::now();
+    projectBatch(p.cs.data(), static_cast<tUint>(p.cs.size()), x, p.w);
+    ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+  }
+  return ms/kReps;
+}
+
+// true if within tol
+template<typename C>
+bool check(const Problem<C> &p, const tReal tol)
+{
+  ParticleStore xs, xv;
+  const double ms_scalar = project(p, pbd::kSimdScalar, xs);
+  const double ms_avx2 = project(p, pbd::kSimdAvx2, xv);
+
+  double max_abs = 0, max_rel = 0;
+  tUint n_bad = 0;
+  for(const C &c : p.cs) {
+    double corr = 0;
+    for(int v=0; v<C::kArity; ++v)
+      corr = std::max(corr, static_cast<double>(glm::length(xs.get(c.vertex(v)) - p.x.get(c.vertex(v)))));
+    for(int v=0; v<C::kArity; ++v) {
+      const double d = glm::length(xv.get(c.vertex(v)) - xs.get(c.vertex(v)));
+      max_abs = std::max(max_abs, d);
+      max_rel = std::max(max_rel, d/(1 + corr));
+      if(d>tol*(1 + corr)) ++n_bad;
+    }
+  }
+  std::cout << std::setw(8) << C::name() << std::setw(9) << p.cs.size()
+            << std::scientific << std::setprecision(2) << std::setw(11) << max_abs
+            << std::setw(11) << max_rel << std::setw(9) << tol << std::setw(6) << n_bad
+            << std::fixed << std::setprecision(3) << std::setw(11) << ms_scalar
+            << std::setw(11) << ms_avx2 << std::endl;
+  return !n_bad;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  const tUint n = argc>1 ? static_cast<tUint>(std::atoi(argv[1])) : 1 << 16;
+  if(pbd::simdLevel()!=pbd::kSimdAvx2) {
+    std::cout << "no AVX2: nothing to compare" << std::endl;
+    return EXIT_SUCCESS;
+  }
+
+  std::cout << "|dx|: AVX2 vs. scalar, rel: over 1 + the correction; ms per projection"
+            << std::endl
+            << std::setw(8) << "kind" << std::setw(9) << "n" << std::setw(11) << "max |dx|"
+            << std::setw(11) << "max rel" << std::setw(9) << "tol" << std::setw(6) << "bad"
+            << std::setw(11) << "scalar" << std::setw(11) << "avx2" << std::endl;
+  bool ok = check(stretches(n), 1e-5f);
+  ok = check(bends(n), 1e-4f) && ok;
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
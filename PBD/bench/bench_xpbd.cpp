@@ -0,0 +1,98 @@
+// ----------------------------------------------------------------------------
+// bench_xpbd.cpp
+//
+// Description: Convergence vs. CPU time of PBD (one step, num_solve
+//   Gauss-Seidel iterations), Jacobi PBD (plain and Chebyshev-accelerated)
+//   and XPBD small steps (num substeps, one iteration each) on a square
+//   cloth hanging from two corners. After kSeconds of simulation at
+//   60 steps per second, the stretch error is the mean of |l - l0|/l0 over
+//   the edges, and the sag the drop of the lowest vertex; both shrink as the
+//   cloth gets stiffer.
+//
+// Usage: bench_xpbd [<bend compliance> [<spectral radius>]]
+// ----------------------------------------------------------------------------
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#include "../src/PbdSolver.hpp"
+
+namespace {
+
+const tReal kDt = 1.f/60.f;
+const tReal kSeconds = 2;
+
+enum Scheme { kPbd, kJacobi, kChebyshev, kXpbd };
+const char *const kSchemeNames[] = { "pbd", "jacobi", "cheby", "xpbd" };
+
+tReal gBendCompliance = 1e-3f;
+tReal gRho = 0.98f;
+
+struct Result { double msPerStep, stretch, sag; };
+
+Result run(const tUint res, const tUint iters, const Scheme scheme)
+{
+  Mesh mesh;
+  mesh.addCloth(res, res, 0.8f, 0.8f);
+  const std::vector<glm::vec3> x0 = mesh.vertexPositions();
+
+  PbdSolver solver(scheme==kXpbd ? 1 : iters);
+  solver.setVerbose(false);
+  if(scheme==kXpbd) solver.setSmallSteps(iters, 0, gBendCompliance);
+  if(scheme==kJacobi) solver.setJacobi(true, 0);
+  if(scheme==kChebyshev) solver.setJacobi(true, gRho);
+  solver.initSim(mesh);
+
+  const int steps = static_cast<int>(kSeconds/kDt);
+  const auto t0 = std::chrono::steady_clock::now();
+  for(int s=0; s<steps; ++s) solver.step(kDt);
+  const auto t1 = std::chrono::steady_clock::now();
+  solver.updateMesh(mesh);
+
+  Result r = { std::chrono::duration<double, std::milli>(t1 - t0).count()/steps, 0, 0 };
+  const std::vector<glm::vec3> &x = mesh.vertexPositions();
+  tUint n = 0;
+  for(const glm::uvec3 &t : mesh.triangleIndices())
+    for(int k=0; k<3; ++k) {
+      const tUint a = t[k], b = t[(k+1)%3];
+      const double l0 = glm::distance(x0[a], x0[b]);
+      r.stretch += std::abs(glm::distance(x[a], x[b]) - l0)/l0;
+      ++n;
+    }
+  r.stretch /= n;
+  for(const glm::vec3 &p : x) r.sag = std::max(r.sag, static_cast<double>(-p.y));
+  return r;
+}
+
+void report(const tUint res, const tUint iters, const Scheme scheme)
+{
+  const Result r = run(res, iters, scheme);
+  std::cout << std::setw(6) << res << std::setw(8) << kSchemeNames[scheme] << std::setw(7) << iters
+            << std::fixed << std::setprecision(3) << std::setw(11) << r.msPerStep
+            << std::scientific << std::setprecision(2) << std::setw(12) << r.stretch
+            << std::fixed << std::setprecision(4) << std::setw(10) << r.sag << std::endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  if(argc>1) gBendCompliance = static_cast<tReal>(std::atof(argv[1]));
+  if(argc>2) gRho = static_cast<tReal>(std::atof(argv[2]));
+
+  std::cout << "iters: iterations per step, or substeps of one iteration (xpbd); cheby: rho = "
+            << gRho << std::endl
+            << std::setw(6) << "res" << std::setw(8) << "scheme" << std::setw(7) << "iters"
+            << std::setw(11) << "ms/step" << std::setw(12) << "stretch" << std::setw(10) << "sag"
+            << std::endl;
+  const tUint res[] = { 15, 64, 128 };
+  const tUint iters[] = { 5, 10, 20, 40, 80 };
+  for(const tUint r : res) {
+    for(int s=kPbd; s<=kXpbd; ++s)
+      for(const tUint it : iters) report(r, it, static_cast<Scheme>(s));
+  }
+  return EXIT_SUCCESS;
+}
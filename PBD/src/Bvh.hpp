@@ -0,0 +1,423 @@
+// ----------------------------------------------------------------------------
+// Bvh.hpp
+//
+// Description: Bounding volume hierarchy over the triangles of a mesh, for
+//   closest-point queries. It is built top-down with the surface area
+//   heuristic over kBins bins per axis. The nodes live in one array in
+//   depth-first order, 32 bytes each, with the left child right after its
+//   parent. A leaf holds at most kLeafSize triangles, stored as a structure
+//   of arrays in slots of kLeafSize, so that a query gets the distances to
+//   all of them at once with AVX2 (checked at run time, as in
+//   ConstraintKernels.hpp). refit() updates the triangles and boxes after
+//   the vertices moved, bottom-up and without changing the tree; after a
+//   large deformation, build() again.
+// ----------------------------------------------------------------------------
+
+#ifndef _BVH_HPP_
+#define _BVH_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "typedefs.hpp"
+#include "ParticleStore.hpp"
+#include "ConstraintKernels.hpp"
+
+namespace pbd {
+
+// closest point to p on the triangle (a, b, c), by the Voronoi regions of
+// its corners and edges (Ericson, Real-Time Collision Detection, 5.1.5)
+inline glm::vec3 closestPointTriangle(
+  const glm::vec3 &p, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c)
+{
+  const glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+  const tReal d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+  if(d1<=0 && d2<=0) return a;
+  const glm::vec3 bp = p - b;
+  const tReal d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+  if(d3>=0 && d4<=d3) return b;
+  const tReal vc = d1*d4 - d3*d2;
+  if(vc<=0 && d1>=0 && d3<=0) return a + (d1/(d1 - d3))*ab;
+  const glm::vec3 cp = p - c;
+  const tReal d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+  if(d6>=0 && d5<=d6) return c;
+  const tReal vb = d5*d2 - d1*d6;
+  if(vb<=0 && d2>=0 && d6<=0) return a + (d2/(d2 - d6))*ac;
+  const tReal va = d3*d6 - d5*d4;
+  if(va<=0 && d4>=d3 && d5>=d6) return b + ((d4 - d3)/((d4 - d3) + (d5 - d6)))*(c - b);
+  const tReal s = 1/(va + vb + vc);
+  return a + (vb*s)*ab + (vc*s)*ac;
+}
+
+#ifdef PBD_AVX2_DISPATCH
+namespace avx2 {
+
+// the same for 8 triangles: every region is evaluated and the first that
+// holds is blended in last; the divisions of the regions not taken may give
+// inf or nan, which the blends drop, and a degenerate triangle gives nan
+PBD_TARGET_AVX2 inline V3 closestPointTriangle(const V3 &p, const V3 &a, const V3 &b, const V3 &c)
+{
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+  const V3 ab = sub(b, a), ac = sub(c, a);
+  const V3 ap = sub(p, a), bp = sub(p, b), cp = sub(p, c);
+  const __m256 d1 = dot(ab, ap), d2 = dot(ac, ap), d3 = dot(ab, bp);
+  const __m256 d4 = dot(ac, bp), d5 = dot(ab, cp), d6 = dot(ac, cp);
+  const __m256 va = _mm256_fmsub_ps(d3, d6, _mm256_mul_ps(d5, d4));
+  const __m256 vb = _mm256_fmsub_ps(d5, d2, _mm256_mul_ps(d1, d6));
+  const __m256 vc = _mm256_fmsub_ps(d1, d4, _mm256_mul_ps(d3, d2));
+#define PBD_LE(x, y) _mm256_cmp_ps(x, y, _CMP_LE_OQ)
+
+  // q = a + v*ab + w*ac; inside the face
+  const __m256 s = _mm256_div_ps(one, _mm256_add_ps(va, _mm256_add_ps(vb, vc)));
+  __m256 v = _mm256_mul_ps(vb, s), w = _mm256_mul_ps(vc, s);
+  // edge bc
+  const __m256 e43 = _mm256_sub_ps(d4, d3), e56 = _mm256_sub_ps(d5, d6);
+  __m256 m = _mm256_and_ps(PBD_LE(va, zero), _mm256_and_ps(PBD_LE(zero, e43), PBD_LE(zero, e56)));
+  __m256 t = _mm256_div_ps(e43, _mm256_add_ps(e43, e56));
+  v = _mm256_blendv_ps(v, _mm256_sub_ps(one, t), m);
+  w = _mm256_blendv_ps(w, t, m);
+  // edge ac
+  m = _mm256_and_ps(PBD_LE(vb, zero), _mm256_and_ps(PBD_LE(zero, d2), PBD_LE(d6, zero)));
+  t = _mm256_div_ps(d2, _mm256_sub_ps(d2, d6));
+  v = _mm256_blendv_ps(v, zero, m);
+  w = _mm256_blendv_ps(w, t, m);
+  // corner c
+  m = _mm256_and_ps(PBD_LE(zero, d6), PBD_LE(d5, d6));
+  v = _mm256_blendv_ps(v, zero, m);
+  w = _mm256_blendv_ps(w, one, m);
+  // edge ab
+  m = _mm256_and_ps(PBD_LE(vc, zero), _mm256_and_ps(PBD_LE(zero, d1), PBD_LE(d3, zero)));
+  t = _mm256_div_ps(d1, _mm256_sub_ps(d1, d3));
+  v = _mm256_blendv_ps(v, t, m);
+  w = _mm256_blendv_ps(w, zero, m);
+  // corner b
+  m = _mm256_and_ps(PBD_LE(zero, d3), PBD_LE(d4, d3));
+  v = _mm256_blendv_ps(v, one, m);
+  w = _mm256_blendv_ps(w, zero, m);
+  // corner a
+  m = _mm256_and_ps(PBD_LE(d1, zero), PBD_LE(d2, zero));
+  v = _mm256_blendv_ps(v, zero, m);
+  w = _mm256_blendv_ps(w, zero, m);
+
+#undef PBD_LE
+  return madd(madd(a, ab, v), ac, w);
+}
+
+}
+#endif
+
+}
+
+class Bvh {
+public:
+  enum {
+    kLeafSize = 8,              // triangles per leaf, one AVX register
+    kBins = 16,                 // SAH bins per axis
+    kSahDepth = 32,             // deeper, split at the median: depth < 64
+    kMaxDepth = 64
+  };
+
+  // count>0: a leaf, whose triangles are in the slots first..first+count-1;
+  // count=0: an inner node, whose children are the next node and first
+  struct Node {
+    glm::vec3 lo;
+    tUint first;
+    glm::vec3 hi;
+    tUint count;
+  };
+
+  struct Hit {
+    tUint triangle;             // index in the mesh
+    glm::vec3 point;            // closest point
+    glm::vec3 normal;           // unit normal of the triangle (counterclockwise)
+    tReal dist2;                // squared distance
+  };
+
+  void build(const std::vector<glm::vec3> &v, const std::vector<glm::uvec3> &tris)
+  {
+    const tUint nt = static_cast<tUint>(tris.size());
+    _tris = tris;
+    _nodes.clear();
+    _slots.clear();
+    _depth = 0;
+    if(nt==0) { updateLeaves(v); return; }
+
+    std::vector<glm::vec3> lo(nt), hi(nt), centroid(nt);
+    for(tUint t=0; t<nt; ++t) {
+      const glm::vec3 &a = v[tris[t][0]], &b = v[tris[t][1]], &c = v[tris[t][2]];
+      lo[t] = glm::min(a, glm::min(b, c));
+      hi[t] = glm::max(a, glm::max(b, c));
+      centroid[t] = (a + b + c)/3.f;
+    }
+    std::vector<tUint> order(nt);
+    for(tUint t=0; t<nt; ++t) order[t] = t;
+    _nodes.reserve(2*(nt/kLeafSize + 1));
+    _slots.reserve(2*nt + kLeafSize);
+    Builder b = { lo, hi, centroid, order, *this };
+    b.node(0, nt, 0);
+    updateLeaves(v);
+  }
+
+  // the same triangles over the moved vertices v
+  void refit(const std::vector<glm::vec3> &v)
+  {
+    updateLeaves(v);
+  }
+
+  // the triangle closest to p within max_dist; false if none
+  bool closest(const glm::vec3 &p, const tReal max_dist, Hit &hit) const
+  {
+    if(_nodes.empty()) return false;
+    tReal best = max_dist*max_dist;
+    tUint best_slot = kNoSlot;
+    glm::vec3 best_q(0);
+    tUint stack[kMaxDepth + 1];
+    int top = 0;
+    stack[top++] = 0;
+    while(top) {
+      const tUint id = stack[--top];
+      const Node &nd = _nodes[id];
+      if(boxDist2(nd, p)>best) continue;
+      if(nd.count) {
+        leaf(nd, p, best, best_slot, best_q);
+        continue;
+      }
+      // nearer child on top
+      const tUint l = id + 1, r = nd.first;
+      const tReal dl = boxDist2(_nodes[l], p), dr = boxDist2(_nodes[r], p);
+      if(dl<=dr) {
+        if(dr<=best) stack[top++] = r;
+        if(dl<=best) stack[top++] = l;
+      } else {
+        if(dl<=best) stack[top++] = l;
+        if(dr<=best) stack[top++] = r;
+      }
+    }
+    if(best_slot==kNoSlot) return false;
+
+    hit.triangle = _slots[best_slot];
+    hit.point = best_q;
+    hit.dist2 = best;
+    const glm::vec3 a = slotVertex(best_slot, 0);
+    const glm::vec3 nc = glm::cross(slotVertex(best_slot, 1) - a, slotVertex(best_slot, 2) - a);
+    const tReal l = glm::length(nc);
+    hit.normal = l>0 ? nc/l : glm::vec3(0);
+    return true;
+  }
+
+  const std::vector<Node> &nodes() const { return _nodes; }
+  tUint numTriangles() const { return static_cast<tUint>(_tris.size()); }
+  tUint depth() const { return _depth; }
+
+private:
+  enum { kNoSlot = ~0u };
+
+  struct Builder {
+    const std::vector<glm::vec3> &lo, &hi, &centroid;
+    std::vector<tUint> &order;
+    Bvh &bvh;
+
+    struct Bin {
+      glm::vec3 lo = glm::vec3(1e30f), hi = glm::vec3(-1e30f);
+      tUint n = 0;
+    };
+    static tReal area(const glm::vec3 &lo, const glm::vec3 &hi)
+    {
+      const glm::vec3 e = glm::max(hi - lo, glm::vec3(0));
+      return e.x*e.y + e.y*e.z + e.z*e.x;
+    }
+
+    // the subtree of order[b..e), returns its index
+    tUint node(const tUint b, const tUint e, const tUint depth)
+    {
+      const tUint id = static_cast<tUint>(bvh._nodes.size());
+      bvh._nodes.push_back(Node());
+      bvh._depth = std::max(bvh._depth, depth + 1);
+      glm::vec3 clo(1e30f), chi(-1e30f);
+      for(tUint k=b; k<e; ++k) {
+        clo = glm::min(clo, centroid[order[k]]);
+        chi = glm::max(chi, centroid[order[k]]);
+      }
+
+      const tUint n = e - b;
+      if(n<=kLeafSize) {
+        Node &nd = bvh._nodes[id];
+        nd.first = static_cast<tUint>(bvh._slots.size());
+        nd.count = n;
+        for(tUint k=0; k<kLeafSize; ++k) bvh._slots.push_back(k<n ? order[b + k] : kNoSlot);
+        return id;
+      }
+
+      // SAH over the centroid bins of each axis: cost of a split after bin s
+      // = area(left)*#left + area(right)*#right
+      int axis = -1, split = 0;
+      tReal best = 1e30f;
+      const glm::vec3 ext = chi - clo;
+      for(int a=0; a<3 && depth<kSahDepth; ++a) {
+        if(ext[a]<=1e-12f*(1 + std::abs(clo[a]))) continue;
+        const tReal scale = kBins/ext[a];
+        Bin bins[kBins];
+        for(tUint k=b; k<e; ++k) {
+          const tUint t = order[k];
+          Bin &bin = bins[std::min<int>(kBins - 1, static_cast<int>((centroid[t][a] - clo[a])*scale))];
+          bin.lo = glm::min(bin.lo, lo[t]);
+          bin.hi = glm::max(bin.hi, hi[t]);
+          ++bin.n;
+        }
+        tReal left[kBins];
+        Bin acc;
+        for(int s=0; s<kBins - 1; ++s) {
+          acc.lo = glm::min(acc.lo, bins[s].lo);
+          acc.hi = glm::max(acc.hi, bins[s].hi);
+          acc.n += bins[s].n;
+          left[s] = acc.n ? area(acc.lo, acc.hi)*acc.n : 0;
+        }
+        acc = Bin();
+        for(int s=kBins - 1; s>0; --s) {
+          acc.lo = glm::min(acc.lo, bins[s].lo);
+          acc.hi = glm::max(acc.hi, bins[s].hi);
+          acc.n += bins[s].n;
+          const tReal cost = left[s - 1] + (acc.n ? area(acc.lo, acc.hi)*acc.n : 0);
+          if(acc.n && acc.n<n && cost<best) {
+            best = cost;
+            axis = a;
+            split = s;
+          }
+        }
+      }
+
+      tUint mid;
+      if(axis>=0) {
+        const tReal scale = kBins/ext[axis], c0 = clo[axis];
+        const std::vector<glm::vec3> &cen = centroid;
+        const int a = axis, s = split;
+        mid = static_cast<tUint>(std::partition(
+          order.begin() + b, order.begin() + e, [&](const tUint t) {
+            return std::min<int>(kBins - 1, static_cast<int>((cen[t][a] - c0)*scale))<s;
+          }) - order.begin());
+      } else {
+        // no SAH split (too deep, or coincident centroids): the median
+        const int a = ext.x>=ext.y && ext.x>=ext.z ? 0 : ext.y>=ext.z ? 1 : 2;
+        const std::vector<glm::vec3> &cen = centroid;
+        mid = b + n/2;
+        std::nth_element(order.begin() + b, order.begin() + mid, order.begin() + e,
+                         [&](const tUint s, const tUint t) { return cen[s][a]<cen[t][a]; });
+      }
+
+      node(b, mid, depth + 1);
+      const tUint right = node(mid, e, depth + 1);
+      bvh._nodes[id].first = right;
+      bvh._nodes[id].count = 0;
+      return id;
+    }
+  };
+
+  glm::vec3 slotVertex(const tUint s, const int k) const
+  { return glm::vec3(_soa[3*k][s], _soa[3*k + 1][s], _soa[3*k + 2][s]); }
+
+  static tReal boxDist2(const Node &nd, const glm::vec3 &p)
+  {
+    const glm::vec3 d = glm::max(glm::max(nd.lo - p, p - nd.hi), glm::vec3(0));
+    return glm::dot(d, d);
+  }
+
+  // the triangle slots from v, then the boxes: leaves in parallel, inner
+  // nodes backwards, as children come after their parent
+  void updateLeaves(const std::vector<glm::vec3> &v)
+  {
+    const long ns = static_cast<long>(_slots.size());
+    for(int c=0; c<9; ++c) _soa[c].resize(ns);
+#pragma omp parallel for schedule(static) if(ns>=16384)
+    for(long s=0; s<ns; ++s) {
+      // padding repeats the first triangle of the leaf
+      const tUint t = _slots[s]!=kNoSlot ? _slots[s] : _slots[s/kLeafSize*kLeafSize];
+      for(int k=0; k<3; ++k)
+        for(int c=0; c<3; ++c) _soa[3*k + c][s] = v[_tris[t][k]][c];
+    }
+
+    const long nn = static_cast<long>(_nodes.size());
+#pragma omp parallel for schedule(static) if(nn>=4096)
+    for(long i=0; i<nn; ++i) {
+      Node &nd = _nodes[i];
+      if(!nd.count) continue;
+      nd.lo = glm::vec3(1e30f);
+      nd.hi = glm::vec3(-1e30f);
+      for(tUint s=nd.first; s<nd.first + nd.count; ++s)
+        for(int k=0; k<3; ++k) {
+          nd.lo = glm::min(nd.lo, slotVertex(s, k));
+          nd.hi = glm::max(nd.hi, slotVertex(s, k));
+        }
+    }
+    for(long i=nn - 1; i>=0; --i) {
+      Node &nd = _nodes[i];
+      if(nd.count) continue;
+      nd.lo = glm::min(_nodes[i + 1].lo, _nodes[nd.first].lo);
+      nd.hi = glm::max(_nodes[i + 1].hi, _nodes[nd.first].hi);
+    }
+  }
+
+  // the triangles of a leaf closer to p than sqrt(best): updates best, the
+  // slot and the point
+  void leaf(const Node &nd, const glm::vec3 &p, tReal &best, tUint &slot, glm::vec3 &q) const
+  {
+#ifdef PBD_AVX2_DISPATCH
+    if(pbd::simdLevel()==pbd::kSimdAvx2) {
+      leafAvx2(nd, p, best, slot, q);
+      return;
+    }
+#endif
+    for(tUint s=nd.first; s<nd.first + nd.count; ++s) {
+      const glm::vec3 c = pbd::closestPointTriangle(
+        p, slotVertex(s, 0), slotVertex(s, 1), slotVertex(s, 2));
+      const tReal d2 = glm::dot(p - c, p - c);
+      if(d2<best) {
+        best = d2;
+        slot = s;
+        q = c;
+      }
+    }
+  }
+
+#ifdef PBD_AVX2_DISPATCH
+  PBD_TARGET_AVX2 void leafAvx2(
+    const Node &nd, const glm::vec3 &p, tReal &best, tUint &slot, glm::vec3 &q) const
+  {
+    using namespace pbd::avx2;
+    const tUint s = nd.first;
+    V3 tri[3];
+    for(int k=0; k<3; ++k) {
+      tri[k].x = _mm256_load_ps(_soa[3*k].data() + s);
+      tri[k].y = _mm256_load_ps(_soa[3*k + 1].data() + s);
+      tri[k].z = _mm256_load_ps(_soa[3*k + 2].data() + s);
+    }
+    const V3 pv = { _mm256_set1_ps(p.x), _mm256_set1_ps(p.y), _mm256_set1_ps(p.z) };
+    const V3 c = pbd::avx2::closestPointTriangle(pv, tri[0], tri[1], tri[2]);
+    const V3 d = sub(pv, c);
+    const __m256 d2 = dot(d, d);
+    if(!_mm256_movemask_ps(_mm256_cmp_ps(d2, _mm256_set1_ps(best), _CMP_LT_OQ))) return;
+
+    alignas(32) tReal dd[kLeafSize], cx[kLeafSize], cy[kLeafSize], cz[kLeafSize];
+    _mm256_store_ps(dd, d2);
+    _mm256_store_ps(cx, c.x);
+    _mm256_store_ps(cy, c.y);
+    _mm256_store_ps(cz, c.z);
+    for(tUint k=0; k<nd.count; ++k)
+      if(dd[k]<best) {
+        best = dd[k];
+        slot = s + k;
+        q = glm::vec3(cx[k], cy[k], cz[k]);
+      }
+  }
+#endif
+
+  std::vector<glm::uvec3> _tris;
+  std::vector<Node> _nodes;     // depth first; the root first
+  std::vector<tUint> _slots;    // triangle per slot, kLeafSize per leaf
+  ParticleStore::tArray _soa[9]; // per slot: a.xyz, b.xyz, c.xyz
+  tUint _depth = 0;
+};
+
+#endif  /* _BVH_HPP_ */
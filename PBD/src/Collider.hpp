@@ -0,0 +1,86 @@
+// ----------------------------------------------------------------------------
+// Collider.hpp
+//
+// Description: Static or kinematic obstacles of the cloth. A collider answers
+//   one query: the point of its surface closest to a particle, within some
+//   distance, and the outward normal there. Surfaces are one-sided: the front
+//   is the side of the counterclockwise triangle normals, so that a particle
+//   found behind, e.g., pushed through by a fast step, is sent back out
+//   along the face normal. Closed meshes must be oriented outward.
+// ----------------------------------------------------------------------------
+
+#ifndef _COLLIDER_HPP_
+#define _COLLIDER_HPP_
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "typedefs.hpp"
+#include "Mesh.h"
+#include "Bvh.hpp"
+
+class Collider {
+public:
+  virtual ~Collider() {}
+
+  // q: the closest point to p within max_dist, n: the unit outward normal at
+  // q; false if there is none
+  virtual bool closest(const glm::vec3 &p, const tReal max_dist, glm::vec3 &q, glm::vec3 &n) const = 0;
+};
+
+// the triangles of a mesh, e.g., from loadOFF, under a BVH; the mesh is
+// copied, so it may go away
+class MeshCollider : public Collider {
+public:
+  explicit MeshCollider(const Mesh &mesh, const glm::mat4 &transform=glm::mat4(1.0)) :
+    _rest(mesh.vertexPositions())
+  {
+    transformRest(transform);
+    _bvh.build(_v, mesh.triangleIndices());
+  }
+
+  // kinematic: the mesh as given to the constructor, moved by transform; the
+  // BVH is refit
+  void setTransform(const glm::mat4 &transform)
+  {
+    transformRest(transform);
+    _bvh.refit(_v);
+  }
+  // deforming: the current positions of the vertices
+  void setVertices(const std::vector<glm::vec3> &v)
+  {
+    _v = v;
+    _bvh.refit(_v);
+  }
+
+  virtual bool closest(const glm::vec3 &p, const tReal max_dist, glm::vec3 &q, glm::vec3 &n) const
+  {
+    Bvh::Hit hit;
+    if(!_bvh.closest(p, max_dist, hit)) return false;
+    q = hit.point;
+    // in front: away from the surface, smooth around edges and corners;
+    // behind or on it: along the face normal
+    const glm::vec3 d = p - q;
+    const tReal l = glm::length(d);
+    n = hit.normal;
+    if(l>1e-6f*max_dist && (glm::dot(d, n)>0 || n==glm::vec3(0))) n = d/l;
+    return n!=glm::vec3(0);
+  }
+
+  const Bvh &bvh() const { return _bvh; }
+  const std::vector<glm::vec3> &vertexPositions() const { return _v; }
+
+private:
+  void transformRest(const glm::mat4 &m)
+  {
+    _v.resize(_rest.size());
+    for(std::size_t i=0; i<_rest.size(); ++i) _v[i] = glm::vec3(m*glm::vec4(_rest[i], 1.f));
+  }
+
+  std::vector<glm::vec3> _rest; // as given
+  std::vector<glm::vec3> _v;    // current
+  Bvh _bvh;
+};
+
+#endif  /* _COLLIDER_HPP_ */
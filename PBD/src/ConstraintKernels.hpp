@@ -0,0 +1,257 @@
+// ----------------------------------------------------------------------------
+// ConstraintKernels.hpp
+//
+// Description: Batch kernels of the stretch and bend constraints. Within one
+//   color the constraints share no vertex, so 8 of them are projected at once
+//   with AVX2: the particles are gathered, the corrections computed in
+//   registers (1/sqrt with rsqrt and a Newton step, atan with a polynomial)
+//   and scattered back. The remainder of a batch goes through project().
+//   The instruction set is checked at run time, independently of the flags
+//   the rest of the code is compiled with; setSimdLevel() forces the scalar
+//   path, e.g., to compare both.
+//   Both paths round differently (FMA, rsqrt, the atan polynomial), so they
+//   agree to rounding, not bitwise: bench_kernels checks 1e-5 of the
+//   correction for stretch and 1e-4 for bend, whose gradients cancel down to
+//   the dihedral angle near flat. Hinges that can only move on one side are
+//   ill-conditioned in float and both paths may be off by a few percent; a
+//   hinge within rounding of the flat cut-off may be skipped by one path only.
+// ----------------------------------------------------------------------------
+
+#ifndef _CONSTRAINTKERNELS_HPP_
+#define _CONSTRAINTKERNELS_HPP_
+
+#include <algorithm>
+
+#include "typedefs.hpp"
+#include "ParticleStore.hpp"
+#include "ConstraintSet.hpp"
+#include "Constraints.hpp"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PBD_AVX2_DISPATCH
+#define PBD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+namespace pbd {
+
+enum SimdLevel { kSimdScalar = 0, kSimdAvx2 = 1 };
+
+// best level the CPU supports
+inline SimdLevel detectSimdLevel()
+{
+#ifdef PBD_AVX2_DISPATCH
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return kSimdAvx2;
+#endif
+  return kSimdScalar;
+}
+
+namespace detail {
+inline SimdLevel &simdLevel() { static SimdLevel l = detectSimdLevel(); return l; }
+}
+
+inline SimdLevel simdLevel() { return detail::simdLevel(); }
+// clamped to what the CPU supports
+inline void setSimdLevel(const SimdLevel l) { detail::simdLevel() = std::min(l, detectSimdLevel()); }
+
+#ifdef PBD_AVX2_DISPATCH
+namespace avx2 {
+
+struct V3 { __m256 x, y, z; };
+
+PBD_TARGET_AVX2 inline V3 sub(const V3 &a, const V3 &b)
+{ V3 r = { _mm256_sub_ps(a.x, b.x), _mm256_sub_ps(a.y, b.y), _mm256_sub_ps(a.z, b.z) }; return r; }
+PBD_TARGET_AVX2 inline V3 mul(const V3 &a, const __m256 s)
+{ V3 r = { _mm256_mul_ps(a.x, s), _mm256_mul_ps(a.y, s), _mm256_mul_ps(a.z, s) }; return r; }
+// a + b*s
+PBD_TARGET_AVX2 inline V3 madd(const V3 &a, const V3 &b, const __m256 s)
+{
+  V3 r = { _mm256_fmadd_ps(b.x, s, a.x), _mm256_fmadd_ps(b.y, s, a.y), _mm256_fmadd_ps(b.z, s, a.z) };
+  return r;
+}
+PBD_TARGET_AVX2 inline __m256 dot(const V3 &a, const V3 &b)
+{ return _mm256_fmadd_ps(a.x, b.x, _mm256_fmadd_ps(a.y, b.y, _mm256_mul_ps(a.z, b.z))); }
+PBD_TARGET_AVX2 inline V3 cross(const V3 &a, const V3 &b)
+{
+  V3 r = {
+    _mm256_fmsub_ps(a.y, b.z, _mm256_mul_ps(a.z, b.y)),
+    _mm256_fmsub_ps(a.z, b.x, _mm256_mul_ps(a.x, b.z)),
+    _mm256_fmsub_ps(a.x, b.y, _mm256_mul_ps(a.y, b.x)) };
+  return r;
+}
+
+// 1/sqrt(a), rsqrt refined by one Newton step
+PBD_TARGET_AVX2 inline __m256 rsqrt(const __m256 a)
+{
+  const __m256 r = _mm256_rsqrt_ps(a);
+  const __m256 arr = _mm256_mul_ps(_mm256_mul_ps(a, r), r);
+  return _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), r), _mm256_sub_ps(_mm256_set1_ps(3.f), arr));
+}
+
+// atan2(y, x) on [0, pi] for y >= 0; atan on [0, 1] with the minimax
+// polynomial of SLEEF's atanf, relative error <= 1.3e-7
+PBD_TARGET_AVX2 inline __m256 atan2(const __m256 y, const __m256 x)
+{
+  const __m256 ax = _mm256_andnot_ps(_mm256_set1_ps(-0.f), x);
+  const __m256 t = _mm256_div_ps(
+    _mm256_min_ps(y, ax), _mm256_max_ps(_mm256_max_ps(y, ax), _mm256_set1_ps(1e-30f)));
+  const __m256 t2 = _mm256_mul_ps(t, t);
+  __m256 p = _mm256_set1_ps(0.00282363896f);
+  p = _mm256_fmadd_ps(p, t2, _mm256_set1_ps(-0.0159569029f));
+  p = _mm256_fmadd_ps(p, t2, _mm256_set1_ps(0.0425049886f));
+  p = _mm256_fmadd_ps(p, t2, _mm256_set1_ps(-0.0748900920f));
+  p = _mm256_fmadd_ps(p, t2, _mm256_set1_ps(0.106347933f));
+  p = _mm256_fmadd_ps(p, t2, _mm256_set1_ps(-0.142027363f));
+  p = _mm256_fmadd_ps(p, t2, _mm256_set1_ps(0.199926957f));
+  p = _mm256_fmadd_ps(p, t2, _mm256_set1_ps(-0.333331019f));
+  __m256 r = _mm256_fmadd_ps(_mm256_mul_ps(t, t2), p, t);
+  // atan(1/t) = pi/2 - atan(t), atan2(y, -x) = pi - atan2(y, x)
+  r = _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(1.57079633f), r),
+                       _mm256_cmp_ps(y, ax, _CMP_GT_OQ));
+  return _mm256_blendv_ps(r, _mm256_sub_ps(_mm256_set1_ps(3.14159265f), r),
+                          _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+}
+
+// hardware gathers are slow on several cores; 8 loads per component
+PBD_TARGET_AVX2 inline __m256 gather(const tReal *a, const tUint *i)
+{ return _mm256_setr_ps(a[i[0]], a[i[1]], a[i[2]], a[i[3]], a[i[4]], a[i[5]], a[i[6]], a[i[7]]); }
+PBD_TARGET_AVX2 inline V3 gather(const ParticleStore &x, const tUint *i)
+{
+  V3 r = { gather(x.data(0), i), gather(x.data(1), i), gather(x.data(2), i) };
+  return r;
+}
+
+// the indices are distinct within a batch
+PBD_TARGET_AVX2 inline void scatter(ParticleStore &x, const tUint *i, const V3 &v)
+{
+  alignas(32) tReal c[3][8];
+  _mm256_store_ps(c[0], v.x);
+  _mm256_store_ps(c[1], v.y);
+  _mm256_store_ps(c[2], v.z);
+  tReal *px = x.data(0), *py = x.data(1), *pz = x.data(2);
+  for(int k=0; k<8; ++k) {
+    px[i[k]] = c[0][k];
+    py[i[k]] = c[1][k];
+    pz[i[k]] = c[2][k];
+  }
+}
+
+// n a multiple of 8
+PBD_TARGET_AVX2 inline void projectStretch(
+  const ConstraintStretch *cs, const tUint n, ParticleStore &x, const tMassInv &w)
+{
+  alignas(32) tUint vi[8], vj[8];
+  alignas(32) tReal vd[8], vk[8];
+  for(tUint b=0; b<n; b+=8) {
+    for(int l=0; l<8; ++l) {
+      const ConstraintStretch &c = cs[b + l];
+      vi[l] = c._i; vj[l] = c._j; vd[l] = c._d; vk[l] = c._k;
+    }
+    const __m256 d = _mm256_load_ps(vd), k = _mm256_load_ps(vk);
+    const __m256 wi = gather(w.data(), vi), wj = gather(w.data(), vj);
+    const V3 pi = gather(x, vi), pj = gather(x, vj);
+
+    const V3 e = sub(pi, pj);
+    const __m256 l2 = dot(e, e), r = rsqrt(l2), ws = _mm256_add_ps(wi, wj);
+    // k*(l - d)/(l*ws), zero where ws<=0 or l<=0 as in project()
+    const __m256 valid = _mm256_and_ps(
+      _mm256_cmp_ps(ws, _mm256_setzero_ps(), _CMP_GT_OQ),
+      _mm256_cmp_ps(l2, _mm256_setzero_ps(), _CMP_GT_OQ));
+    const __m256 s = _mm256_and_ps(valid, _mm256_div_ps(
+      _mm256_mul_ps(_mm256_mul_ps(k, _mm256_fmsub_ps(l2, r, d)), r), ws));
+    const V3 dp = mul(e, s);
+
+    scatter(x, vi, madd(pi, dp, _mm256_sub_ps(_mm256_setzero_ps(), wi)));
+    scatter(x, vj, madd(pj, dp, wj));
+  }
+}
+
+// n a multiple of 8
+PBD_TARGET_AVX2 inline void projectBend(
+  const ConstraintBend *cs, const tUint n, ParticleStore &x, const tMassInv &w)
+{
+  const __m256 zero = _mm256_setzero_ps();
+  alignas(32) tUint i1[8], i2[8], i3[8], i4[8];
+  alignas(32) tReal vphi[8], vk[8];
+  for(tUint b=0; b<n; b+=8) {
+    for(int l=0; l<8; ++l) {
+      const ConstraintBend &c = cs[b + l];
+      i1[l] = c._i1; i2[l] = c._i2; i3[l] = c._i3; i4[l] = c._i4;
+      vphi[l] = c._phi; vk[l] = c._k;
+    }
+    const __m256 phi = _mm256_load_ps(vphi), k = _mm256_load_ps(vk);
+    const V3 x1 = gather(x, i1), x2 = gather(x, i2), x3 = gather(x, i3), x4 = gather(x, i4);
+    const V3 p2 = sub(x2, x1), p3 = sub(x3, x1), p4 = sub(x4, x1);
+
+    const V3 c23 = cross(p2, p3), c24 = cross(p2, p4);
+    const __m256 l23sq = dot(c23, c23), l24sq = dot(c24, c24);
+    __m256 valid = _mm256_and_ps(
+      _mm256_cmp_ps(l23sq, _mm256_set1_ps(1e-24f), _CMP_GT_OQ),
+      _mm256_cmp_ps(l24sq, _mm256_set1_ps(1e-24f), _CMP_GT_OQ));
+    // zero in the degenerate lanes rather than infinite, so that s = 0 leaves
+    // them in place
+    const __m256 r23 = _mm256_and_ps(valid, rsqrt(l23sq)), r24 = _mm256_and_ps(valid, rsqrt(l24sq));
+    const V3 n1 = mul(c23, r23), n2 = mul(c24, r24);
+    const V3 c12 = cross(n1, n2);
+    const __m256 d = dot(n1, n2), sn2 = dot(c12, c12), sn = _mm256_sqrt_ps(sn2);
+
+    const V3 q3 = mul(madd(cross(p2, n2), cross(n1, p2), d), r23);
+    const V3 q4 = mul(madd(cross(p2, n1), cross(n2, p2), d), r24);
+    const V3 q2 = sub(mul(madd(cross(p3, n2), cross(n1, p3), d), _mm256_sub_ps(zero, r23)),
+                      mul(madd(cross(p4, n1), cross(n2, p4), d), r24));
+    const V3 q1 = sub(sub(sub(V3{ zero, zero, zero }, q2), q3), q4);
+
+    const __m256 w1 = gather(w.data(), i1), w2 = gather(w.data(), i2);
+    const __m256 w3 = gather(w.data(), i3), w4 = gather(w.data(), i4);
+    const __m256 sum = _mm256_fmadd_ps(w1, dot(q1, q1), _mm256_fmadd_ps(w2, dot(q2, q2),
+                       _mm256_fmadd_ps(w3, dot(q3, q3), _mm256_mul_ps(w4, dot(q4, q4)))));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(sum, _mm256_set1_ps(1e-12f), _CMP_GT_OQ));
+    // nearly flat, as in ConstraintBend
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(sn2, _mm256_set1_ps(1e-5f), _CMP_GT_OQ));
+
+    // -k*sin*(atan2(sin, d) - phi)/sum
+    const __m256 s = _mm256_and_ps(valid, _mm256_div_ps(
+      _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(zero, k), sn), _mm256_sub_ps(atan2(sn, d), phi)), sum));
+
+    scatter(x, i1, madd(x1, q1, _mm256_mul_ps(s, w1)));
+    scatter(x, i2, madd(x2, q2, _mm256_mul_ps(s, w2)));
+    scatter(x, i3, madd(x3, q3, _mm256_mul_ps(s, w3)));
+    scatter(x, i4, madd(x4, q4, _mm256_mul_ps(s, w4)));
+  }
+}
+
+}
+#endif
+
+}
+
+// batch overloads picked by ConstraintSet
+
+inline void projectBatch(
+  const ConstraintStretch *cs, const tUint n, ParticleStore &x, const tMassInv &w)
+{
+  tUint done = 0;
+#ifdef PBD_AVX2_DISPATCH
+  if(pbd::simdLevel()==pbd::kSimdAvx2) {
+    done = n/8*8;
+    pbd::avx2::projectStretch(cs, done, x, w);
+  }
+#endif
+  projectSerial(cs + done, n - done, x, w);
+}
+
+inline void projectBatch(
+  const ConstraintBend *cs, const tUint n, ParticleStore &x, const tMassInv &w)
+{
+  tUint done = 0;
+#ifdef PBD_AVX2_DISPATCH
+  if(pbd::simdLevel()==pbd::kSimdAvx2) {
+    done = n/8*8;
+    pbd::avx2::projectBend(cs, done, x, w);
+  }
+#endif
+  projectSerial(cs + done, n - done, x, w);
+}
+
+#endif  /* _CONSTRAINTKERNELS_HPP_ */
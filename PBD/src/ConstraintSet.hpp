@@ -0,0 +1,389 @@
+// ----------------------------------------------------------------------------
+// ConstraintSet.hpp
+//
+// Description: Contiguous storage of PBD constraints, one array per kind.
+//   A kind is a plain struct with
+//
+//     enum { kArity = <number of vertices> };
+//     tUint vertex(const int k) const;      // k-th vertex, k < kArity
+//     void project(ParticleStore &x, const tMassInv &w) const;
+//     void projectXpbd(ParticleStore &x, const tMassInv &w, tReal inv_dt2);
+//     void resetLambda();
+//     bool jacobi(const ParticleStore &x, const tMassInv &w,
+//                 glm::vec3 dp[]) const;  // corrections of the vertices
+//     static const char *name();
+//
+//   and is registered by listing it in the ConstraintSet parameters. The
+//   arrays are projected one after the other, in that order.
+//
+//   color() sorts every array into colors, i.e., groups of constraints that
+//   share no vertex, with a greedy first-fit coloring. The constraints of a
+//   color are then projected in parallel, with a barrier between colors;
+//   the result does not depend on the thread count. The coloring is kept
+//   until a constraint is added. Each thread hands its part of a color to
+//   projectBatch(), which a kind may overload with a dedicated kernel;
+//   constraints that are not colored are projected one by one.
+//
+//   accumulate() runs a Jacobi iteration without coloring: each constraint
+//   writes its corrections to slots of its own, and each particle then sums
+//   its slots in array order through a vertex-to-slot table (CSR), so that
+//   this result does not depend on the thread count either.
+// ----------------------------------------------------------------------------
+
+#ifndef _CONSTRAINTSET_HPP_
+#define _CONSTRAINTSET_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <tuple>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "typedefs.hpp"
+#include "ParticleStore.hpp"
+
+typedef ParticleStore::tArray tMassInv;
+
+// n constraints in order
+template<typename C>
+inline void projectSerial(const C *cs, const tUint n, ParticleStore &x, const tMassInv &w)
+{
+  for(tUint k=0; k<n; ++k) cs[k].project(x, w);
+}
+
+// default batch kernel; the n constraints share no vertex, so they may be
+// projected in any order
+template<typename C>
+inline void projectBatch(const C *cs, const tUint n, ParticleStore &x, const tMassInv &w)
+{
+  projectSerial(cs, n, x, w);
+}
+
+namespace pbd_detail {
+
+// index of T in Ts...
+template<typename T, typename... Ts> struct IndexOf;
+template<typename T, typename... Ts>
+struct IndexOf<T, T, Ts...> { enum { value = 0 }; };
+template<typename T, typename U, typename... Ts>
+struct IndexOf<T, U, Ts...> { enum { value = 1 + IndexOf<T, Ts...>::value }; };
+
+// f(std::get<I>(t)) for I = N, ..., size-1
+template<int N, int Size>
+struct ForEach {
+  template<typename Tuple, typename F>
+  static void apply(Tuple &t, F &f) { f(std::get<N>(t)); ForEach<N+1, Size>::apply(t, f); }
+};
+template<int Size>
+struct ForEach<Size, Size> {
+  template<typename Tuple, typename F>
+  static void apply(Tuple &, F &) {}
+};
+
+inline int threadId() {
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+inline int numThreads() {
+#ifdef _OPENMP
+  return omp_get_num_threads();
+#else
+  return 1;
+#endif
+}
+
+}
+
+// constraints of one kind; colors[c] to colors[c+1] is color c, and
+// constraints from colors.back() on could not be colored and run serially;
+// slotStart[i] to slotStart[i+1] are the slots k*kArity + v of vertex i,
+// i.e., the v-th vertex of items[k]
+template<typename C>
+struct ConstraintArray {
+  std::vector<C> items;
+  std::vector<tUint> colors;
+  std::vector<tUint> slotStart, slots;
+
+  bool colored() const { return !colors.empty(); }
+  tUint numColors() const { return colored() ? static_cast<tUint>(colors.size()) - 1 : 0; }
+};
+
+template<typename... Kinds>
+class ConstraintSet {
+public:
+  enum {
+    kKinds = sizeof...(Kinds),
+    kMaxColors = 64,            // per kind; one bit per color and vertex
+    kBatch = 8,                 // thread chunks start at multiples of kBatch
+    kParallelMin = 4096         // fewer constraints are projected serially
+  };
+
+  template<typename C> const std::vector<C> &get() const { return array<C>().items; }
+  template<typename C> void add(const C &c) {
+    ConstraintArray<C> &a = array<C>();
+    a.items.push_back(c);
+    a.colors.clear();
+    a.slotStart.clear();
+  }
+
+  // (re)colors the arrays that changed since the last call; n_vertices
+  // bounds the vertex indices
+  void color(const tUint n_vertices) {
+    Color f = { n_vertices };
+    pbd_detail::ForEach<0, kKinds>::apply(_arrays, f);
+  }
+
+  // one PBD iteration
+  void project(ParticleStore &x, const tMassInv &w) const {
+#pragma omp parallel if(size()>=kParallelMin)
+    {
+      Project<PbdOp> f = { x, w, PbdOp() };
+      pbd_detail::ForEach<0, kKinds>::apply(_arrays, f);
+    }
+  }
+
+  // one XPBD iteration of a (sub)step of length dt; the Lagrange multipliers
+  // accumulate until resetLambdas()
+  void projectXpbd(ParticleStore &x, const tMassInv &w, const tReal dt) {
+    const XpbdOp op = { 1/(dt*dt) };
+#pragma omp parallel if(size()>=kParallelMin)
+    {
+      Project<XpbdOp> f = { x, w, op };
+      pbd_detail::ForEach<0, kKinds>::apply(_arrays, f);
+    }
+  }
+  void resetLambdas() {
+    ResetLambdas f;
+    pbd_detail::ForEach<0, kKinds>::apply(_arrays, f);
+  }
+
+  // one Jacobi iteration: the corrections of all constraints at x, added to
+  // dx; per kind, each particle gets the mean of the corrections of the
+  // constraints that produced one, so that satisfied, nearly flat or
+  // degenerate ones do not count, and the many bends of a vertex do not
+  // dilute its stretches
+  void accumulate(const ParticleStore &x, const tMassInv &w, ParticleStore &dx) {
+    Index g = { x.size(), 0 };
+    pbd_detail::ForEach<0, kKinds>::apply(_arrays, g);
+    if(_slots.size()<g.slots) _slots.resize(g.slots);
+#pragma omp parallel if(size()>=kParallelMin)
+    {
+      Accumulate f = { x, w, dx, _slots.data() };
+      pbd_detail::ForEach<0, kKinds>::apply(_arrays, f);
+    }
+  }
+
+  // all constraints of kind C
+  template<typename C> void clear() {
+    ConstraintArray<C> &a = array<C>();
+    a.items.clear();
+    a.colors.clear();
+    a.slotStart.clear();
+  }
+  void clear() {
+    Clear f;
+    pbd_detail::ForEach<0, kKinds>::apply(_arrays, f);
+  }
+  tUint size() const {
+    Count f = { 0 };
+    pbd_detail::ForEach<0, kKinds>::apply(_arrays, f);
+    return f.n;
+  }
+
+  // colors per kind and the load balance of the colors over `threads`, i.e.,
+  // the parallel efficiency bound that the barriers leave
+  void reportColoring(std::ostream &out, const int threads) const {
+    Report f = { out, threads };
+    pbd_detail::ForEach<0, kKinds>::apply(_arrays, f);
+  }
+
+private:
+  template<typename C> ConstraintArray<C> &array() {
+    return std::get<pbd_detail::IndexOf<C, Kinds...>::value>(_arrays);
+  }
+  template<typename C> const ConstraintArray<C> &array() const {
+    return std::get<pbd_detail::IndexOf<C, Kinds...>::value>(_arrays);
+  }
+
+  // greedy first-fit in array order, then a stable sort by color, so the
+  // result is deterministic
+  struct Color {
+    tUint nv;
+    template<typename C> void operator()(ConstraintArray<C> &a) {
+      if(a.colored()) return;
+      std::vector<std::uint64_t> used(nv, 0);
+      std::vector<int> col(a.items.size());
+      std::vector<tUint> count(kMaxColors + 1, 0);
+      for(std::size_t k=0; k<a.items.size(); ++k) {
+        std::uint64_t m = 0;
+        for(int v=0; v<C::kArity; ++v) m |= used[a.items[k].vertex(v)];
+        int c = 0;
+        while(c<kMaxColors && ((m >> c) & 1)) ++c;
+        if(c<kMaxColors)
+          for(int v=0; v<C::kArity; ++v) used[a.items[k].vertex(v)] |= std::uint64_t(1) << c;
+        col[k] = c;             // kMaxColors: serial leftovers
+        ++count[c];
+      }
+
+      int nc = 0;
+      for(int c=0; c<kMaxColors; ++c) if(count[c]) nc = c + 1;
+      a.colors.assign(1, 0);
+      for(int c=0; c<nc; ++c) a.colors.push_back(a.colors.back() + count[c]);
+
+      std::vector<tUint> at(a.colors); // at.back(): leftovers after the last color
+      std::vector<C> sorted(a.items);
+      for(std::size_t k=0; k<a.items.size(); ++k)
+        sorted[col[k]<nc ? at[col[k]]++ : at.back()++] = a.items[k];
+      a.items.swap(sorted);
+      a.slotStart.clear();
+    }
+  };
+
+  // the vertex-to-slot tables of the arrays that changed, by counting; slots:
+  // the most any array needs
+  struct Index {
+    tUint nv;
+    std::size_t slots;
+    template<typename C> void operator()(ConstraintArray<C> &a) {
+      const tUint m = static_cast<tUint>(a.items.size())*C::kArity;
+      slots = std::max<std::size_t>(slots, m);
+      if(a.slotStart.size()==nv + 1) return;
+      a.slotStart.assign(nv + 1, 0);
+      for(const C &c : a.items)
+        for(int v=0; v<C::kArity; ++v) ++a.slotStart[c.vertex(v) + 1];
+      for(tUint i=0; i<nv; ++i) a.slotStart[i + 1] += a.slotStart[i];
+      a.slots.resize(m);
+      std::vector<tUint> fill(a.slotStart.begin(), a.slotStart.end() - 1);
+      for(tUint s=0; s<m; ++s) a.slots[fill[a.items[s/C::kArity].vertex(s%C::kArity)]++] = s;
+    }
+  };
+
+  // the constraint updates of project() and projectXpbd()
+  struct PbdOp {
+    template<typename C>
+    void batch(const C *cs, const tUint n, ParticleStore &x, const tMassInv &w) const
+    { projectBatch(cs, n, x, w); }
+    template<typename C>
+    void serial(const C *cs, const tUint n, ParticleStore &x, const tMassInv &w) const
+    { projectSerial(cs, n, x, w); }
+  };
+  struct XpbdOp {
+    tReal inv_dt2;
+    template<typename C>
+    void batch(C *cs, const tUint n, ParticleStore &x, const tMassInv &w) const
+    { serial(cs, n, x, w); }
+    template<typename C>
+    void serial(C *cs, const tUint n, ParticleStore &x, const tMassInv &w) const
+    { for(tUint k=0; k<n; ++k) cs[k].projectXpbd(x, w, inv_dt2); }
+  };
+
+  template<typename Op>
+  struct Project {
+    ParticleStore &x;
+    const tMassInv &w;
+    Op op;
+    template<typename A> void operator()(A &a) {
+      const int tid = pbd_detail::threadId(), nt = pbd_detail::numThreads();
+      if(!a.colored()) {
+#pragma omp single
+        op.serial(a.items.data(), static_cast<tUint>(a.items.size()), x, w);
+        return;
+      }
+      for(tUint c=0; c<a.numColors(); ++c) {
+        // the batch kernels see the same groups of kBatch on any thread count
+        const tUint n = a.colors[c+1] - a.colors[c], nb = (n + kBatch - 1)/kBatch;
+        const tUint lo = a.colors[c] + std::min(nb*tid/nt*kBatch, n);
+        const tUint hi = a.colors[c] + std::min(nb*(tid+1)/nt*kBatch, n);
+        op.batch(a.items.data() + lo, hi - lo, x, w);
+#pragma omp barrier
+      }
+      const tUint rest = static_cast<tUint>(a.items.size()) - a.colors.back();
+      if(rest) {
+#pragma omp single
+        op.serial(a.items.data() + a.colors.back(), rest, x, w);
+      }
+    }
+  };
+
+  // slot: the correction, and 1 if the constraint produced one
+  struct Accumulate {
+    const ParticleStore &x;
+    const tMassInv &w;
+    ParticleStore &dx;
+    glm::vec4 *slots;
+    template<typename C> void operator()(const ConstraintArray<C> &a) {
+      const long n = static_cast<long>(a.items.size());
+      if(!n) return;
+#pragma omp for schedule(static)
+      for(long k=0; k<n; ++k) {
+        glm::vec3 dp[C::kArity];
+        glm::vec4 *s = slots + k*C::kArity;
+        if(a.items[k].jacobi(x, w, dp))
+          for(int v=0; v<C::kArity; ++v) s[v] = glm::vec4(dp[v], 1);
+        else
+          for(int v=0; v<C::kArity; ++v) s[v] = glm::vec4(0);
+      }
+
+      const long nv = static_cast<long>(x.size());
+      tReal *d[3] = { dx.data(0), dx.data(1), dx.data(2) };
+#pragma omp for schedule(static)
+      for(long i=0; i<nv; ++i) {
+        glm::vec4 sum(0);
+        for(tUint k=a.slotStart[i]; k<a.slotStart[i + 1]; ++k) sum += slots[a.slots[k]];
+        if(sum.w>0)
+          for(int c=0; c<3; ++c) d[c][i] += sum[c]/sum.w;
+      }
+    }
+  };
+  struct ResetLambdas {
+    template<typename C> void operator()(ConstraintArray<C> &a) {
+      for(C &c : a.items) c.resetLambda();
+    }
+  };
+  struct Clear {
+    template<typename C> void operator()(ConstraintArray<C> &a) {
+      a.items.clear();
+      a.colors.clear();
+      a.slotStart.clear();
+    }
+  };
+  struct Count {
+    tUint n;
+    template<typename C> void operator()(const ConstraintArray<C> &a) { n += a.items.size(); }
+  };
+  struct Report {
+    std::ostream &out;
+    int threads;
+    template<typename C> void operator()(const ConstraintArray<C> &a) {
+      tUint slots = 0;
+      for(tUint c=0; c<a.numColors(); ++c) {
+        const tUint n = a.colors[c+1] - a.colors[c];
+        slots += (n + threads - 1)/threads*threads;
+      }
+      const tUint colored = a.colored() ? a.colors.back() : 0;
+      out << "> " << std::setw(8) << C::name() << ": " << std::setw(8) << a.items.size()
+          << " constraints in " << std::setw(3) << a.numColors() << " colors";
+      if(a.items.size()>colored) out << " (+" << a.items.size() - colored << " serial)";
+      if(slots) {
+        const std::streamsize prec = out.precision();
+        out << ", balance " << std::fixed << std::setprecision(1)
+            << 100.0*colored/slots << "% on " << threads << " threads"
+            << std::defaultfloat << std::setprecision(prec);
+      }
+      out << std::endl;
+    }
+  };
+
+  std::tuple<ConstraintArray<Kinds>...> _arrays;
+  std::vector<glm::vec4> _slots;        // accumulate() scratch
+};
+
+#endif  /* _CONSTRAINTSET_HPP_ */
@@ -0,0 +1,387 @@
+// ----------------------------------------------------------------------------
+// Constraints.hpp
+//
+// Description: PBD constraint kinds. Each is stored by value in its own array
+//   of a ConstraintSet and projected by a non-virtual member; see
+//   ConstraintKernels.hpp for the batch kernels. project() is the PBD update
+//   with stiffness _k in [0, 1]; projectXpbd() the XPBD one, with compliance
+//   _alpha (inverse stiffness, in physical units) and the Lagrange
+//   multiplier _lambda accumulated since the last resetLambda(). jacobi()
+//   returns the PBD corrections of the vertices instead of applying them,
+//   or false if there are none. The contact kinds are inequalities, rebuilt
+//   every step (collider contacts: every substep), and act fully (no
+//   stiffness or compliance).
+// ----------------------------------------------------------------------------
+
+#ifndef _CONSTRAINTS_HPP_
+#define _CONSTRAINTS_HPP_
+
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "typedefs.hpp"
+#include "ParticleStore.hpp"
+#include "ConstraintSet.hpp"
+
+struct ConstraintAttach {
+  explicit ConstraintAttach(const tUint i, const glm::vec3 &p) :
+    _i(i), _p(p) {}
+
+  enum { kArity = 1 };
+  tUint vertex(const int) const { return _i; }
+  static const char *name() { return "attach"; }
+
+  void project(ParticleStore &x, const tMassInv &) const
+  { x.set(_i, _p); }
+  void projectXpbd(ParticleStore &x, const tMassInv &w, const tReal)
+  { project(x, w); }
+  bool jacobi(const ParticleStore &x, const tMassInv &, glm::vec3 dp[]) const
+  {
+    dp[0] = _p - x.get(_i);
+    return true;
+  }
+  void resetLambda() {}
+
+  tUint _i;                     // vertex id
+  glm::vec3 _p;                 // fixed position
+};
+
+struct ConstraintStretch {
+  explicit ConstraintStretch(
+    const tUint i, const tUint j, const tReal d, const tReal k, const tReal alpha=0) :
+    _i(i), _j(j), _d(d), _k(k), _alpha(alpha), _lambda(0) {}
+
+  enum { kArity = 2 };
+  tUint vertex(const int k) const { return k ? _j : _i; }
+  static const char *name() { return "stretch"; }
+
+  void project(ParticleStore &x, const tMassInv &w) const
+  {
+    glm::vec3 dp;
+    if(!correction(x, w, dp)) return;
+    x.set(_i, x.get(_i) - w[_i]*dp);
+    x.set(_j, x.get(_j) + w[_j]*dp);
+  }
+
+  bool jacobi(const ParticleStore &x, const tMassInv &w, glm::vec3 dp[]) const
+  {
+    glm::vec3 d;
+    if(!correction(x, w, d)) return false;
+    dp[0] = -w[_i]*d;
+    dp[1] = w[_j]*d;
+    return true;
+  }
+
+  // inv_dt2: 1/dt^2 of the (sub)step
+  void projectXpbd(ParticleStore &x, const tMassInv &w, const tReal inv_dt2)
+  {
+    const tReal ws = w[_i] + w[_j];
+    if(ws<=0) return;
+    const glm::vec3 pi = x.get(_i), pj = x.get(_j);
+    const glm::vec3 e = pi - pj;
+    const tReal l = glm::length(e);
+    if(l<=0) return;
+    const tReal at = _alpha*inv_dt2;
+    const tReal dl = (_d - l - at*_lambda)/(ws + at);
+    _lambda += dl;
+    const glm::vec3 dp = (dl/l)*e;
+    x.set(_i, pi + w[_i]*dp);
+    x.set(_j, pj - w[_j]*dp);
+  }
+  void resetLambda() { _lambda = 0; }
+
+  tUint _i, _j;                 // indices of two vertices
+  tReal _d;                     // initial length
+  tReal _k;                     // stiffness
+  tReal _alpha;                 // compliance
+  tReal _lambda;                // Lagrange multiplier
+
+private:
+  // the PBD correction, -dp/w for _i and dp/w for _j; false if none
+  bool correction(const ParticleStore &x, const tMassInv &w, glm::vec3 &dp) const
+  {
+    const tReal ws = w[_i] + w[_j];
+    if(ws<=0) return false;
+    const glm::vec3 e = x.get(_i) - x.get(_j);
+    const tReal l = glm::length(e);
+    if(l<=0) return false;
+    dp = (_k*(l - _d)/(l*ws))*e;
+    return true;
+  }
+};
+
+struct ConstraintBend {
+  explicit ConstraintBend(
+    const tUint i1, const tUint i2, const tUint i3, const tUint i4,
+    const tReal phi, const tReal k, const tReal alpha=0) :
+    _i1(i1), _i2(i2), _i3(i3), _i4(i4), _phi(phi), _k(k), _alpha(alpha), _lambda(0) {}
+
+  enum { kArity = 4 };
+  tUint vertex(const int k) const { return k==0 ? _i1 : k==1 ? _i2 : k==2 ? _i3 : _i4; }
+  static const char *name() { return "bend"; }
+
+  // dihedral angle between (p1, p2, p3) and (p1, p2, p4), as in the PBD paper;
+  // from its sine and cosine, since acos loses most digits near flat
+  static tReal angle(
+    const glm::vec3 &p1, const glm::vec3 &p2, const glm::vec3 &p3, const glm::vec3 &p4)
+  {
+    const glm::vec3 n1 = glm::normalize(glm::cross(p2 - p1, p3 - p1));
+    const glm::vec3 n2 = glm::normalize(glm::cross(p2 - p1, p4 - p1));
+    return std::atan2(glm::length(glm::cross(n1, n2)), glm::dot(n1, n2));
+  }
+
+  // Mueller et al. 2007, appendix A
+  void project(ParticleStore &x, const tMassInv &w) const
+  {
+    glm::vec3 q[4];
+    tReal s;
+    if(correction(x, w, q, s)) apply(x, w, q, s);
+  }
+
+  bool jacobi(const ParticleStore &x, const tMassInv &w, glm::vec3 dp[]) const
+  {
+    glm::vec3 q[4];
+    tReal s;
+    if(!correction(x, w, q, s)) return false;
+    for(int k=0; k<4; ++k) dp[k] = s*w[vertex(k)]*q[k];
+    return true;
+  }
+
+  // with C = acos(d) - phi and grad C = q/sin in the sign convention of the
+  // paper; written so as not to divide by sin
+  void projectXpbd(ParticleStore &x, const tMassInv &w, const tReal inv_dt2)
+  {
+    glm::vec3 q[4];
+    tReal d, sn;
+    if(!gradients(x, q, d, sn)) return;
+    const tReal sum = w[_i1]*glm::dot(q[0], q[0]) + w[_i2]*glm::dot(q[1], q[1]) +
+      w[_i3]*glm::dot(q[2], q[2]) + w[_i4]*glm::dot(q[3], q[3]);
+    if(sum<=1e-12f) return;
+    const tReal s2 = sn*sn, at = _alpha*inv_dt2;
+    const tReal r = (_phi - std::atan2(sn, d) - at*_lambda)/(sum + at*s2);
+    _lambda += r*s2;
+    apply(x, w, q, r*sn);
+  }
+  void resetLambda() { _lambda = 0; }
+
+  tUint _i1, _i2, _i3, _i4; // indices of vertices forming two adjacent triangles
+  tReal _phi;               // initial angle
+  tReal _k;                 // stiffness
+  tReal _alpha;             // compliance
+  tReal _lambda;            // Lagrange multiplier
+
+private:
+  // q: gradients of d, the cosine of the dihedral angle, and sn its sine,
+  // taken from the normals rather than sqrt(1 - d^2), whose relative error
+  // near flat is that of d over 1 - d^2; false if degenerate or nearly flat
+  bool gradients(const ParticleStore &x, glm::vec3 q[4], tReal &d, tReal &sn) const
+  {
+    const glm::vec3 p1 = x.get(_i1);
+    const glm::vec3 p2 = x.get(_i2) - p1, p3 = x.get(_i3) - p1, p4 = x.get(_i4) - p1;
+    const glm::vec3 c23 = glm::cross(p2, p3), c24 = glm::cross(p2, p4);
+    const tReal l23 = glm::length(c23), l24 = glm::length(c24);
+    if(l23<=1e-12f || l24<=1e-12f) return false;
+    const glm::vec3 n1 = c23/l23, n2 = c24/l24;
+    d = glm::dot(n1, n2);
+    sn = glm::length(glm::cross(n1, n2));
+    // nearly flat: the gradients vanish down to their rounding error, which
+    // the division by their norm would blow up
+    if(sn*sn<=1e-5f) return false;
+
+    q[2] = (glm::cross(p2, n2) + glm::cross(n1, p2)*d)/l23;
+    q[3] = (glm::cross(p2, n1) + glm::cross(n2, p2)*d)/l24;
+    q[1] = -(glm::cross(p3, n2) + glm::cross(n1, p3)*d)/l23
+      - (glm::cross(p4, n1) + glm::cross(n2, p4)*d)/l24;
+    q[0] = -q[1] - q[2] - q[3];
+    return true;
+  }
+
+  // the PBD correction, s*w*q per vertex; false if none
+  bool correction(const ParticleStore &x, const tMassInv &w, glm::vec3 q[4], tReal &s) const
+  {
+    tReal d, sn;
+    if(!gradients(x, q, d, sn)) return false;
+    const tReal sum = w[_i1]*glm::dot(q[0], q[0]) + w[_i2]*glm::dot(q[1], q[1]) +
+      w[_i3]*glm::dot(q[2], q[2]) + w[_i4]*glm::dot(q[3], q[3]);
+    if(sum<=1e-12f) return false;
+    s = -_k*sn*(std::atan2(sn, d) - _phi)/sum;
+    return true;
+  }
+
+  void apply(ParticleStore &x, const tMassInv &w, const glm::vec3 q[4], const tReal s) const
+  {
+    x.set(_i1, x.get(_i1) + s*w[_i1]*q[0]);
+    x.set(_i2, x.get(_i2) + s*w[_i2]*q[1]);
+    x.set(_i3, x.get(_i3) + s*w[_i3]*q[2]);
+    x.set(_i4, x.get(_i4) + s*w[_i4]*q[3]);
+  }
+};
+
+// particle-particle contact: |p_i - p_j| >= _d
+struct ConstraintContact {
+  explicit ConstraintContact(const tUint i, const tUint j, const tReal d) :
+    _i(i), _j(j), _d(d) {}
+
+  enum { kArity = 2 };
+  tUint vertex(const int k) const { return k ? _j : _i; }
+  static const char *name() { return "contact"; }
+
+  void project(ParticleStore &x, const tMassInv &w) const
+  {
+    glm::vec3 dp;
+    if(!correction(x, w, dp)) return;
+    x.set(_i, x.get(_i) - w[_i]*dp);
+    x.set(_j, x.get(_j) + w[_j]*dp);
+  }
+  void projectXpbd(ParticleStore &x, const tMassInv &w, const tReal)
+  { project(x, w); }
+  bool jacobi(const ParticleStore &x, const tMassInv &w, glm::vec3 dp[]) const
+  {
+    glm::vec3 d;
+    if(!correction(x, w, d)) return false;
+    dp[0] = -w[_i]*d;
+    dp[1] = w[_j]*d;
+    return true;
+  }
+  void resetLambda() {}
+
+  tUint _i, _j;                 // indices of two vertices
+  tReal _d;                     // minimum distance
+
+private:
+  bool correction(const ParticleStore &x, const tMassInv &w, glm::vec3 &dp) const
+  {
+    const tReal ws = w[_i] + w[_j];
+    if(ws<=0) return false;
+    const glm::vec3 e = x.get(_i) - x.get(_j);
+    const tReal l = glm::length(e);
+    if(l>=_d || l<=0) return false;
+    dp = ((l - _d)/(l*ws))*e;
+    return true;
+  }
+};
+
+// vertex-triangle contact: vertex _i stays at least _h from the plane of
+// triangle (_t1, _t2, _t3), on the side _side of its normal, while it
+// projects inside the triangle grown by kMargin (in barycentric units), so
+// that a vertex sliding over the edge to a neighbor stays held; outside the
+// triangle, the clamped coordinates spread the push over its corners
+struct ConstraintTriangleContact {
+  explicit ConstraintTriangleContact(
+    const tUint i, const tUint t1, const tUint t2, const tUint t3, const tReal h,
+    const tReal side) :
+    _i(i), _t1(t1), _t2(t2), _t3(t3), _h(h), _side(side) {}
+
+  enum { kArity = 4 };
+  tUint vertex(const int k) const { return k==0 ? _i : k==1 ? _t1 : k==2 ? _t2 : _t3; }
+  static const char *name() { return "tricontact"; }
+  static tReal margin() { return 0.25f; }
+
+  void project(ParticleStore &x, const tMassInv &w) const
+  {
+    glm::vec3 n, b;
+    if(!correction(x, w, n, b)) return;
+    x.set(_i, x.get(_i) + w[_i]*n);
+    x.set(_t1, x.get(_t1) - (w[_t1]*b[0])*n);
+    x.set(_t2, x.get(_t2) - (w[_t2]*b[1])*n);
+    x.set(_t3, x.get(_t3) - (w[_t3]*b[2])*n);
+  }
+  void projectXpbd(ParticleStore &x, const tMassInv &w, const tReal)
+  { project(x, w); }
+  bool jacobi(const ParticleStore &x, const tMassInv &w, glm::vec3 dp[]) const
+  {
+    glm::vec3 n, b;
+    if(!correction(x, w, n, b)) return false;
+    dp[0] = w[_i]*n;
+    dp[1] = -(w[_t1]*b[0])*n;
+    dp[2] = -(w[_t2]*b[1])*n;
+    dp[3] = -(w[_t3]*b[2])*n;
+    return true;
+  }
+  void resetLambda() {}
+
+  // barycentric coordinates of the projection of p on the plane of (a, b, c);
+  // false if the triangle is degenerate or p projects outside the grown
+  // triangle
+  static bool barycentric(
+    const glm::vec3 &p, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c,
+    glm::vec3 &bary)
+  {
+    const glm::vec3 e1 = b - a, e2 = c - a, ep = p - a;
+    const tReal d11 = glm::dot(e1, e1), d12 = glm::dot(e1, e2), d22 = glm::dot(e2, e2);
+    const tReal det = d11*d22 - d12*d12;
+    if(det<=1e-20f) return false;
+    const tReal d1p = glm::dot(e1, ep), d2p = glm::dot(e2, ep);
+    bary.y = (d22*d1p - d12*d2p)/det;
+    bary.z = (d11*d2p - d12*d1p)/det;
+    bary.x = 1 - bary.y - bary.z;
+    return bary.x>=-margin() && bary.y>=-margin() && bary.z>=-margin();
+  }
+
+  tUint _i;                     // vertex
+  tUint _t1, _t2, _t3;          // triangle
+  tReal _h;                     // thickness
+  tReal _side;                  // +1 or -1: side of the triangle normal
+
+private:
+  // dn: the correction along the normal per unit inverse mass, b: the
+  // barycentric coordinates; false if none
+  bool correction(const ParticleStore &x, const tMassInv &w, glm::vec3 &dn, glm::vec3 &b) const
+  {
+    const glm::vec3 p = x.get(_i), a = x.get(_t1), pb = x.get(_t2), pc = x.get(_t3);
+    if(!barycentric(p, a, pb, pc, b)) return false;
+    b = glm::max(b, glm::vec3(0));
+    b /= b.x + b.y + b.z;
+    const glm::vec3 nc = glm::cross(pb - a, pc - a);
+    const tReal l = glm::length(nc);
+    if(l<=0) return false;
+    const glm::vec3 n = (_side/l)*nc;
+    const tReal c = glm::dot(n, p - a) - _h;
+    if(c>=0) return false;
+    // the push has to move something: with the vertex pinned, a triangle held
+    // by pinned corners would only give way at a tiny lever
+    const tReal sum = w[_i] + w[_t1]*b.x*b.x + w[_t2]*b.y*b.y + w[_t3]*b.z*b.z;
+    if(sum<=1e-3f*(w[_i] + w[_t1] + w[_t2] + w[_t3])) return false;
+    dn = (-c/sum)*n;
+    return true;
+  }
+};
+
+// collider contact: vertex _i stays at least _h in front of the plane
+// through the collider point _q with outward normal _n; the collider does
+// not give way
+struct ConstraintColliderContact {
+  explicit ConstraintColliderContact(
+    const tUint i, const glm::vec3 &q, const glm::vec3 &n, const tReal h) :
+    _i(i), _q(q), _n(n), _h(h) {}
+
+  enum { kArity = 1 };
+  tUint vertex(const int) const { return _i; }
+  static const char *name() { return "collider"; }
+
+  void project(ParticleStore &x, const tMassInv &w) const
+  {
+    if(w[_i]<=0) return;
+    const tReal c = glm::dot(_n, x.get(_i) - _q) - _h;
+    if(c<0) x.set(_i, x.get(_i) - c*_n);
+  }
+  void projectXpbd(ParticleStore &x, const tMassInv &w, const tReal)
+  { project(x, w); }
+  bool jacobi(const ParticleStore &x, const tMassInv &w, glm::vec3 dp[]) const
+  {
+    if(w[_i]<=0) return false;
+    const tReal c = glm::dot(_n, x.get(_i) - _q) - _h;
+    if(c>=0) return false;
+    dp[0] = -c*_n;
+    return true;
+  }
+  void resetLambda() {}
+
+  tUint _i;                     // vertex
+  glm::vec3 _q;                 // closest collider point
+  glm::vec3 _n;                 // outward normal there
+  tReal _h;                     // thickness
+};
+
+#endif  /* _CONSTRAINTS_HPP_ */
@@ -3,7 +3,10 @@
 #include "Mesh.h"
 
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <algorithm>
+#include <utility>
 #include <iostream>
 #include <fstream>
 #include <exception>
@@ -11,6 +14,28 @@
 #include <string>
 #include <memory>
 
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+namespace {
+
+// glBufferStorage, which the GL 3.3 loader does not have
+typedef void (APIENTRYP tBufferStorage)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+tBufferStorage g_bufferStorage = nullptr;
+
+void waitAndDelete(GLsync &fence)
+{
+  if(!fence) return;
+  GLenum r;
+  do r = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull); while(r==GL_TIMEOUT_EXPIRED);
+  glDeleteSync(fence);
+  fence = 0;
+}
+
+}
+
 Mesh::~Mesh()
 {
   clear();
@@ -27,26 +52,82 @@ void Mesh::computeBoundingSphere(glm::vec3 &center, float &radius) const
     radius = std::max(radius, distance(center, p));
 }
 
+namespace {
+
+// atan2(y, x) for y >= 0, in [0, pi], to about 2e-4; branch-free so that the
+// face loop vectorizes
+inline float atan2Upper(const float y, const float x)
+{
+  const float ax = std::abs(x);
+  const float a = std::min(ax, y)/std::max(std::max(ax, y), 1e-30f), s = a*a;
+  float r = ((-0.0464964749f*s + 0.15931422f)*s - 0.327622764f)*s*a + a;
+  r = y>ax ? 1.57079637f - r : r;
+  return x<0 ? 3.14159274f - r : r;
+}
+
+}
+
 void Mesh::recomputePerVertexNormals(bool angleBased)
 {
-  _vertexNormals.clear();
-  // Change the following code to compute a proper per-vertex normal
-  _vertexNormals.resize(_vertexPositions.size(), glm::vec3(0.0, 0.0, 0.0));
-
-  for(unsigned int tIt=0 ; tIt < _triangleIndices.size() ; ++tIt) {
-    glm::uvec3 t = _triangleIndices[tIt];
-    glm::vec3 n_t = glm::cross(
-      _vertexPositions[t[1]] - _vertexPositions[t[0]],
-      _vertexPositions[t[2]] - _vertexPositions[t[0]]);
-    _vertexNormals[t[0]] += n_t;
-    _vertexNormals[t[1]] += n_t;
-    _vertexNormals[t[2]] += n_t;
+  const long nv = static_cast<long>(_vertexPositions.size());
+  const long nt = static_cast<long>(_triangleIndices.size());
+  if(_cornerStart.size()!=static_cast<std::size_t>(nv + 1) ||
+     _corners.size()!=static_cast<std::size_t>(3*nt))
+    buildCornerAdjacency();
+  _vertexNormals.resize(nv);
+  _faceNormals.resize(nt);
+  _cornerWeights.resize(3*nt);
+
+  // face normals: by area (the cross product), or unit and weighted by the
+  // angle at each corner
+  if(!angleBased) {
+#pragma omp parallel for simd schedule(static) if(nt>=16384)
+    for(long t=0; t<nt; ++t) {
+      const glm::uvec3 &tri = _triangleIndices[t];
+      const glm::vec3 &a = _vertexPositions[tri[0]];
+      _faceNormals[t] = glm::cross(_vertexPositions[tri[1]] - a, _vertexPositions[tri[2]] - a);
+    }
+  } else {
+#pragma omp parallel for simd schedule(static) if(nt>=16384)
+    for(long t=0; t<nt; ++t) {
+      const glm::uvec3 &tri = _triangleIndices[t];
+      const glm::vec3 &a = _vertexPositions[tri[0]], &b = _vertexPositions[tri[1]], &c = _vertexPositions[tri[2]];
+      const glm::vec3 n = glm::cross(b - a, c - a);
+      // the angle at each corner from its two edges; |cross| is the same
+      const float l = glm::length(n);
+      _faceNormals[t] = l>0 ? n/l : glm::vec3(0);
+      _cornerWeights[3*t] = atan2Upper(l, glm::dot(b - a, c - a));
+      _cornerWeights[3*t + 1] = atan2Upper(l, glm::dot(c - b, a - b));
+      _cornerWeights[3*t + 2] = atan2Upper(l, glm::dot(a - c, b - c));
+    }
   }
-  for(unsigned int nIt = 0 ; nIt < _vertexNormals.size() ; ++nIt) {
-    glm::normalize(_vertexNormals[nIt]);
+
+  // each vertex sums over its own corners
+#pragma omp parallel for schedule(static) if(nv>=16384)
+  for(long i=0; i<nv; ++i) {
+    glm::vec3 n(0);
+    for(GLuint k=_cornerStart[i]; k<_cornerStart[i + 1]; ++k) {
+      const GLuint c = _corners[k];
+      n += angleBased ? _cornerWeights[c]*_faceNormals[c/3] : _faceNormals[c/3];
+    }
+    const float l = glm::length(n);
+    _vertexNormals[i] = l>0 ? n/l : n;
   }
 }
 
+void Mesh::buildCornerAdjacency()
+{
+  const std::size_t nv = _vertexPositions.size(), nt = _triangleIndices.size();
+  _cornerStart.assign(nv + 1, 0);
+  for(const glm::uvec3 &t : _triangleIndices)
+    for(int k=0; k<3; ++k) ++_cornerStart[t[k] + 1];
+  for(std::size_t i=0; i<nv; ++i) _cornerStart[i + 1] += _cornerStart[i];
+  _corners.resize(3*nt);
+  std::vector<GLuint> fill(_cornerStart.begin(), _cornerStart.end() - 1);
+  for(std::size_t t=0; t<nt; ++t)
+    for(int k=0; k<3; ++k) _corners[fill[_triangleIndices[t][k]]++] = static_cast<GLuint>(3*t + k);
+}
+
 void Mesh::recomputePerVertexTextureCoordinates()
 {
   _vertexTexCoords.clear();
@@ -204,36 +285,109 @@ void Mesh::addBox(const float w, const float h, const float d)
 
 void Mesh::addCloth(const GLuint rw, const GLuint rh, const float w, const float h)
 {
-  for(int i=0;i<rw;i++){
-    for(int j=0;j<rh;j++){
-      _vertexPositions.push_back(glm::vec3(-w/2+i*w/rw, 0,-h/2+j*h/rh));
-      _vertexPositions.push_back(glm::vec3(-w/2+i*w/rw, 0,-h/2+(j+1)*h/rh));
-      _vertexPositions.push_back(glm::vec3(-w/2+(i+1)*w/rw, 0,-h/2+(j+1)*h/rh));
-      _vertexPositions.push_back(glm::vec3(-w/2+(i+1)*w/rw, 0,-h/2+j*h/rh));
-
-      _vertexTexCoords.push_back(glm::vec2(0.0, 0.0));
-      _vertexTexCoords.push_back(glm::vec2(1.0, 0.0));
-      _vertexTexCoords.push_back(glm::vec2(1.0, 1.0));
-      _vertexTexCoords.push_back(glm::vec2(0.0, 1.0));
-
-      _vertexNormals.push_back(glm::vec3(0,0, 1));
-      _vertexNormals.push_back(glm::vec3(0,0, 1));
-      _vertexNormals.push_back(glm::vec3(0,0, 1));
-      _vertexNormals.push_back(glm::vec3(0,0, 1));
-
-      _triangleIndices.push_back(
-        glm::uvec3(_vertexPositions.size()-4, _vertexPositions.size()-3, _vertexPositions.size()-2));
-      _triangleIndices.push_back(
-        glm::uvec3(_vertexPositions.size()-4, _vertexPositions.size()-2, _vertexPositions.size()-1));
+  // (rw+1) x (rh+1) shared vertices, column by column; one texture tile per
+  // quad, as the texture repeats
+  const GLuint base = _vertexPositions.size();
+  for(GLuint i=0; i<=rw; ++i) {
+    for(GLuint j=0; j<=rh; ++j) {
+      _vertexPositions.push_back(glm::vec3(-w/2+i*w/rw, 0, -h/2+j*h/rh));
+      _vertexTexCoords.push_back(glm::vec2(j, i));
+      _vertexNormals.push_back(glm::vec3(0, 1, 0));
+    }
+  }
+
+  // the two triangles of each quad in turn, along the columns, so that
+  // consecutive triangles share an edge
+  for(GLuint i=0; i<rw; ++i) {
+    for(GLuint j=0; j<rh; ++j) {
+      const GLuint v00 = base + i*(rh+1) + j, v01 = v00 + 1;
+      const GLuint v10 = v00 + rh + 1, v11 = v10 + 1;
+      _triangleIndices.push_back(glm::uvec3(v00, v01, v11));
+      _triangleIndices.push_back(glm::uvec3(v00, v11, v10));
     }
   }
-    
+}
+
+std::size_t Mesh::weldVertices(float tolerance)
+{
+  const std::size_t n = _vertexPositions.size();
+  if(n==0) return 0;
+  if(tolerance<=0) {
+    glm::vec3 center;
+    float radius;
+    computeBoundingSphere(center, radius);
+    tolerance = 1e-6f*std::max(radius, 1e-30f);
+  }
+
+  // spatial hash with cells of the tolerance size; the vertices sorted by
+  // cell, so that the vertices of a cell are found by binary search
+  const float inv_cell = 1.f/tolerance;
+  auto cellOf = [&](const glm::vec3 &p) { return glm::ivec3(glm::floor(p*inv_cell)); };
+  auto hashOf = [](const glm::ivec3 &c) {
+    return static_cast<std::uint64_t>(static_cast<std::uint32_t>(c.x)*73856093u ^
+                                      static_cast<std::uint32_t>(c.y)*19349663u ^
+                                      static_cast<std::uint32_t>(c.z)*83492791u);
+  };
+  std::vector< std::pair<std::uint64_t, GLuint> > sorted(n);
+  for(std::size_t i=0; i<n; ++i)
+    sorted[i] = std::make_pair(hashOf(cellOf(_vertexPositions[i])), static_cast<GLuint>(i));
+  std::sort(sorted.begin(), sorted.end());
+
+  // every vertex is merged into the first vertex, in the original order,
+  // that lies within the tolerance
+  const GLuint unset = ~0u;
+  std::vector<GLuint> remap(n, unset);
+  std::vector<GLuint> kept;
+  const float tol2 = tolerance*tolerance;
+  for(std::size_t i=0; i<n; ++i) {
+    if(remap[i]!=unset) continue;
+    remap[i] = kept.size();
+    kept.push_back(i);
+    const glm::vec3 &p = _vertexPositions[i];
+    const glm::ivec3 c = cellOf(p);
+    for(int dz=-1; dz<=1; ++dz)
+      for(int dy=-1; dy<=1; ++dy)
+        for(int dx=-1; dx<=1; ++dx) {
+          const std::uint64_t h = hashOf(c + glm::ivec3(dx, dy, dz));
+          for(auto it=std::lower_bound(sorted.begin(), sorted.end(), std::make_pair(h, 0u));
+              it!=sorted.end() && it->first==h; ++it) {
+            const GLuint j = it->second;
+            if(remap[j]==unset && glm::dot(_vertexPositions[j] - p, _vertexPositions[j] - p)<=tol2)
+              remap[j] = remap[i];
+          }
+        }
+  }
+
+  // compact the attributes and drop the triangles that collapsed
+  for(std::size_t k=0; k<kept.size(); ++k) {
+    _vertexPositions[k] = _vertexPositions[kept[k]];
+    if(kept[k]<_vertexNormals.size()) _vertexNormals[k] = _vertexNormals[kept[k]];
+    if(kept[k]<_vertexTexCoords.size()) _vertexTexCoords[k] = _vertexTexCoords[kept[k]];
+  }
+  _vertexPositions.resize(kept.size());
+  if(_vertexNormals.size()>kept.size()) _vertexNormals.resize(kept.size());
+  if(_vertexTexCoords.size()>kept.size()) _vertexTexCoords.resize(kept.size());
+
+  std::size_t nt = 0;
+  for(const glm::uvec3 &t : _triangleIndices) {
+    const glm::uvec3 r(remap[t[0]], remap[t[1]], remap[t[2]]);
+    if(r[0]!=r[1] && r[1]!=r[2] && r[2]!=r[0]) _triangleIndices[nt++] = r;
+  }
+  _triangleIndices.resize(nt);
+
+  return n - kept.size();
 }
 
 
 #ifdef SUPPORT_OPENGL_45
 void Mesh::init()
 {
+  // streamed slots hold as many normals and texture coordinates as positions
+  if(_streaming) {
+    _vertexNormals.resize(_vertexPositions.size());
+    _vertexTexCoords.resize(_vertexPositions.size());
+  }
+
   glCreateBuffers(1, &_posVbo); // Generate a GPU buffer to store the positions of the vertices
   size_t vertexBufferSize = sizeof(glm::vec3)*_vertexPositions.size(); // Gather the size of the buffer from the CPU-side vector
   glNamedBufferStorage(_posVbo, vertexBufferSize, _vertexPositions.data(), GL_DYNAMIC_STORAGE_BIT); // Create a data store on the GPU
@@ -266,10 +420,18 @@ void Mesh::init()
 
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ibo);
   glBindVertexArray(0); // Desactive the VAO just created. Will be activated at rendering time.
+
+  if(_streaming) initStream();
 }
 #else
 void Mesh::init()
 {
+  // streamed slots hold as many normals and texture coordinates as positions
+  if(_streaming) {
+    _vertexNormals.resize(_vertexPositions.size());
+    _vertexTexCoords.resize(_vertexPositions.size());
+  }
+
   // Generate a GPU buffer to store the positions of the vertices
   size_t vertexBufferSize = sizeof(glm::vec3)*_vertexPositions.size();
   glGenBuffers(1, &_posVbo);
@@ -312,11 +474,24 @@ void Mesh::init()
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ibo);
 
   glBindVertexArray(0); // Desactive the VAO just created. Will be activated at rendering time.
+
+  if(_streaming) initStream();
 }
 #endif
 
-void Mesh::bufferData(const bool vertex, const bool normal) const
+void Mesh::bufferData(const bool vertex, const bool normal)
 {
+  // streaming: a new slot, so both
+  if(_streaming) {
+    const StreamSlot slot = beginStream();
+    if(slot.positions!=_vertexPositions.data()) {
+      std::copy(_vertexPositions.begin(), _vertexPositions.end(), slot.positions);
+      std::copy(_vertexNormals.begin(), _vertexNormals.end(), slot.normals);
+    }
+    endStream();
+    return;
+  }
+
   size_t vertexBufferSize = sizeof(glm::vec3)*_vertexPositions.size();
   if(vertex) {
     glBindBuffer(GL_ARRAY_BUFFER, _posVbo);
@@ -329,10 +504,115 @@ void Mesh::bufferData(const bool vertex, const bool normal) const
   }
 }
 
+bool Mesh::loadStreamingFunctions(GLADloadproc load)
+{
+  g_bufferStorage = nullptr;
+  bool supported = GLVersion.major>4 || (GLVersion.major==4 && GLVersion.minor>=4);
+  GLint n = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &n);
+  for(GLint i=0; i<n && !supported; ++i) {
+    const char *ext = reinterpret_cast<const char *>(glGetStringi(GL_EXTENSIONS, i));
+    supported = ext && !std::strcmp(ext, "GL_ARB_buffer_storage");
+  }
+  if(supported) g_bufferStorage = reinterpret_cast<tBufferStorage>(load("glBufferStorage"));
+  return g_bufferStorage!=nullptr;
+}
+
+void Mesh::initStream()
+{
+  const std::size_t n = _vertexPositions.size(), bytes = sizeof(glm::vec3)*n;
+  if(!g_bufferStorage || n==0) return; // the fallback uses the plain buffers
+
+  // one immutable buffer, mapped for good
+  const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  glGenBuffers(1, &_streamVbo);
+  glBindBuffer(GL_ARRAY_BUFFER, _streamVbo);
+  g_bufferStorage(GL_ARRAY_BUFFER, 2*kStreamSlots*bytes, nullptr, flags);
+  _streamMap = static_cast<unsigned char *>(glMapBufferRange(GL_ARRAY_BUFFER, 0, 2*kStreamSlots*bytes, flags));
+  if(!_streamMap) {
+    glDeleteBuffers(1, &_streamVbo);
+    _streamVbo = 0;
+    return;
+  }
+  for(int s=0; s<kStreamSlots; ++s) {
+    std::memcpy(_streamMap + s*bytes, _vertexPositions.data(), bytes);
+    std::memcpy(_streamMap + (kStreamSlots + s)*bytes, _vertexNormals.data(), bytes);
+  }
+  glDeleteBuffers(1, &_posVbo);
+  glDeleteBuffers(1, &_normalVbo);
+  _posVbo = _normalVbo = 0;
+
+  // slot s is drawn with base vertex s*n, which offsets the texture
+  // coordinates too: they are repeated
+  std::vector<glm::vec2> texCoords;
+  texCoords.reserve(kStreamSlots*n);
+  for(int s=0; s<kStreamSlots; ++s)
+    texCoords.insert(texCoords.end(), _vertexTexCoords.begin(), _vertexTexCoords.end());
+  glDeleteBuffers(1, &_texCoordVbo);
+  glGenBuffers(1, &_texCoordVbo);
+  glBindBuffer(GL_ARRAY_BUFFER, _texCoordVbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(glm::vec2)*texCoords.size(), texCoords.data(), GL_STATIC_DRAW);
+
+  glBindVertexArray(_vao);
+  glBindBuffer(GL_ARRAY_BUFFER, _streamVbo);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), 0);
+  glVertexAttribPointer(
+    1, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), reinterpret_cast<const void *>(kStreamSlots*bytes));
+  glBindBuffer(GL_ARRAY_BUFFER, _texCoordVbo);
+  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 2*sizeof(GLfloat), 0);
+  glBindVertexArray(0);
+  _streamSlot = _drawSlot = 0;
+}
+
+Mesh::StreamSlot Mesh::beginStream()
+{
+  StreamSlot slot = { _vertexPositions.data(), _vertexNormals.data() };
+  if(!_streamMap) return slot;
+
+  // the draws so far read the last slot written: fence them, then wait
+  // until those of the next slot are done
+  if(_fences[_drawSlot]) glDeleteSync(_fences[_drawSlot]);
+  _fences[_drawSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  _streamSlot = (_drawSlot + 1)%kStreamSlots;
+  waitAndDelete(_fences[_streamSlot]);
+
+  const std::size_t bytes = sizeof(glm::vec3)*_vertexPositions.size();
+  slot.positions = reinterpret_cast<glm::vec3 *>(_streamMap + _streamSlot*bytes);
+  slot.normals = reinterpret_cast<glm::vec3 *>(_streamMap + (kStreamSlots + _streamSlot)*bytes);
+  return slot;
+}
+
+void Mesh::endStream()
+{
+  if(_streamMap) {
+    _drawSlot = _streamSlot;
+    return;
+  }
+
+  // fallback: new storage (orphaning, so no wait for the draws of the old
+  // one) filled with glBufferSubData; the GL 4.5 path has immutable storage
+  const std::size_t bytes = sizeof(glm::vec3)*_vertexPositions.size();
+  glBindBuffer(GL_ARRAY_BUFFER, _posVbo);
+#ifndef SUPPORT_OPENGL_45
+  glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+#endif
+  glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, _vertexPositions.data());
+  glBindBuffer(GL_ARRAY_BUFFER, _normalVbo);
+#ifndef SUPPORT_OPENGL_45
+  glBufferData(GL_ARRAY_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+#endif
+  glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, _vertexNormals.data());
+}
+
 void Mesh::render()
 {
   glBindVertexArray(_vao);      // Activate the VAO storing geometry data
-  glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(_triangleIndices.size()*3), GL_UNSIGNED_INT, 0);
+  const GLsizei count = static_cast<GLsizei>(_triangleIndices.size()*3);
+  if(_streamMap)
+    glDrawElementsBaseVertex(
+      GL_TRIANGLES, count, GL_UNSIGNED_INT, 0, static_cast<GLint>(_drawSlot*_vertexPositions.size()));
+  else
+    glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, 0);
 }
 
 void Mesh::clear()
@@ -341,6 +621,20 @@ void Mesh::clear()
   _vertexNormals.clear();
   _vertexTexCoords.clear();
   _triangleIndices.clear();
+  _cornerStart.clear();
+  _corners.clear();
+  for(int s=0; s<kStreamSlots; ++s)
+    if(_fences[s]) {
+      glDeleteSync(_fences[s]);
+      _fences[s] = 0;
+    }
+  if(_streamVbo) {
+    glBindBuffer(GL_ARRAY_BUFFER, _streamVbo);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glDeleteBuffers(1, &_streamVbo);
+    _streamVbo = 0;
+    _streamMap = nullptr;
+  }
   if(_vao) {
     glDeleteVertexArrays(1, &_vao);
     _vao = 0;
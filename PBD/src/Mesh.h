@@ -28,10 +28,37 @@ public:
   // Compute the parameters of a sphere which bounds the mesh
   void computeBoundingSphere(glm::vec3 &center, float &radius) const;
 
+  // Unit normals, averaged over the incident triangles by area, or by the
+  // angle at the vertex if angleBased. The vertex-to-corner table is kept
+  // between calls and rebuilt when the vertex or triangle count changes, or
+  // after clear().
   void recomputePerVertexNormals(bool angleBased = false);
   void recomputePerVertexTextureCoordinates( );
 
-  void bufferData(const bool vertex, const bool normal) const;
+  void bufferData(const bool vertex, const bool normal);
+
+  // Streaming, for meshes whose positions and normals change every frame;
+  // set before init(), which then sizes the normals and texture coordinates
+  // to the positions. With buffer storage (GL 4.4 or ARB_buffer_storage,
+  // see loadStreamingFunctions()), they live in a ring of kStreamSlots
+  // copies in one persistently and coherently mapped buffer: each frame
+  // writes the next copy, after a fence says the GPU is done drawing it,
+  // and render() draws the last one written. Otherwise, the buffers are
+  // orphaned and refilled with glBufferSubData. Either way, a frame is
+  // uploaded once, however often it is drawn.
+  enum { kStreamSlots = 3 };
+  struct StreamSlot {
+    glm::vec3 *positions;       // vertexPositions().size() of each
+    glm::vec3 *normals;
+  };
+  void setStreaming(const bool on) { _streaming = on; }
+  bool streaming() const { return _streaming; }
+  // where to write this frame's data: mapped memory, or the arrays of the
+  // mesh in the fallback; every vertex has to be written before endStream()
+  StreamSlot beginStream();
+  void endStream();
+  // with the current context; false if buffer storage is not supported
+  static bool loadStreamingFunctions(GLADloadproc load);
 
   void init();
   void render();
@@ -39,19 +66,42 @@ public:
 
   void addPlane(const float square_half_side = 1.0f);
   void addBox(const float w, const float h, const float d);
+  // rw x rh quads over w x h in the xz-plane, sharing (rw+1)(rh+1) vertices
   void addCloth(const GLuint rw, const GLuint rh, const float w, const float h);
 
+  // Merge the vertices closer than tolerance (default: 1e-6 of the bounding
+  // radius), e.g., on a polygon soup from loadOFF; the first vertex keeps its
+  // attributes and degenerate triangles are dropped. Returns the number of
+  // vertices removed.
+  std::size_t weldVertices(float tolerance = 0.f);
+
 private:
   std::vector<glm::vec3> _vertexPositions;
   std::vector<glm::vec3> _vertexNormals;
   std::vector<glm::vec2> _vertexTexCoords;
   std::vector<glm::uvec3> _triangleIndices;
 
+  // normals: corner 3t+k is corner k of triangle t; the corners of vertex i
+  // are _corners[_cornerStart[i]] to _corners[_cornerStart[i+1]-1]
+  void buildCornerAdjacency();
+  std::vector<GLuint> _cornerStart;
+  std::vector<GLuint> _corners;
+  std::vector<glm::vec3> _faceNormals;
+  std::vector<float> _cornerWeights;
+
   GLuint _vao = 0;
   GLuint _posVbo = 0;
   GLuint _normalVbo = 0;
   GLuint _texCoordVbo = 0;
   GLuint _ibo = 0;
+
+  void initStream();
+  bool _streaming = false;
+  GLuint _streamVbo = 0;        // positions, then normals, kStreamSlots each
+  unsigned char *_streamMap = nullptr;
+  GLsync _fences[kStreamSlots] = {};
+  int _streamSlot = 0;          // being written, or last written
+  int _drawSlot = 0;
 };
 
 // utility: loader
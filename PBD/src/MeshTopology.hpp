@@ -0,0 +1,189 @@
+// ----------------------------------------------------------------------------
+// MeshTopology.hpp
+//
+// Description: Edge adjacency of a triangle mesh. Half-edge h = 3*t + k runs
+//   from corner k to corner k+1 of triangle t, across from corner k+2. The
+//   half-edges are sorted by their packed (min, max) vertex key with an LSD
+//   radix sort, in parallel with OpenMP, so that those of an edge are
+//   consecutive; the unique edges come out in lexicographic order. Building
+//   takes O(#triangles) time, plus O(#vertices) for the vertex-to-triangle
+//   table (CSR).
+// ----------------------------------------------------------------------------
+
+#ifndef _MESHTOPOLOGY_HPP_
+#define _MESHTOPOLOGY_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <glm/glm.hpp>
+
+#include "typedefs.hpp"
+#include "Mesh.h"
+
+namespace pbd {
+
+// sorts keys (of `bits` significant bits) and vals along, stably, in
+// passes of at most 11 bits; tmp_* are scratch arrays of the same size
+inline void radixSort(
+  std::vector<std::uint64_t> &keys, std::vector<tUint> &vals, const int bits,
+  std::vector<std::uint64_t> &tmp_keys, std::vector<tUint> &tmp_vals)
+{
+  enum { kMaxDigitBits = 11, kParallelMin = 65536 };
+  const std::size_t m = keys.size();
+  const int passes = (bits + kMaxDigitBits - 1)/kMaxDigitBits;
+  if(passes==0) return;
+  const int digit_bits = (bits + passes - 1)/passes;
+  const std::size_t radix = std::size_t(1) << digit_bits;
+  const std::uint64_t mask = radix - 1;
+  tmp_keys.resize(m);
+  tmp_vals.resize(m);
+  std::vector<std::size_t> hist;
+
+  for(int shift=0; shift<bits; shift+=digit_bits) {
+#pragma omp parallel if(m>=kParallelMin)
+    {
+#ifdef _OPENMP
+      const int nt = omp_get_num_threads(), tid = omp_get_thread_num();
+#else
+      const int nt = 1, tid = 0;
+#endif
+      const std::size_t b = m*tid/nt, e = m*(tid + 1)/nt;
+#pragma omp single
+      hist.assign(nt*radix, 0);
+
+      // per-thread digit counts, then offsets in (digit, thread) order so
+      // that the scatter is stable
+      std::size_t *h = hist.data() + tid*radix;
+      for(std::size_t i=b; i<e; ++i) ++h[(keys[i] >> shift) & mask];
+#pragma omp barrier
+#pragma omp single
+      {
+        std::size_t sum = 0;
+        for(std::size_t d=0; d<radix; ++d)
+          for(int t=0; t<nt; ++t) {
+            const std::size_t c = hist[t*radix + d];
+            hist[t*radix + d] = sum;
+            sum += c;
+          }
+      }
+      for(std::size_t i=b; i<e; ++i) {
+        const std::size_t o = h[(keys[i] >> shift) & mask]++;
+        tmp_keys[o] = keys[i];
+        tmp_vals[o] = vals[i];
+      }
+    }
+    keys.swap(tmp_keys);
+    vals.swap(tmp_vals);
+  }
+}
+
+}
+
+class MeshTopology {
+public:
+  enum { kNone = ~0u };
+
+  void build(const Mesh &mesh)
+  {
+    build(mesh.triangleIndices(), static_cast<tUint>(mesh.vertexPositions().size()));
+  }
+
+  // triangles over vertices 0..n-1
+  void build(const std::vector<glm::uvec3> &tris, const tUint n)
+  {
+    const tUint nh = 3*static_cast<tUint>(tris.size());
+    _tris = tris;
+
+    // half-edges by edge key
+    int bits = 1;
+    while(bits<32 && (1ull << bits)<n) ++bits;
+    std::vector<std::uint64_t> keys(nh), tmp_keys;
+    std::vector<tUint> order(nh), tmp_order;
+    const long long nt = static_cast<long long>(tris.size());
+#pragma omp parallel for schedule(static) if(nt>=16384)
+    for(long long t=0; t<nt; ++t)
+      for(int k=0; k<3; ++k) {
+        const tUint a = tris[t][k], b = tris[t][(k + 1)%3], h = static_cast<tUint>(3*t + k);
+        keys[h] = (static_cast<std::uint64_t>(std::min(a, b)) << bits) | std::max(a, b);
+        order[h] = h;
+      }
+    pbd::radixSort(keys, order, 2*bits, tmp_keys, tmp_order);
+
+    // runs of equal keys: one edge each
+    _edges.clear();
+    _edgeStart.clear();
+    _edges.reserve(nh/2 + 1);
+    _edgeStart.reserve(nh/2 + 2);
+    _halfEdges.swap(order);
+    _edgeOf.assign(nh, kNone);
+    for(tUint s=0; s<nh; ) {
+      tUint e = s + 1;
+      while(e<nh && keys[e]==keys[s]) ++e;
+      const tUint id = static_cast<tUint>(_edges.size());
+      _edges.push_back(glm::uvec2(keys[s] >> bits, keys[s] & ((1ull << bits) - 1)));
+      _edgeStart.push_back(s);
+      for(tUint k=s; k<e; ++k) _edgeOf[_halfEdges[k]] = id;
+      s = e;
+    }
+    _edgeStart.push_back(nh);
+
+    // vertex to triangles, by counting
+    _vertexStart.assign(n + 1, 0);
+    for(const glm::uvec3 &t : tris)
+      for(int k=0; k<3; ++k) ++_vertexStart[t[k] + 1];
+    for(tUint i=0; i<n; ++i) _vertexStart[i + 1] += _vertexStart[i];
+    _vertexTris.resize(nh);
+    std::vector<tUint> fill(_vertexStart.begin(), _vertexStart.end() - 1);
+    for(tUint t=0; t<tris.size(); ++t)
+      for(int k=0; k<3; ++k) _vertexTris[fill[tris[t][k]]++] = t;
+  }
+
+  // half-edges
+  tUint numHalfEdges() const { return static_cast<tUint>(_edgeOf.size()); }
+  tUint origin(const tUint h) const { return _tris[h/3][h%3]; }
+  tUint target(const tUint h) const { return _tris[h/3][(h%3 + 1)%3]; }
+  tUint opposite(const tUint h) const { return _tris[h/3][(h%3 + 2)%3]; }
+  tUint edgeOf(const tUint h) const { return _edgeOf[h]; }
+  // the other half-edge of a manifold interior edge, kNone otherwise
+  tUint twin(const tUint h) const {
+    const tUint e = _edgeOf[h];
+    if(numFaces(e)!=2) return kNone;
+    const tUint *he = halfEdges(e);
+    return he[0]==h ? he[1] : he[0];
+  }
+
+  // unique edges (i < j), sorted
+  tUint numEdges() const { return static_cast<tUint>(_edges.size()); }
+  const glm::uvec2 &edge(const tUint e) const { return _edges[e]; }
+  const std::vector<glm::uvec2> &edges() const { return _edges; }
+  // the numFaces(e) half-edges of edge e, by triangle
+  tUint numFaces(const tUint e) const { return _edgeStart[e + 1] - _edgeStart[e]; }
+  const tUint *halfEdges(const tUint e) const { return _halfEdges.data() + _edgeStart[e]; }
+  bool interior(const tUint e) const { return numFaces(e)==2; }
+  // vertices across an interior edge, from its two triangles
+  glm::uvec2 opposites(const tUint e) const {
+    const tUint *he = halfEdges(e);
+    return glm::uvec2(opposite(he[0]), opposite(he[1]));
+  }
+
+  // triangles around vertex i
+  tUint numTriangles(const tUint i) const { return _vertexStart[i + 1] - _vertexStart[i]; }
+  const tUint *triangles(const tUint i) const { return _vertexTris.data() + _vertexStart[i]; }
+
+private:
+  std::vector<glm::uvec3> _tris;
+  std::vector<tUint> _halfEdges;  // sorted by edge
+  std::vector<tUint> _edgeOf;     // per half-edge
+  std::vector<glm::uvec2> _edges;
+  std::vector<tUint> _edgeStart;  // CSR into _halfEdges
+  std::vector<tUint> _vertexStart;
+  std::vector<tUint> _vertexTris; // CSR
+};
+
+#endif  /* _MESHTOPOLOGY_HPP_ */
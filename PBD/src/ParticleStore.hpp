@@ -0,0 +1,102 @@
+// ----------------------------------------------------------------------------
+// ParticleStore.hpp
+//
+// Description: Structure-of-arrays storage of per-particle 3D vectors. The x,
+//   y and z components live in separate float arrays aligned to kAlign bytes
+//   and padded with zeros to a multiple of kWidth, so that kernels can run
+//   whole SIMD registers over them without a remainder loop.
+// ----------------------------------------------------------------------------
+
+#ifndef _PARTICLESTORE_HPP_
+#define _PARTICLESTORE_HPP_
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "typedefs.hpp"
+
+// std::allocator with a fixed alignment (a power of two, multiple of
+// sizeof(void*))
+template<typename T, std::size_t A>
+struct AlignedAllocator {
+  typedef T value_type;
+  template<typename U> struct rebind { typedef AlignedAllocator<U, A> other; };
+
+  AlignedAllocator() {}
+  template<typename U> AlignedAllocator(const AlignedAllocator<U, A> &) {}
+
+  T *allocate(const std::size_t n) {
+    void *p = nullptr;
+#ifdef _WIN32
+    p = _aligned_malloc(n*sizeof(T), A);
+#else
+    if(posix_memalign(&p, A, n*sizeof(T))) p = nullptr;
+#endif
+    if(!p) throw std::bad_alloc();
+    return static_cast<T *>(p);
+  }
+  void deallocate(T *p, const std::size_t) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+  }
+};
+template<typename T, typename U, std::size_t A>
+bool operator==(const AlignedAllocator<T, A> &, const AlignedAllocator<U, A> &) { return true; }
+template<typename T, typename U, std::size_t A>
+bool operator!=(const AlignedAllocator<T, A> &, const AlignedAllocator<U, A> &) { return false; }
+
+class ParticleStore {
+public:
+  enum {
+    kWidth = 8,                 // floats per SIMD register (AVX)
+    kAlign = 32                 // bytes
+  };
+  typedef std::vector<tReal, AlignedAllocator<tReal, kAlign> > tArray;
+
+  // n particles, all zero
+  void resize(const tUint n) {
+    _n = n;
+    const tUint padded = paddedSize(n);
+    for(int c=0; c<3; ++c) _c[c].assign(padded, 0);
+  }
+  void fill(const glm::vec3 &v) {
+    for(int c=0; c<3; ++c) {
+      std::fill(_c[c].begin(), _c[c].begin() + _n, v[c]);
+      std::fill(_c[c].begin() + _n, _c[c].end(), 0);
+    }
+  }
+
+  void fromAoS(const std::vector<glm::vec3> &v) {
+    resize(static_cast<tUint>(v.size()));
+    for(tUint i=0; i<_n; ++i) set(i, v[i]);
+  }
+  void toAoS(std::vector<glm::vec3> &v) const {
+    v.resize(_n);
+    for(tUint i=0; i<_n; ++i) v[i] = get(i);
+  }
+
+  glm::vec3 get(const tUint i) const { return glm::vec3(_c[0][i], _c[1][i], _c[2][i]); }
+  void set(const tUint i, const glm::vec3 &v) { _c[0][i] = v.x; _c[1][i] = v.y; _c[2][i] = v.z; }
+
+  // component c (0: x, 1: y, 2: z), paddedSize() entries
+  const tReal *data(const int c) const { return _c[c].data(); }
+  tReal *data(const int c) { return _c[c].data(); }
+
+  tUint size() const { return _n; }
+  tUint paddedSize() const { return paddedSize(_n); }
+  static tUint paddedSize(const tUint n) { return (n + kWidth - 1)/kWidth*kWidth; }
+
+private:
+  tArray _c[3];
+  tUint _n = 0;
+};
+
+#endif  /* _PARTICLESTORE_HPP_ */
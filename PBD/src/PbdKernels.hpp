@@ -0,0 +1,122 @@
+// ----------------------------------------------------------------------------
+// PbdKernels.hpp
+//
+// Description: Vectorized per-particle loops of the PBD time step, written
+//   against one component array of a ParticleStore at a time. The instruction
+//   set is picked at compile time (AVX, SSE or plain C++, left to the
+//   compiler for chebyshev()); n must be a multiple of ParticleStore::kWidth
+//   and the arrays kAlign-aligned.
+// ----------------------------------------------------------------------------
+
+#ifndef _PBDKERNELS_HPP_
+#define _PBDKERNELS_HPP_
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PBD_SSE
+#endif
+
+#include "typedefs.hpp"
+#include "ParticleStore.hpp"
+
+namespace pbd {
+
+// v += dt*w*f; p = x + dt*v
+inline void predict(
+  const tUint n, const tReal dt, const tReal *x, tReal *v, const tReal *f,
+  const tReal *w, tReal *p)
+{
+#if defined(__AVX__)
+  const __m256 vdt = _mm256_set1_ps(dt);
+  for(tUint i=0; i<n; i+=8) {
+    __m256 vv = _mm256_load_ps(v + i);
+    vv = _mm256_add_ps(vv, _mm256_mul_ps(vdt, _mm256_mul_ps(_mm256_load_ps(w + i), _mm256_load_ps(f + i))));
+    _mm256_store_ps(v + i, vv);
+    _mm256_store_ps(p + i, _mm256_add_ps(_mm256_load_ps(x + i), _mm256_mul_ps(vdt, vv)));
+  }
+#elif defined(PBD_SSE)
+  const __m128 vdt = _mm_set1_ps(dt);
+  for(tUint i=0; i<n; i+=4) {
+    __m128 vv = _mm_load_ps(v + i);
+    vv = _mm_add_ps(vv, _mm_mul_ps(vdt, _mm_mul_ps(_mm_load_ps(w + i), _mm_load_ps(f + i))));
+    _mm_store_ps(v + i, vv);
+    _mm_store_ps(p + i, _mm_add_ps(_mm_load_ps(x + i), _mm_mul_ps(vdt, vv)));
+  }
+#else
+  for(tUint i=0; i<n; ++i) {
+    v[i] += dt*w[i]*f[i];
+    p[i] = x[i] + dt*v[i];
+  }
+#endif
+}
+
+// v = damp*(p - x)/dt; x = p
+inline void update(
+  const tUint n, const tReal dt, const tReal damp, tReal *x, tReal *v, const tReal *p)
+{
+  const tReal s = damp/dt;
+#if defined(__AVX__)
+  const __m256 vs = _mm256_set1_ps(s);
+  for(tUint i=0; i<n; i+=8) {
+    const __m256 vp = _mm256_load_ps(p + i);
+    _mm256_store_ps(v + i, _mm256_mul_ps(vs, _mm256_sub_ps(vp, _mm256_load_ps(x + i))));
+    _mm256_store_ps(x + i, vp);
+  }
+#elif defined(PBD_SSE)
+  const __m128 vs = _mm_set1_ps(s);
+  for(tUint i=0; i<n; i+=4) {
+    const __m128 vp = _mm_load_ps(p + i);
+    _mm_store_ps(v + i, _mm_mul_ps(vs, _mm_sub_ps(vp, _mm_load_ps(x + i))));
+    _mm_store_ps(x + i, vp);
+  }
+#else
+  for(tUint i=0; i<n; ++i) {
+    v[i] = s*(p[i] - x[i]);
+    x[i] = p[i];
+  }
+#endif
+}
+
+// Jacobi iteration with Chebyshev acceleration (Wang 2015): p_hat = p +
+// relax*dx is the averaged Jacobi update (dx: the mean corrections) and the
+// new iterate is omega*(p_hat - p_prev) + p_prev; p_prev takes p and dx is
+// cleared
+inline void chebyshev(
+  const tUint n, const tReal omega, const tReal relax, tReal *p, tReal *p_prev, tReal *dx)
+{
+#pragma omp parallel for simd schedule(static) if(n>=16384)
+  for(tUint i=0; i<n; ++i) {
+    const tReal q = omega*(p[i] + relax*dx[i] - p_prev[i]) + p_prev[i];
+    p_prev[i] = p[i];
+    p[i] = q;
+    dx[i] = 0;
+  }
+}
+
+// all three components
+inline void predict(
+  const tReal dt, const ParticleStore &x, ParticleStore &v, const ParticleStore &f,
+  const tReal *w, ParticleStore &p)
+{
+  for(int c=0; c<3; ++c)
+    predict(x.paddedSize(), dt, x.data(c), v.data(c), f.data(c), w, p.data(c));
+}
+inline void update(
+  const tReal dt, const tReal damp, ParticleStore &x, ParticleStore &v, const ParticleStore &p)
+{
+  for(int c=0; c<3; ++c)
+    update(x.paddedSize(), dt, damp, x.data(c), v.data(c), p.data(c));
+}
+inline void chebyshev(
+  const tReal omega, const tReal relax, ParticleStore &p, ParticleStore &p_prev,
+  ParticleStore &dx)
+{
+  for(int c=0; c<3; ++c)
+    chebyshev(p.paddedSize(), omega, relax, p.data(c), p_prev.data(c), dx.data(c));
+}
+
+}
+
+#endif  /* _PBDKERNELS_HPP_ */
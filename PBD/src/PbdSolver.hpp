@@ -20,8 +20,9 @@
 #define _PBDSOLVER_HPP_
 
 #include <cmath>
-#include <set>
-#include <map>
+#include <iostream>
+#include <vector>
+#include <algorithm>
 #include <glm/glm.hpp>
 #include <memory>
 #include <utility>
@@ -32,53 +33,17 @@
 #include "glm/geometric.hpp"
 #include "typedefs.hpp"
 #include "Mesh.h"
-
-struct Constraint {
-  virtual void project(std::vector<glm::vec3> &x, const std::vector<tReal> &w) const = 0;
-};
-
-struct ConstraintAttach : public Constraint {
-  explicit ConstraintAttach(const tUint i, const glm::vec3 &p) :
-    _i(i), _p(p) {}
-
-  virtual void project(std::vector<glm::vec3> &x, const std::vector<tReal> &w) const
-  { x[_i] = _p; }
-
-  tUint _i;                     // vertex id
-  glm::vec3 _p;                 // fixed position
-};
-
-struct ConstraintStretch : public Constraint {
-  explicit ConstraintStretch(
-    const tUint i, const tUint j, const tReal d, const tReal k) :
-    _i(i), _j(j), _d(d), _k(k) {}
-
-  virtual void project(std::vector<glm::vec3> &x, const std::vector<tReal> &w) const
-  {
-    // TODO: update/project x according to this constraint
-  }
-
-  tUint _i, _j;                 // indices of two vertices
-  tReal _d;                     // initial length
-  tReal _k;                     // stiffness
-};
-
-struct ConstraintBend : public Constraint {
-  explicit ConstraintBend(
-    const tUint i1, const tUint i2, const tUint i3, const tUint i4,
-    const tReal phi, const tReal k) :
-    _i1(i1), _i2(i2), _i3(i3), _i4(i4), _phi(phi), _k(k) {}
-
-  virtual void project(std::vector<glm::vec3> &x, const std::vector<tReal> &w) const
-  {
-    // TODO: update/project x according to this constraint
-  }
-
-  tUint _i1, _i2, _i3, _i4; // indices of vertices forming two adjacent triangles
-  tReal _phi;               // initial angle
-  tReal _k;                 // stiffness
-};
-
+#include "MeshTopology.hpp"
+#include "SpatialHash.hpp"
+#include "Collider.hpp"
+#include "ParticleStore.hpp"
+#include "PbdKernels.hpp"
+#include "ConstraintKernels.hpp"
+
+// projected in this order; attachments last so that they always hold
+typedef ConstraintSet<
+  ConstraintStretch, ConstraintBend, ConstraintContact, ConstraintTriangleContact,
+  ConstraintColliderContact, ConstraintAttach> tConstraints;
 
 class PbdSolver {
 public:
@@ -87,59 +52,378 @@ public:
     const tReal k_stretch=1.0f, const tReal k_bend=1.0f, const tReal k_damp=0.99f,
     const glm::vec3 &gravity=glm::vec3(0.f, -9.8f, 0.f)) :
     _g(gravity), _step(0), _sim_t(0.0f),
-    _Ns(num_solve), _kStretch(k_stretch), _kBend(k_bend), _kDamp(k_damp) {}
+    _Ns(num_solve), _kStretch(k_stretch), _kBend(k_bend), _kDamp(k_damp),
+    _substeps(0), _alphaStretch(0), _alphaBend(0),
+    _jacobi(false), _rho(0.98f), _relax(1.5f),
+    _selfCollision(false), _thicknessSet(0), _thickness(0), _cellSize(1), _verbose(true) {}
   virtual ~PbdSolver() {}
 
+  void setVerbose(const bool verbose) { _verbose = verbose; }
+
+  // XPBD "small steps": each step is split into `substeps` substeps of one
+  // iteration each, and the constraints are as stiff as their compliances
+  // (inverse stiffnesses, in physical units; 0: inextensible) whatever the
+  // substep count. 0 substeps: PBD with num_solve iterations per step and
+  // the k_* stiffnesses. The compliances are read by initSim().
+  void setSmallSteps(
+    const tUint substeps, const tReal stretch_compliance=0, const tReal bend_compliance=0)
+  {
+    _substeps = substeps;
+    _alphaStretch = stretch_compliance;
+    _alphaBend = bend_compliance;
+  }
+  tUint substeps() const { return _substeps; }
+
+  // PBD iterations as Jacobi sweeps: every constraint is evaluated at the
+  // same positions, in parallel without coloring, and each particle moves by
+  // relax times the sum, over the constraint kinds, of the mean of its
+  // corrections (see ConstraintSet::accumulate()). From the kChebyshevDelay-th
+  // iteration on, Chebyshev acceleration extrapolates with the spectral
+  // radius rho of the sweep (0: plain Jacobi; too large diverges). Not used
+  // with small steps.
+  void setJacobi(const bool on, const tReal rho=0.98f, const tReal relax=1.5f)
+  {
+    _jacobi = on;
+    _rho = rho;
+    _relax = relax;
+  }
+  bool jacobi() const { return _jacobi; }
+
+  // self-collision: at the start of each step, particle-particle and
+  // vertex-triangle contacts within reach of the step are found in a spatial
+  // hash of the positions and projected with the other constraints. The
+  // cells are as large as the mean rest edge; thickness (the minimum
+  // distance; 0: half the mean rest edge) is resolved by initSim(). Pairs
+  // closer than that at rest keep their rest distance, and a triangle
+  // ignores the vertices of its one-ring, which only bend around it.
+  void setSelfCollision(const bool on, const tReal thickness=0)
+  {
+    _selfCollision = on;
+    _thicknessSet = thickness;
+    if(!on && (_stats.contacts || _stats.triangleContacts)) {
+      _constraints.clear<ConstraintContact>();
+      _constraints.clear<ConstraintTriangleContact>();
+      _stats = Stats();
+    }
+  }
+  bool selfCollision() const { return _selfCollision; }
+
+  // colliders: obstacles that the particles keep the thickness away from.
+  // At the start of every step (every substep with small steps), each
+  // particle gets a contact with the closest point of each collider within
+  // reach of its predicted position. Colliders stay through initSim(); a
+  // kinematic one is moved by the caller between steps.
+  void addCollider(const std::shared_ptr<const Collider> &collider)
+  {
+    _colliders.push_back(collider);
+  }
+  void clearColliders()
+  {
+    _colliders.clear();
+    if(_stats.colliderContacts) {
+      _constraints.clear<ConstraintColliderContact>();
+      _stats.colliderContacts = 0;
+    }
+  }
+  tUint numColliders() const { return static_cast<tUint>(_colliders.size()); }
+
+  // statistics of the last step
+  struct Stats {
+    tUint contacts = 0;         // particle-particle
+    tUint triangleContacts = 0; // vertex-triangle
+    double hashMs = 0;          // hash rebuild
+    double queryMs = 0;         // contact queries
+    tUint colliderContacts = 0; // of the last substep
+    double colliderMs = 0;      // collider queries, all substeps
+  };
+  const Stats &stats() const { return _stats; }
+
   void initSim(const Mesh &mesh)
   {
     _step = 0;
     _sim_t = 0.0f;
 
-    _x = mesh.vertexPositions();
+    _x.fromAoS(mesh.vertexPositions());
     _idx = mesh.triangleIndices();
     _tex = mesh.vertexTexCoords();
 
-    // TODO: initialize physical variables _v, _f, _w
-    _v = 0;
-    _f = 2*_g;
-    _w = 1/2;
-
-    // TODO: create constraints
-
-    // TODO: attachments
-
-    // TODO: edge-triangle information
-
-    // TODO: stretch
-
-    // TODO: bend
+    // unit masses at rest under gravity; the padding keeps w=0 and f=0
+    const tUint n = _x.size();
+    _p = _x;
+    _v.resize(n);
+    _f.resize(n);
+    _f.fill(_g);
+    _w.assign(_x.paddedSize(), 0);
+    std::fill(_w.begin(), _w.begin() + n, 1);
+
+    _constraints.clear();
+    _x0 = _x;
+    _stats = Stats();
+
+    // attachments: the vertices at the two corners of the -z border
+    glm::vec3 lo(1e30f), hi(-1e30f);
+    for(tUint i=0; i<n; ++i) {
+      lo = glm::min(lo, _x.get(i));
+      hi = glm::max(hi, _x.get(i));
+    }
+    const tReal eps = 1e-6f*(1 + glm::length(hi - lo));
+    for(tUint i=0; i<n; ++i) {
+      const glm::vec3 p = _x.get(i);
+      if(std::abs(p.z - lo.z)<eps && (std::abs(p.x - lo.x)<eps || std::abs(p.x - hi.x)<eps)) {
+        _constraints.add(ConstraintAttach(i, p));
+        _w[i] = 0;
+      }
+    }
+
+    // edge-triangle information: the triangles on both sides of each edge,
+    // as the vertex opposite to it
+    _topo.build(_idx, n);
+    const MeshTopology &topo = _topo;
+    tReal edge_sum = 0;
+    for(tUint e=0; e<topo.numEdges(); ++e) {
+      const tUint i = topo.edge(e).x, j = topo.edge(e).y;
+      edge_sum += glm::distance(_x.get(i), _x.get(j));
+
+      // stretch
+      _constraints.add(ConstraintStretch(
+                         i, j, glm::distance(_x.get(i), _x.get(j)), _kStretch, _alphaStretch));
+
+      // bend
+      if(topo.interior(e)) {
+        const tUint k = topo.opposites(e).x, l = topo.opposites(e).y;
+        _constraints.add(ConstraintBend(
+                           i, j, k, l,
+                           ConstraintBend::angle(_x.get(i), _x.get(j), _x.get(k), _x.get(l)),
+                           _kBend, _alphaBend));
+      }
+    }
+
+    _cellSize = topo.numEdges() ? edge_sum/topo.numEdges() : 1;
+    if(_cellSize<=0) _cellSize = 1;
+    _thickness = _thicknessSet>0 ? _thicknessSet : _cellSize/2;
+
+    _constraints.color(n);
+    _pPrev.resize(n);
+    _dx.resize(n);
+
+    if(_verbose) {
+#ifdef _OPENMP
+      _constraints.reportColoring(std::cout, omp_get_max_threads());
+#else
+      _constraints.reportColoring(std::cout, 1);
+#endif
+    }
   }
 
   void updateMesh(Mesh &mesh)
   {
-    mesh.vertexPositions() = _x;
+    _x.toAoS(mesh.vertexPositions());
     mesh.recomputePerVertexNormals();
   }
 
   void step(const tReal dt)
   {
-    std::cout << "t=" << _sim_t << " (dt=" << dt << ")" << std::endl;
-
-    // TODO: main solver routine
+    if(_verbose) std::cout << "t=" << _sim_t << " (dt=" << dt << ")" << std::endl;
+
+    if(_selfCollision) {
+      detectSelfCollisions(dt);
+      if(_verbose)
+        std::cout << "> self-collision: " << _stats.contacts << " contacts, "
+                  << _stats.triangleContacts << " vertex-triangle; hash "
+                  << _stats.hashMs << " ms, query " << _stats.queryMs << " ms" << std::endl;
+    }
+    _stats.colliderMs = 0;
+    if(_substeps) {
+      // the same damping per step as with PBD
+      const tReal h = dt/_substeps, damp = std::pow(_kDamp, 1.f/_substeps);
+      for(tUint s=0; s<_substeps; ++s) {
+        pbd::predict(h, _x, _v, _f, _w.data(), _p);
+        detectColliderContacts();
+        _constraints.color(_x.size()); // no-op unless constraints were added
+        _constraints.resetLambdas();
+        _constraints.projectXpbd(_p, _w, h);
+        pbd::update(h, damp, _x, _v, _p);
+      }
+    } else if(_jacobi) {
+      pbd::predict(dt, _x, _v, _f, _w.data(), _p);
+      detectColliderContacts();
+      _pPrev = _p;
+      tReal omega = 1;
+      for(tUint it=0; it<_Ns; ++it) {
+        _constraints.accumulate(_p, _w, _dx);
+        if(it==kChebyshevDelay) omega = 2/(2 - _rho*_rho);
+        else if(it>kChebyshevDelay) omega = 4/(4 - _rho*_rho*omega);
+        pbd::chebyshev(omega, _relax, _p, _pPrev, _dx);
+      }
+      pbd::update(dt, _kDamp, _x, _v, _p);
+    } else {
+      pbd::predict(dt, _x, _v, _f, _w.data(), _p);
+      detectColliderContacts();
+      _constraints.color(_x.size());
+      for(tUint it=0; it<_Ns; ++it)
+        _constraints.project(_p, _w);
+      pbd::update(dt, _kDamp, _x, _v, _p);
+    }
+    if(_verbose && !_colliders.empty())
+      std::cout << "> colliders: " << _stats.colliderContacts << " contacts; query "
+                << _stats.colliderMs << " ms" << std::endl;
 
     ++_step;
     _sim_t += dt;
   }
 
 private:
-  std::vector<glm::vec3> _x;    // position
-  std::vector<glm::vec3> _v;    // velocity
-  std::vector<glm::vec3> _f;    // force
+  // replaces the contact constraints with those in reach of this step
+  void detectSelfCollisions(const tReal dt)
+  {
+    typedef std::chrono::steady_clock tClock;
+    const tUint n = _x.size();
+    const tClock::time_point t0 = tClock::now();
+    _hash.build(_x, n, _cellSize);
+    const tClock::time_point t1 = tClock::now();
+
+    // reach: the thickness plus a bound on how much closer two particles get
+    // over the step, at most kMaxReach cells; faster contacts may tunnel
+    glm::vec3 vm(0);
+    for(tUint i=0; i<n; ++i) vm += _v.get(i);
+    vm /= std::max<tUint>(n, 1);
+    tReal v2 = 0;
+    for(tUint i=0; i<n; ++i) {
+      const glm::vec3 dv = _v.get(i) - vm;
+      v2 = std::max(v2, glm::dot(dv, dv));
+    }
+    const tReal r = _thickness + std::min(2*dt*std::sqrt(v2), kMaxReach*_cellSize), r2 = r*r;
+    const glm::vec3 rv(r);
+
+#ifdef _OPENMP
+    const int nt = omp_get_max_threads();
+#else
+    const int nt = 1;
+#endif
+    _visitors.resize(nt);
+    _contacts.resize(nt);
+    _triangleContacts.resize(nt);
+    for(int t=0; t<nt; ++t) {
+      _contacts[t].clear();
+      _triangleContacts[t].clear();
+    }
+    const long nv = static_cast<long>(n), ntri = static_cast<long>(_idx.size());
+#pragma omp parallel if(n>=4096)
+    {
+      // static chunks in thread order: the concatenation is in index order
+      // whatever the thread count
+      const int tid = pbd_detail::threadId();
+      SpatialHash::Visitor &vis = _visitors[tid];
+      std::vector<ConstraintContact> &cs = _contacts[tid];
+      std::vector<ConstraintTriangleContact> &ts = _triangleContacts[tid];
+
+#pragma omp for schedule(static)
+      for(long i=0; i<nv; ++i) {
+        const glm::vec3 p = _x.get(i);
+        _hash.query(p - rv, p + rv, vis, [&](const tUint j) {
+            if(j<=static_cast<tUint>(i) || _w[i] + _w[j]<=0) return;
+            const glm::vec3 e = _x.get(j) - p;
+            if(glm::dot(e, e)>=r2) return;
+            const tReal d = std::min(_thickness, glm::distance(_x0.get(i), _x0.get(j)));
+            if(d>1e-6f*_thickness) cs.push_back(ConstraintContact(i, j, d));
+          });
+      }
+
+#pragma omp for schedule(static)
+      for(long t=0; t<ntri; ++t) {
+        const glm::uvec3 &tri = _idx[t];
+        const glm::vec3 a = _x.get(tri[0]), b = _x.get(tri[1]), c = _x.get(tri[2]);
+        const glm::vec3 nc = glm::cross(b - a, c - a);
+        const tReal l = glm::length(nc);
+        if(l<=0) continue;
+        const glm::vec3 nrm = nc/l;
+        const glm::vec3 a0 = _x0.get(tri[0]), b0 = _x0.get(tri[1]), c0 = _x0.get(tri[2]);
+        const glm::vec3 n0 = glm::cross(b0 - a0, c0 - a0);
+        _hash.query(glm::min(a, glm::min(b, c)) - rv, glm::max(a, glm::max(b, c)) + rv, vis,
+                    [&](const tUint v) {
+            if(v==tri[0] || v==tri[1] || v==tri[2]) return;
+            const glm::vec3 p = _x.get(v);
+            const tReal h = glm::dot(nrm, p - a);
+            glm::vec3 bary;
+            if(std::abs(h)>=r || !ConstraintTriangleContact::barycentric(p, a, b, c, bary)) return;
+            // in the one-ring of the triangle: bending, not a collision
+            const tUint *vt = _topo.triangles(v);
+            for(tUint k=0; k<_topo.numTriangles(v); ++k)
+              for(int m=0; m<3; ++m)
+                if(_idx[vt[k]][m]==tri[0] || _idx[vt[k]][m]==tri[1] || _idx[vt[k]][m]==tri[2]) return;
+            // in contact at rest
+            const glm::vec3 p0 = _x0.get(v);
+            const tReal l0 = glm::length(n0);
+            if(l0>0 && std::abs(glm::dot(n0, p0 - a0))<_thickness*l0 &&
+               ConstraintTriangleContact::barycentric(p0, a0, b0, c0, bary)) return;
+            ts.push_back(ConstraintTriangleContact(
+                           v, tri[0], tri[1], tri[2], _thickness, h<0 ? -1.f : 1.f));
+          });
+      }
+    }
+
+    _constraints.clear<ConstraintContact>();
+    _constraints.clear<ConstraintTriangleContact>();
+    _stats.contacts = _stats.triangleContacts = 0;
+    for(int t=0; t<nt; ++t) {
+      for(const ConstraintContact &c : _contacts[t]) _constraints.add(c);
+      for(const ConstraintTriangleContact &c : _triangleContacts[t]) _constraints.add(c);
+      _stats.contacts += _contacts[t].size();
+      _stats.triangleContacts += _triangleContacts[t].size();
+    }
+    const tClock::time_point t2 = tClock::now();
+    _stats.hashMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    _stats.queryMs = std::chrono::duration<double, std::milli>(t2 - t1).count();
+  }
+
+  // replaces the collider contacts with those of the predicted positions;
+  // reach: the thickness, the move of the (sub)step, and one cell for the
+  // move of the colliders
+  void detectColliderContacts()
+  {
+    if(_colliders.empty()) return;
+    typedef std::chrono::steady_clock tClock;
+    const tClock::time_point t0 = tClock::now();
+#ifdef _OPENMP
+    const int nt = omp_get_max_threads();
+#else
+    const int nt = 1;
+#endif
+    _colliderContacts.resize(nt);
+    for(int t=0; t<nt; ++t) _colliderContacts[t].clear();
+    const long n = static_cast<long>(_x.size());
+#pragma omp parallel if(n>=256)
+    {
+      std::vector<ConstraintColliderContact> &cs = _colliderContacts[pbd_detail::threadId()];
+#pragma omp for schedule(static)
+      for(long i=0; i<n; ++i) {
+        if(_w[i]<=0) continue;
+        const glm::vec3 p = _p.get(i);
+        const tReal r = _thickness + glm::distance(_x.get(i), p) + _cellSize;
+        glm::vec3 q, nrm;
+        for(const std::shared_ptr<const Collider> &c : _colliders)
+          if(c->closest(p, r, q, nrm)) cs.push_back(ConstraintColliderContact(i, q, nrm, _thickness));
+      }
+    }
+
+    _constraints.clear<ConstraintColliderContact>();
+    _stats.colliderContacts = 0;
+    for(int t=0; t<nt; ++t) {
+      for(const ConstraintColliderContact &c : _colliderContacts[t]) _constraints.add(c);
+      _stats.colliderContacts += _colliderContacts[t].size();
+    }
+    _stats.colliderMs += std::chrono::duration<double, std::milli>(tClock::now() - t0).count();
+  }
+
+  ParticleStore _x;             // position
+  ParticleStore _p;             // predicted position
+  ParticleStore _v;             // velocity
+  ParticleStore _f;             // force
   std::vector<glm::uvec3> _idx; // indices
   std::vector<glm::vec2> _tex;  // texture coordinates
-  std::vector<tReal> _w;        // mass inverse
+  tMassInv _w;                  // mass inverse
 
-  std::vector< std::shared_ptr<Constraint> > _constraints; // constraints
+  tConstraints _constraints;
 
   // simulation parameters
   glm::vec3 _g;                 // gravity
@@ -149,6 +433,37 @@ private:
   // PBD solver parameters
   tUint _Ns;                       // solver iterations
   tReal _kStretch, _kBend, _kDamp; // stiffness coefficients
+
+  // XPBD small-steps parameters
+  tUint _substeps;                    // 0: PBD
+  tReal _alphaStretch, _alphaBend;    // compliances
+
+  // Jacobi parameters and buffers
+  enum { kChebyshevDelay = 5 };       // plain Jacobi iterations first
+  bool _jacobi;
+  tReal _rho, _relax;                 // spectral radius, relaxation
+  ParticleStore _pPrev;               // previous iterate
+  ParticleStore _dx;                  // mean corrections per kind
+
+  // self-collision
+  bool _selfCollision;
+  tReal _thicknessSet;                // as set; 0: from the rest edges
+  tReal _thickness;                   // minimum distance
+  tReal _cellSize;                    // hash cell, the mean rest edge
+  ParticleStore _x0;                  // rest positions
+  MeshTopology _topo;
+  enum { kMaxReach = 2 };              // cells
+  SpatialHash _hash;
+  std::vector<SpatialHash::Visitor> _visitors;                             // per thread
+  std::vector< std::vector<ConstraintContact> > _contacts;                 // per thread
+  std::vector< std::vector<ConstraintTriangleContact> > _triangleContacts; // per thread
+  Stats _stats;
+
+  // colliders
+  std::vector< std::shared_ptr<const Collider> > _colliders;
+  std::vector< std::vector<ConstraintColliderContact> > _colliderContacts; // per thread
+
+  bool _verbose;
 };
 
 #endif  /* _PBDSOLVER_HPP_ */
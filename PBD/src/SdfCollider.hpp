@@ -0,0 +1,282 @@
+// ----------------------------------------------------------------------------
+// SdfCollider.hpp
+//
+// Description: Collider baked into a signed distance field on a regular
+//   grid, for static obstacles: a query is one trilinear lookup and its
+//   gradient, whatever the triangle count. Baking computes the exact
+//   distance in a narrow band of kBand cells around the surface, in
+//   parallel with a BVH, and extends it to the rest of the grid by fast
+//   sweeping (Zhao 2005, eight serial sweeps, twice). The sign is the parity
+//   of the crossings of a ray along +x, so the mesh must be closed. A baked
+//   field is cached in a file named after a hash of the transformed mesh and
+//   of the grid parameters; the same obstacle then loads in one read.
+// ----------------------------------------------------------------------------
+
+#ifndef _SDFCOLLIDER_HPP_
+#define _SDFCOLLIDER_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "typedefs.hpp"
+#include "Mesh.h"
+#include "Bvh.hpp"
+#include "Collider.hpp"
+
+class SdfCollider : public Collider {
+public:
+  enum { kBand = 3 };           // cells of exact distance around the surface
+
+  // the mesh moved by transform, in cells of size dx; cache_dir: where baked
+  // fields are looked up and stored ("": no cache)
+  SdfCollider(
+    const Mesh &mesh, const glm::mat4 &transform, const tReal dx,
+    const std::string &cache_dir="") :
+    _dx(dx), _fromCache(false), _bakeMs(0)
+  {
+    std::vector<glm::vec3> v(mesh.vertexPositions().size());
+    for(std::size_t i=0; i<v.size(); ++i)
+      v[i] = glm::vec3(transform*glm::vec4(mesh.vertexPositions()[i], 1.f));
+    const std::vector<glm::uvec3> &tris = mesh.triangleIndices();
+
+    // the grid: the bounding box grown by the band and one cell
+    glm::vec3 lo(1e30f), hi(-1e30f);
+    for(const glm::vec3 &p : v) {
+      lo = glm::min(lo, p);
+      hi = glm::max(hi, p);
+    }
+    if(v.empty()) lo = hi = glm::vec3(0);
+    const tReal pad = (kBand + 1)*_dx;
+    _origin = lo - glm::vec3(pad);
+    _n = glm::ivec3(glm::ceil((hi - lo + glm::vec3(2*pad))/_dx)) + glm::ivec3(1);
+
+    const std::uint64_t key = hash(v, tris);
+    std::string path;
+    if(!cache_dir.empty()) {
+      std::ostringstream name;
+      name << cache_dir << "/sdf-" << std::hex << std::setw(16) << std::setfill('0') << key << ".bin";
+      path = name.str();
+      if(load(path, key)) {
+        _fromCache = true;
+        return;
+      }
+    }
+    const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    bake(v, tris);
+    _bakeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    if(!path.empty()) save(path, key);
+  }
+
+  // the trilinear distance at p and its gradient; outside the grid, the
+  // distance at the closest grid point plus the way there
+  virtual bool closest(const glm::vec3 &p, const tReal max_dist, glm::vec3 &q, glm::vec3 &n) const
+  {
+    const glm::vec3 g = (p - _origin)/_dx;
+    const glm::vec3 c = glm::clamp(g, glm::vec3(0), glm::vec3(_n - glm::ivec3(1)));
+    const glm::ivec3 b = glm::min(glm::ivec3(c), _n - glm::ivec3(2));
+    const glm::vec3 f = c - glm::vec3(b);
+    const float *v = _phi.data() + index(b.x, b.y, b.z);
+    const std::size_t sj = _n.x, sk = std::size_t(_n.x)*_n.y;
+    const tReal v000 = v[0], v100 = v[1], v010 = v[sj], v110 = v[sj + 1];
+    const tReal v001 = v[sk], v101 = v[sk + 1], v011 = v[sk + sj], v111 = v[sk + sj + 1];
+
+    // along x, then y, then z
+    const tReal x00 = v000 + f.x*(v100 - v000), x10 = v010 + f.x*(v110 - v010);
+    const tReal x01 = v001 + f.x*(v101 - v001), x11 = v011 + f.x*(v111 - v011);
+    const tReal y0 = x00 + f.y*(x10 - x00), y1 = x01 + f.y*(x11 - x01);
+    const tReal phi = y0 + f.z*(y1 - y0) + glm::length(g - c)*_dx;
+    if(phi>max_dist) return false;
+
+    const tReal dy0 = (1 - f.x)*(v010 - v000) + f.x*(v110 - v100);
+    const tReal dy1 = (1 - f.x)*(v011 - v001) + f.x*(v111 - v101);
+    const glm::vec3 grad(
+      (1 - f.z)*((1 - f.y)*(v100 - v000) + f.y*(v110 - v010)) +
+      f.z*((1 - f.y)*(v101 - v001) + f.y*(v111 - v011)),
+      (1 - f.z)*dy0 + f.z*dy1,
+      y1 - y0);
+    const tReal l = glm::length(grad);
+    if(l<=0) return false;
+    n = grad/l;
+    q = p - phi*n;
+    return true;
+  }
+
+  const glm::ivec3 &resolution() const { return _n; }
+  tReal cellSize() const { return _dx; }
+  bool fromCache() const { return _fromCache; }
+  double bakeMs() const { return _bakeMs; }
+
+private:
+  std::size_t index(const int i, const int j, const int k) const
+  { return (std::size_t(k)*_n.y + j)*_n.x + i; }
+  glm::vec3 point(const int i, const int j, const int k) const
+  { return _origin + _dx*glm::vec3(i, j, k); }
+
+  void bake(const std::vector<glm::vec3> &v, const std::vector<glm::uvec3> &tris)
+  {
+    const std::size_t size = std::size_t(_n.x)*_n.y*_n.z;
+    const tReal far = (_n.x + _n.y + _n.z)*_dx;
+    _phi.assign(size, far);
+    std::vector<char> exact(size, 0);
+
+    // exact unsigned distance in the band
+    Bvh bvh;
+    bvh.build(v, tris);
+    const tReal band = kBand*_dx;
+#pragma omp parallel for schedule(dynamic)
+    for(int k=0; k<_n.z; ++k)
+      for(int j=0; j<_n.y; ++j)
+        for(int i=0; i<_n.x; ++i) {
+          Bvh::Hit hit;
+          if(!bvh.closest(point(i, j, k), band, hit)) continue;
+          _phi[index(i, j, k)] = std::sqrt(hit.dist2);
+          exact[index(i, j, k)] = 1;
+        }
+
+    // the rest: |grad phi| = 1 by upwind (Godunov) updates, sweeping in the
+    // eight orders of the axes
+    for(int pass=0; pass<2; ++pass)
+      for(int o=0; o<8; ++o) {
+        const int di = o & 1 ? -1 : 1, dj = o & 2 ? -1 : 1, dk = o & 4 ? -1 : 1;
+        for(int k=dk>0 ? 0 : _n.z - 1; k>=0 && k<_n.z; k+=dk)
+          for(int j=dj>0 ? 0 : _n.y - 1; j>=0 && j<_n.y; j+=dj)
+            for(int i=di>0 ? 0 : _n.x - 1; i>=0 && i<_n.x; i+=di) {
+              const std::size_t id = index(i, j, k);
+              if(!exact[id]) _phi[id] = std::min(_phi[id], solveEikonal(i, j, k, far));
+            }
+      }
+
+    // inside: an odd number of crossings along +x up to the point
+    std::vector<int> crossings(size, 0);
+    // rays off the grid lines by irrational fractions of a cell, so that
+    // they do not go through the edges of axis-aligned meshes
+    const tReal ey = 0.0001371f*_dx, ez = 0.0002269f*_dx;
+    for(const glm::uvec3 &t : tris) {
+      const glm::vec3 &a = v[t[0]], &b = v[t[1]], &c = v[t[2]];
+      const tReal e1y = b.y - a.y, e1z = b.z - a.z, e2y = c.y - a.y, e2z = c.z - a.z;
+      const tReal det = e1y*e2z - e1z*e2y;
+      if(det==0) continue;      // parallel to the rays
+      const glm::vec3 tlo = glm::min(a, glm::min(b, c)), thi = glm::max(a, glm::max(b, c));
+      const int j0 = std::max(0, static_cast<int>(std::ceil((tlo.y - _origin.y - ey)/_dx)));
+      const int j1 = std::min(_n.y - 1, static_cast<int>(std::floor((thi.y - _origin.y - ey)/_dx)));
+      const int k0 = std::max(0, static_cast<int>(std::ceil((tlo.z - _origin.z - ez)/_dx)));
+      const int k1 = std::min(_n.z - 1, static_cast<int>(std::floor((thi.z - _origin.z - ez)/_dx)));
+      for(int k=k0; k<=k1; ++k)
+        for(int j=j0; j<=j1; ++j) {
+          const tReal py = _origin.y + j*_dx + ey - a.y, pz = _origin.z + k*_dx + ez - a.z;
+          const tReal s = (py*e2z - pz*e2y)/det, r = (e1y*pz - e1z*py)/det;
+          if(s<0 || r<0 || s + r>1) continue;
+          const tReal x = a.x + s*(b.x - a.x) + r*(c.x - a.x);
+          const int i = std::max(0, static_cast<int>(std::ceil((x - _origin.x)/_dx)));
+          if(i<_n.x) ++crossings[index(i, j, k)];
+        }
+    }
+#pragma omp parallel for schedule(static)
+    for(int k=0; k<_n.z; ++k)
+      for(int j=0; j<_n.y; ++j) {
+        int count = 0;
+        for(int i=0; i<_n.x; ++i) {
+          count += crossings[index(i, j, k)];
+          if(count & 1) _phi[index(i, j, k)] = -_phi[index(i, j, k)];
+        }
+      }
+  }
+
+  // the distance at (i, j, k) from its smallest neighbor along each axis
+  tReal solveEikonal(const int i, const int j, const int k, const tReal far) const
+  {
+    tReal d[3] = { far, far, far };
+    if(i>0) d[0] = std::min(d[0], _phi[index(i - 1, j, k)]);
+    if(i<_n.x - 1) d[0] = std::min(d[0], _phi[index(i + 1, j, k)]);
+    if(j>0) d[1] = std::min(d[1], _phi[index(i, j - 1, k)]);
+    if(j<_n.y - 1) d[1] = std::min(d[1], _phi[index(i, j + 1, k)]);
+    if(k>0) d[2] = std::min(d[2], _phi[index(i, j, k - 1)]);
+    if(k<_n.z - 1) d[2] = std::min(d[2], _phi[index(i, j, k + 1)]);
+    std::sort(d, d + 3);
+    const tReal h = _dx;
+    tReal x = d[0] + h;
+    if(x>d[1]) {
+      x = (d[0] + d[1] + std::sqrt(2*h*h - (d[0] - d[1])*(d[0] - d[1])))/2;
+      if(x>d[2]) {
+        const tReal s = d[0] + d[1] + d[2];
+        const tReal s2 = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+        x = (s + std::sqrt(std::max<tReal>(0, s*s - 3*(s2 - h*h))))/3;
+      }
+    }
+    return x;
+  }
+
+  // FNV-1a over the grid parameters and the mesh
+  std::uint64_t hash(const std::vector<glm::vec3> &v, const std::vector<glm::uvec3> &tris) const
+  {
+    std::uint64_t h = 14695981039346656037ull;
+    const auto add = [&h](const void *data, const std::size_t bytes) {
+      const unsigned char *c = static_cast<const unsigned char *>(data);
+      for(std::size_t k=0; k<bytes; ++k) h = (h ^ c[k])*1099511628211ull;
+    };
+    const int version = kVersion, band = kBand;
+    add(&version, sizeof(version));
+    add(&band, sizeof(band));
+    add(&_dx, sizeof(_dx));
+    add(v.data(), v.size()*sizeof(glm::vec3));
+    add(tris.data(), tris.size()*sizeof(glm::uvec3));
+    return h;
+  }
+
+  enum { kVersion = 1 };
+  struct Header {
+    char magic[8];
+    std::uint64_t key;
+    std::int32_t n[3];
+    float origin[3], dx;
+  };
+  static const char *magic() { return "PBDSDF1"; }
+
+  // false if there is no such file or it does not match
+  bool load(const std::string &path, const std::uint64_t key)
+  {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    Header hd;
+    if(!in || !in.read(reinterpret_cast<char *>(&hd), sizeof(hd))) return false;
+    if(std::strncmp(hd.magic, magic(), sizeof(hd.magic)) || hd.key!=key ||
+       hd.n[0]!=_n.x || hd.n[1]!=_n.y || hd.n[2]!=_n.z) return false;
+    _phi.resize(std::size_t(_n.x)*_n.y*_n.z);
+    return static_cast<bool>(in.read(reinterpret_cast<char *>(_phi.data()), _phi.size()*sizeof(float)));
+  }
+  // best effort: a field that cannot be stored is baked again next time
+  void save(const std::string &path, const std::uint64_t key) const
+  {
+    std::ofstream out(path.c_str(), std::ios::binary);
+    if(!out) return;
+    Header hd;
+    std::memset(&hd, 0, sizeof(hd));
+    std::strncpy(hd.magic, magic(), sizeof(hd.magic));
+    hd.key = key;
+    for(int c=0; c<3; ++c) {
+      hd.n[c] = _n[c];
+      hd.origin[c] = _origin[c];
+    }
+    hd.dx = _dx;
+    out.write(reinterpret_cast<const char *>(&hd), sizeof(hd));
+    out.write(reinterpret_cast<const char *>(_phi.data()), _phi.size()*sizeof(float));
+  }
+
+  tReal _dx;                    // cell size
+  glm::vec3 _origin;            // grid point (0, 0, 0)
+  glm::ivec3 _n;                // grid points per axis
+  std::vector<float> _phi;      // negative inside; x fastest
+  bool _fromCache;
+  double _bakeMs;
+};
+
+#endif  /* _SDFCOLLIDER_HPP_ */
@@ -0,0 +1,88 @@
+// ----------------------------------------------------------------------------
+// SpatialHash.hpp
+//
+// Description: Dense spatial hash of particles (Teschner et al. 2003, in the
+//   layout of Mueller's "Ten Minute Physics"). The grid cells are hashed into
+//   a table of about 2n buckets; a counting sort lays the particle indices
+//   out bucket by bucket in one array, so a rebuild allocates nothing once
+//   the arrays have grown and there are no per-cell containers. Queries only
+//   read the table and may run concurrently, each thread with its Visitor.
+// ----------------------------------------------------------------------------
+
+#ifndef _SPATIALHASH_HPP_
+#define _SPATIALHASH_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "typedefs.hpp"
+#include "ParticleStore.hpp"
+
+class SpatialHash {
+public:
+  // the first n particles of x in cells of the given size
+  void build(const ParticleStore &x, const tUint n, const tReal cell)
+  {
+    _invCell = 1/cell;
+    _size = std::max<tUint>(2*n, 1);
+    _start.assign(_size + 1, 0);
+    _bucket.resize(n);
+    _entries.resize(n);
+
+#pragma omp parallel for schedule(static) if(n>=16384)
+    for(long i=0; i<static_cast<long>(n); ++i) _bucket[i] = bucketOf(cellOf(x.get(i)));
+    for(tUint i=0; i<n; ++i) ++_start[_bucket[i] + 1];
+    for(tUint b=0; b<_size; ++b) _start[b + 1] += _start[b];
+    _fill.assign(_start.begin(), _start.end() - 1);
+    for(tUint i=0; i<n; ++i) _entries[_fill[_bucket[i]]++] = i;
+  }
+
+  // per-thread query state: the buckets seen by the current query
+  struct Visitor {
+    std::vector<tUint> stamp;
+    tUint pass = 0;
+  };
+
+  // f(j) for every particle j hashed into a cell that meets the box [lo, hi];
+  // it may also see particles of other cells that share a bucket, but sees
+  // each particle once
+  template<typename F>
+  void query(const glm::vec3 &lo, const glm::vec3 &hi, Visitor &v, F f) const
+  {
+    if(v.stamp.size()!=_size || ++v.pass==0) {
+      v.stamp.assign(_size, 0);
+      v.pass = 1;
+    }
+    const glm::ivec3 c0 = cellOf(lo), c1 = cellOf(hi);
+    for(int i=c0.x; i<=c1.x; ++i)
+      for(int j=c0.y; j<=c1.y; ++j)
+        for(int k=c0.z; k<=c1.z; ++k) {
+          const tUint b = bucketOf(glm::ivec3(i, j, k));
+          if(v.stamp[b]==v.pass) continue;
+          v.stamp[b] = v.pass;
+          for(tUint e=_start[b]; e<_start[b + 1]; ++e) f(_entries[e]);
+        }
+  }
+
+private:
+  glm::ivec3 cellOf(const glm::vec3 &p) const
+  { return glm::ivec3(glm::floor(p*_invCell)); }
+  tUint bucketOf(const glm::ivec3 &c) const
+  {
+    const tUint h = (static_cast<tUint>(c.x)*92837111u) ^ (static_cast<tUint>(c.y)*689287499u) ^
+      (static_cast<tUint>(c.z)*283923481u);
+    return h%_size;
+  }
+
+  tReal _invCell = 1;
+  tUint _size = 1;
+  std::vector<tUint> _start;    // CSR into _entries, per bucket
+  std::vector<tUint> _entries;  // particle indices by bucket
+  std::vector<tUint> _bucket;   // per particle
+  std::vector<tUint> _fill;
+};
+
+#endif  /* _SPATIALHASH_HPP_ */
@@ -39,6 +39,7 @@
 #include <memory>
 #include <algorithm>
 #include <exception>
+#include <chrono>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -49,6 +50,7 @@
 #include "Mesh.h"
 
 #include "PbdSolver.hpp"
+#include "SdfCollider.hpp"
 
 // window parameters
 GLFWwindow *g_window = nullptr;
@@ -73,6 +75,24 @@ float g_appTimer = 0.0;
 float g_appTimerLastClockTime;
 bool g_appTimerStoppedP = true;
 
+// XPBD small steps (key X)
+const tUint kSubsteps = 20;
+const tReal kBendCompliance = 1e-3f;
+
+// optional obstacle under the cloth (first argument), fit in a sphere of
+// kObstacleRadius at kObstacleCenter
+std::string g_obstacleFile;
+const float kObstacleRadius = 0.3f;
+const glm::vec3 kObstacleCenter(0.f, -0.5f, 0.f);
+// its signed distance field (key D): cells and cache directory
+const float kObstacleSdfCell = kObstacleRadius/64;
+const char *const kSdfCacheDir = "data";
+
+// several cloths (key M): a kClothGrid x kClothGrid grid of smaller ones,
+// stepped concurrently; step times are reported every kReportSteps steps
+const int kClothGrid = 4;
+const int kReportSteps = 60;
+
 // textures
 unsigned int g_availableTextureSlot = 0;
 
@@ -240,19 +260,40 @@ struct Light {
   }
 };
 
+// one cloth: its solver and its mesh, whose vertices start at `first` in the
+// mesh of all cloths
+struct ClothInstance {
+  PbdSolver solver;
+  Mesh mesh;
+  std::size_t first = 0;
+  double stepMs = 0;            // since the last report
+};
+
 struct Scene {
   Light light;
 
+  // the settings of the cloth solvers, copied to every instance on reset
   PbdSolver solver = PbdSolver();
+  std::vector< std::unique_ptr<ClothInstance> > instances;
+  bool clothGrid = false;
+  double stepMs = 0;            // since the last report
+  int reportSteps = 0;
 
-  // meshes
+  // meshes; cloth: all the instances, uploaded at once
   std::shared_ptr<Mesh> cloth = nullptr;
   std::shared_ptr<Mesh> plane = nullptr;
+  std::shared_ptr<Mesh> obstacle = nullptr;
 
   // transformation matrices
   glm::mat4 clothMat = glm::mat4(1.0);
   glm::mat4 planeMat = glm::mat4(1.0);
   glm::mat4 floorMat = glm::mat4(1.0);
+  glm::mat4 obstacleMat = glm::mat4(1.0);
+
+  // colliders; the obstacle as a BVH or a signed distance field
+  std::vector< std::shared_ptr<const Collider> > walls;
+  std::shared_ptr<const Collider> obstacleBvh, obstacleSdf;
+  bool obstacleSdfOn = false;
 
   glm::vec3 scene_center = glm::vec3(0);
   float scene_radius = 1.f;
@@ -267,11 +308,106 @@ struct Scene {
 
   void resetSim()
   {
+    const int grid = clothGrid ? kClothGrid : 1;
+    const float size = clothGrid ? 0.4f : 0.8f, spacing = 0.5f;
+    instances.clear();
     cloth = std::make_shared<Mesh>();
-    cloth->addCloth(15, 15, 0.8f, 0.8f);
+    for(int i=0; i<grid; ++i)
+      for(int j=0; j<grid; ++j) {
+        instances.push_back(std::unique_ptr<ClothInstance>(new ClothInstance()));
+        ClothInstance &c = *instances.back();
+        c.mesh.addCloth(15, 15, size, size);
+        const glm::vec3 offset(spacing*(i - 0.5f*(grid - 1)), 0.f, spacing*(j - 0.5f*(grid - 1)));
+        for(glm::vec3 &p : c.mesh.vertexPositions()) p += offset;
+
+        // one solver per cloth, quiet but for a single one
+        c.solver = solver;
+        c.solver.setVerbose(grid==1);
+        c.solver.initSim(c.mesh);
+
+        // appended to the mesh of all cloths
+        c.first = cloth->vertexPositions().size();
+        const GLuint base = static_cast<GLuint>(c.first);
+        for(const glm::uvec3 &t : c.mesh.triangleIndices())
+          cloth->triangleIndices().push_back(t + glm::uvec3(base));
+        cloth->vertexPositions().insert(
+          cloth->vertexPositions().end(), c.mesh.vertexPositions().begin(), c.mesh.vertexPositions().end());
+        cloth->vertexNormals().insert(
+          cloth->vertexNormals().end(), c.mesh.vertexNormals().begin(), c.mesh.vertexNormals().end());
+        cloth->vertexTexCoords().insert(
+          cloth->vertexTexCoords().end(), c.mesh.vertexTexCoords().begin(), c.mesh.vertexTexCoords().end());
+      }
+    cloth->setStreaming(true);
     cloth->init();
+    stepMs = 0;
+    reportSteps = 0;
+  }
 
-    solver.initSim(*cloth);
+  // steps every cloth, as tasks of a single team so that idle threads take
+  // the waiting cloths; the solvers then run serially within their task.
+  // The cloths write their vertices straight into the streamed slot of the
+  // mesh of all cloths, which is uploaded once per step.
+  void step(const tReal dt)
+  {
+    typedef std::chrono::steady_clock tClock;
+    const tClock::time_point t0 = tClock::now();
+    const int n = static_cast<int>(instances.size());
+    const Mesh::StreamSlot slot = cloth->beginStream();
+#pragma omp parallel if(n>1)
+#pragma omp single
+    for(int k=0; k<n; ++k) {
+#pragma omp task firstprivate(k)
+      {
+        ClothInstance &c = *instances[k];
+        const tClock::time_point s0 = tClock::now();
+        c.solver.step(dt);
+        c.solver.updateMesh(c.mesh);
+        std::copy(c.mesh.vertexPositions().begin(), c.mesh.vertexPositions().end(), slot.positions + c.first);
+        std::copy(c.mesh.vertexNormals().begin(), c.mesh.vertexNormals().end(), slot.normals + c.first);
+        c.stepMs += std::chrono::duration<double, std::milli>(tClock::now() - s0).count();
+      }
+    }
+    cloth->endStream();
+    stepMs += std::chrono::duration<double, std::milli>(tClock::now() - t0).count();
+
+    if(n>1 && ++reportSteps==kReportSteps) {
+      std::cout << "> " << n << " cloths: " << stepMs/reportSteps << " ms per step; per cloth:"
+                << std::fixed << std::setprecision(2);
+      for(int k=0; k<n; ++k) {
+        std::cout << (k%8 ? " " : "\n   ") << instances[k]->stepMs/reportSteps;
+        instances[k]->stepMs = 0;
+      }
+      std::cout << std::defaultfloat << std::setprecision(6) << std::endl;
+      stepMs = 0;
+      reportSteps = 0;
+    }
+  }
+
+  void setColliders()
+  {
+    setColliders(solver);
+    for(const std::unique_ptr<ClothInstance> &c : instances) setColliders(c->solver);
+  }
+
+  void setColliders(PbdSolver &target)
+  {
+    target.clearColliders();
+    for(const std::shared_ptr<const Collider> &c : walls) target.addCollider(c);
+    if(!obstacle) return;
+    if(!obstacleSdfOn) {
+      target.addCollider(obstacleBvh);
+      return;
+    }
+    if(!obstacleSdf) {
+      std::shared_ptr<SdfCollider> sdf = std::make_shared<SdfCollider>(
+        *obstacle, obstacleMat, kObstacleSdfCell, kSdfCacheDir);
+      std::cout << "> obstacle SDF " << sdf->resolution().x << "x" << sdf->resolution().y << "x"
+                << sdf->resolution().z;
+      if(sdf->fromCache()) std::cout << " loaded from " << kSdfCacheDir << std::endl;
+      else std::cout << " baked in " << sdf->bakeMs() << " ms" << std::endl;
+      obstacleSdf = sdf;
+    }
+    target.addCollider(obstacleSdf);
   }
 
   void render()
@@ -291,9 +427,13 @@ struct Scene {
     shadomMapShader->set("depthMVP", light.depthMVP*floorMat);
     plane->render();
 
+    if(obstacle) {
+      shadomMapShader->set("depthMVP", light.depthMVP*obstacleMat);
+      obstacle->render();
+    }
+
     glDisable(GL_CULL_FACE);
     shadomMapShader->set("depthMVP", light.depthMVP*clothMat);
-    cloth->bufferData(true, true);
     cloth->render();
 
     if(saveShadowMapsPpm) {
@@ -343,6 +483,14 @@ struct Scene {
     mainShader->set("normMat", glm::mat3(glm::inverseTranspose(floorMat)));
     plane->render();
 
+    // obstacle
+    if(obstacle) {
+      mainShader->set("material.albedo", glm::vec3(0.6, 0.6, 0.6));
+      mainShader->set("modelMat", obstacleMat);
+      mainShader->set("normMat", glm::mat3(glm::inverseTranspose(obstacleMat)));
+      obstacle->render();
+    }
+
     // cloth
     mainShader->set("material.albedo", glm::vec3(1, 0.71, 0.29));
     mainShader->set("material.albedoTex", (int)g_albedoTexOnGPU);
@@ -350,7 +498,6 @@ struct Scene {
     mainShader->set("material.normalTexLoaded", 0);
     mainShader->set("modelMat", clothMat);
     mainShader->set("normMat", glm::mat3(glm::inverseTranspose(clothMat)));
-    cloth->bufferData(true, true);
     cloth->render();
 
     mainShader->stop();
@@ -389,11 +536,16 @@ void printHelp()
     "    * Middle button: zoom" << std::endl <<
     "    * Right button: pan camera" << std::endl <<
     "    Keyboard commands:" << std::endl <<
+    "    * C: toggle self-collision and reset" << std::endl <<
+    "    * D: toggle the obstacle collider between BVH and signed distance field" << std::endl <<
     "    * H: print this help" << std::endl <<
+    "    * J: toggle Jacobi (Chebyshev) iterations and reset" << std::endl <<
+    "    * M: toggle one cloth / a grid of cloths and reset" << std::endl <<
     "    * P: toggle simulation" << std::endl <<
     "    * R: reset simulation" << std::endl <<
     "    * S: save a screenshot" << std::endl <<
     "    * W: toggle wireframe/surface rendering" << std::endl <<
+    "    * X: toggle XPBD small steps and reset" << std::endl <<
     "    * ESC: quit the program" << std::endl;
 }
 
@@ -420,6 +572,28 @@ void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods
   } else if(action == GLFW_PRESS && key == GLFW_KEY_W) {
     g_polygonMode = (g_polygonMode==GL_FILL) ? GL_LINE : GL_FILL;
     glPolygonMode(GL_FRONT_AND_BACK, g_polygonMode);
+  } else if(action == GLFW_PRESS && key == GLFW_KEY_C) {
+    g_scene.solver.setSelfCollision(!g_scene.solver.selfCollision());
+    std::cout << "> self-collision " << (g_scene.solver.selfCollision() ? "on" : "off") << std::endl;
+    g_scene.resetSim();
+  } else if(action == GLFW_PRESS && key == GLFW_KEY_D) {
+    if(g_scene.obstacle) {
+      g_scene.obstacleSdfOn = !g_scene.obstacleSdfOn;
+      g_scene.setColliders();
+      std::cout << "> obstacle collider: " << (g_scene.obstacleSdfOn ? "SDF" : "BVH") << std::endl;
+    }
+  } else if(action == GLFW_PRESS && key == GLFW_KEY_M) {
+    g_scene.clothGrid = !g_scene.clothGrid;
+    g_scene.resetSim();
+  } else if(action == GLFW_PRESS && key == GLFW_KEY_J) {
+    g_scene.solver.setJacobi(!g_scene.solver.jacobi());
+    std::cout << "> " << (g_scene.solver.jacobi() ? "Jacobi" : "Gauss-Seidel") << " iterations" << std::endl;
+    g_scene.resetSim();
+  } else if(action == GLFW_PRESS && key == GLFW_KEY_X) {
+    if(g_scene.solver.substeps()) g_scene.solver.setSmallSteps(0);
+    else g_scene.solver.setSmallSteps(kSubsteps, 0, kBendCompliance);
+    std::cout << "> " << (g_scene.solver.substeps() ? "XPBD small steps" : "PBD") << std::endl;
+    g_scene.resetSim();
   } else if(action == GLFW_PRESS && key == GLFW_KEY_ESCAPE) {
     glfwSetWindowShouldClose(window, true); // Closes the application if the escape key is pressed
   }
@@ -519,6 +693,7 @@ void clear()
   g_cam.reset();
   g_scene.cloth.reset();
   g_scene.plane.reset();
+  g_scene.obstacle.reset();
   g_scene.mainShader.reset();
   g_scene.shadomMapShader.reset();
   glfwDestroyWindow(g_window);
@@ -539,6 +714,8 @@ void initOpenGL()
   // Load extensions for modern OpenGL
   if(!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
     exitOnCriticalError("[Failed to initialize OpenGL context]");
+  if(!Mesh::loadStreamingFunctions((GLADloadproc)glfwGetProcAddress))
+    std::cout << "> No buffer storage: dynamic meshes streamed by glBufferSubData" << std::endl;
 
 #ifdef SUPPORT_OPENGL_45
   // supported from OpenGL 4.3
@@ -586,6 +763,27 @@ void initScene()
     g_scene.planeMat = glm::translate(glm::mat4(1.0), glm::vec3(0, 0, -1.0));
     g_scene.floorMat = glm::translate(glm::mat4(1.0), glm::vec3(0, -1.0, 0))*
       glm::rotate(glm::mat4(1.0), (float)(-0.5f*M_PI), glm::vec3(1.0, 0.0, 0.0));
+
+    // the cloth collides with the back wall, the floor and the obstacle
+    g_scene.walls.push_back(std::make_shared<MeshCollider>(*g_scene.plane, g_scene.planeMat));
+    g_scene.walls.push_back(std::make_shared<MeshCollider>(*g_scene.plane, g_scene.floorMat));
+    if(!g_obstacleFile.empty()) {
+      g_scene.obstacle = std::make_shared<Mesh>();
+      try {
+        loadOFF(g_obstacleFile, g_scene.obstacle);
+      } catch(std::exception &e) {
+        exitOnCriticalError(std::string("[Error loading mesh]") + e.what());
+      }
+      g_scene.obstacle->init();
+      glm::vec3 center;
+      float radius;
+      g_scene.obstacle->computeBoundingSphere(center, radius);
+      g_scene.obstacleMat = glm::translate(glm::mat4(1.0), kObstacleCenter)*
+        glm::scale(glm::mat4(1.0), glm::vec3(kObstacleRadius/std::max(radius, 1e-6f)))*
+        glm::translate(glm::mat4(1.0), -center);
+      g_scene.obstacleBvh = std::make_shared<MeshCollider>(*g_scene.obstacle, g_scene.obstacleMat);
+    }
+    g_scene.setColliders();
   }
 
   // Load textures
@@ -647,8 +845,7 @@ void update(const float currentTime)
   const float dt = currentTime - g_appTimerLastClockTime;
 
   if(!g_appTimerStoppedP) {
-    g_scene.solver.step(std::min(dt, 0.017f)); // solve for the next step; avoid any chances of too large time step
-    g_scene.solver.updateMesh(*(g_scene.cloth));
+    g_scene.step(std::min(dt, 0.017f)); // solve for the next step; avoid any chances of too large time step
   }
 
   g_appTimerLastClockTime = currentTime;
@@ -657,6 +854,7 @@ void update(const float currentTime)
 
 int main(int argc, char **argv)
 {
+  if(argc>1) g_obstacleFile = argv[1];
   init();
   while(!glfwWindowShouldClose(g_window)) {
     update(static_cast<float>(glfwGetTime()));
@@ -0,0 +1,69 @@
+// ----------------------------------------------------------------------------
+// bench_fixed.cpp
+//
+// Description: Dynamic SmokeSolver vs. SmokeSolverFixed<NX, NY> on the preset
+//   resolutions
+// ----------------------------------------------------------------------------
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+
+#include "../src/SmokeSolver.hpp"
+
+namespace {
+
+// seconds per solvePressure() call, best of a few batches
+template<typename S>
+double timeSolve(const int nx, const int ny, const int calls)
+{
+  typedef typename S::tGridF G;
+  S solver;
+  solver.initScene(nx, ny, glm::vec2(nx/2, ny/8), glm::vec2(nx/16, nx/16));
+
+  std::unique_ptr<G> u(new G(nx, ny)), v(new G(nx, ny)), p(new G(nx, ny));
+  for(int j=0; j<ny; ++j)
+    for(int i=0; i<nx; ++i) {
+      (*u)(i, j) = 0.01f*((i*7 + j*3)%11);
+      (*v)(i, j) = 0.01f*((i*5 + j*13)%7);
+    }
+
+  double best = 1e30;
+  for(int r=0; r<4; ++r) {
+    const auto t0 = std::chrono::steady_clock::now();
+    for(int c=0; c<calls; ++c) solver.solvePressure(*p, *u, *v, solver.timestep());
+    const auto t1 = std::chrono::steady_clock::now();
+    if(r>0) best = std::min(best, std::chrono::duration<double>(t1 - t0).count()/calls);
+  }
+  return best;
+}
+
+template<int NX, int NY>
+void compare(const int calls)
+{
+  const double td = timeSolve<SmokeSolver>(NX, NY, calls);
+  const double tf = timeSolve< SmokeSolverFixed<NX, NY> >(NX, NY, calls);
+  std::cout << std::setw(5) << NX << "x" << std::setw(4) << std::left << NY << std::right
+            << std::fixed << std::setprecision(2)
+            << std::setw(14) << td*1e6 << std::setw(14) << tf*1e6
+            << std::setw(10) << td/tf << "x" << std::endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  const int calls = (argc>1) ? std::atoi(argv[1]) : 200;
+
+  std::cout << "solvePressure (80 Jacobi sweeps), us per call" << std::endl;
+  std::cout << std::setw(10) << "grid" << std::setw(14) << "dynamic"
+            << std::setw(14) << "fixed" << std::setw(11) << "speedup" << std::endl;
+  compare<32, 64>(calls);
+  compare<64, 64>(calls);
+  compare<64, 128>(calls);
+  compare<128, 128>(calls/4);
+  compare<128, 256>(calls/4);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,85 @@
+// ----------------------------------------------------------------------------
+// bench_pressure.cpp
+//
+// Description: Pressure relaxation benchmark; plain vs. temporally blocked
+//   Jacobi across grid sizes, reported as effective memory bandwidth
+// ----------------------------------------------------------------------------
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <random>
+
+#include "../src/SmokeSolver.hpp"
+
+namespace {
+
+// one Jacobi sweep nominally reads p and rhs and writes p; the bit-packed
+// cell types add 2 bits per cell and are left out
+const double kBytesPerCellSweep = 3*sizeof(tReal);
+
+double run(
+  const SmokeSolver &solver, const Grid2f &p0, const Grid2f &rhs,
+  const int sweeps, const bool blocked, const int tile, const int spt,
+  Grid2f &p)
+{
+  Grid2f tmp(p0.resX(), p0.resY());
+  p = p0;
+  const auto t0 = std::chrono::steady_clock::now();
+  if(blocked)
+    solver.relaxPressureBlocked(p, tmp, rhs, sweeps, tile, spt);
+  else
+    solver.relaxPressure(p, tmp, rhs, sweeps);
+  const auto t1 = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(t1 - t0).count();
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  const int sweeps = (argc>1) ? std::atoi(argv[1]) : 64;
+  const int tile = (argc>2) ? std::atoi(argv[2]) : 64;
+  const int spt = (argc>3) ? std::atoi(argv[3]) : 8;
+
+  std::cout << "sweeps=" << sweeps << " tile=" << tile
+            << " sweeps_per_tile=" << spt << std::endl;
+  std::cout << std::setw(12) << "grid"
+            << std::setw(14) << "jacobi[ms]" << std::setw(12) << "GB/s"
+            << std::setw(14) << "blocked[ms]" << std::setw(12) << "GB/s"
+            << std::setw(12) << "max|diff|" << std::endl;
+
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<tReal> dist(-1, 1);
+  for(int n=128; n<=4096; n*=2) {
+    SmokeSolver solver;
+    solver.initScene(n, n, glm::vec2(n/2, n/8), glm::vec2(n/16, n/16));
+
+    Grid2f p0(n, n), rhs(n, n), pa, pb;
+    for(int j=1; j<n-1; ++j)
+      for(int i=1; i<n-1; ++i) rhs(i, j) = dist(rng);
+
+    // warm-up, then take the best of a few repetitions
+    const int reps = (n<=1024) ? 5 : 2;
+    double ta = 1e30, tb = 1e30;
+    for(int r=0; r<=reps; ++r) {
+      const double a = run(solver, p0, rhs, sweeps, false, tile, spt, pa);
+      const double b = run(solver, p0, rhs, sweeps, true, tile, spt, pb);
+      if(r>0) { ta = std::min(ta, a); tb = std::min(tb, b); }
+    }
+
+    tReal diff = 0;
+    for(int j=0; j<n; ++j)
+      for(int i=0; i<n; ++i) diff = std::max(diff, std::abs(pa(i, j) - pb(i, j)));
+
+    const double bytes = kBytesPerCellSweep*n*n*sweeps;
+    std::cout << std::setw(7) << n << "x" << std::setw(4) << std::left << n << std::right
+              << std::fixed << std::setprecision(2)
+              << std::setw(14) << ta*1e3 << std::setw(12) << bytes/ta*1e-9
+              << std::setw(14) << tb*1e3 << std::setw(12) << bytes/tb*1e-9
+              << std::setw(12) << std::scientific << diff << std::endl;
+  }
+
+  return EXIT_SUCCESS;
+}
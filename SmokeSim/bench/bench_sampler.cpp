@@ -0,0 +1,118 @@
+// ----------------------------------------------------------------------------
+// bench_sampler.cpp
+//
+// Description: Quality vs. cost of the grid samplers; semi-Lagrangian
+//   advection of a smooth bump and a slotted disk through one full solid-body
+//   rotation, with bilinear and monotone cubic interpolation, at the full and
+//   the halved resolution. Both fields share the departure points, so the
+//   stencils are built once. Timed with the kernels picked at run time and
+//   with the scalar ones.
+//
+// Usage: bench_sampler [<res>]
+// ----------------------------------------------------------------------------
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+
+#include "../src/SmokeSolver.hpp"
+
+namespace {
+
+const tReal kPi = 3.14159265f;
+
+// on the unit square; bump and Zalesak's slotted disk
+tReal bump(const tReal x, const tReal y)
+{
+  return std::exp(-(square(x - 0.5f) + square(y - 0.75f))/0.005f);
+}
+tReal disk(const tReal x, const tReal y)
+{
+  const bool in = square(x - 0.5f) + square(y - 0.25f)<square(0.15f);
+  const bool slot = std::abs(x - 0.5f)<0.025f && y<0.35f;
+  return (in && !slot) ? 1 : 0;
+}
+
+struct Result { double msPerStep, errBump, errDisk, overshoot; };
+
+Result run(const int n, const SampleMode mode)
+{
+  Grid2f a(n, n), b(n, n), c(n, n), d(n, n);
+  for(int j=0; j<n; ++j)
+    for(int i=0; i<n; ++i) {
+      a(i, j) = bump((i+0.5f)/n, (j+0.5f)/n);
+      c(i, j) = disk((i+0.5f)/n, (j+0.5f)/n);
+    }
+
+  // one revolution around the center at a CFL number of about 1
+  const int steps = static_cast<int>(kPi*n);
+  const tReal angle = 2*kPi/steps;
+  SampleStencilBatch st(n*n, mode);
+  for(int j=0; j<n; ++j)
+    for(int i=0; i<n; ++i) {
+      // exact departure point of the rotation
+      const tReal x = i + 0.5f - 0.5f*n, y = j + 0.5f - 0.5f*n;
+      const tReal xd = std::cos(angle)*x + std::sin(angle)*y;
+      const tReal yd = -std::sin(angle)*x + std::cos(angle)*y;
+      st.set(j*n + i, xd + 0.5f*n - 0.5f, yd + 0.5f*n - 0.5f, n, n);
+    }
+
+  const auto t0 = std::chrono::steady_clock::now();
+  for(int s=0; s<steps; ++s) {
+#pragma omp parallel for
+    for(int j=0; j<n; ++j) {
+      sampleStencils(a.data(), n, st, j*n, (j+1)*n, &b(0, j));
+      sampleStencils(c.data(), n, st, j*n, (j+1)*n, &d(0, j));
+    }
+    a.swap(b);
+    c.swap(d);
+  }
+  const auto t1 = std::chrono::steady_clock::now();
+
+  Result r = { std::chrono::duration<double, std::milli>(t1 - t0).count()/steps, 0, 0, 0 };
+  for(int j=0; j<n; ++j)
+    for(int i=0; i<n; ++i) {
+      r.errBump += std::abs(a(i, j) - bump((i+0.5f)/n, (j+0.5f)/n));
+      r.errDisk += std::abs(c(i, j) - disk((i+0.5f)/n, (j+0.5f)/n));
+      r.overshoot = std::max(r.overshoot, static_cast<double>(std::max(c(i, j) - 1, -c(i, j))));
+    }
+  r.errBump /= n*n;             // L1 over the unit square
+  r.errDisk /= n*n;
+  return r;
+}
+
+void report(const int n, const SampleMode mode)
+{
+  const SmokeSimdLevel best = smokeSimdLevel();
+  setSmokeSimdLevel(kSmokeSimdScalar);
+  const double scalar_ms = run(n, mode).msPerStep;
+  setSmokeSimdLevel(best);
+  const Result r = run(n, mode);
+  std::cout << std::setw(6) << n << std::setw(9) << ((mode==kSampleCubic) ? "cubic" : "linear")
+            << std::fixed << std::setprecision(3) << std::setw(11) << r.msPerStep
+            << std::setw(11) << scalar_ms
+            << std::scientific << std::setprecision(2) << std::setw(12) << r.errBump
+            << std::setw(12) << r.errDisk << std::setw(12) << r.overshoot << std::endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  const int n = (argc>1) ? std::atoi(argv[1]) : 256;
+
+  std::cout << "one revolution; ms per step for two fields ("
+            << ((smokeSimdLevel()==kSmokeSimdAvx2) ? "avx2" : "scalar")
+            << ", scalar), L1 errors, max overshoot" << std::endl
+            << std::setw(6) << "res" << std::setw(9) << "sampler" << std::setw(11) << "ms/step"
+            << std::setw(11) << "scalar"
+            << std::setw(12) << "L1 bump" << std::setw(12) << "L1 disk"
+            << std::setw(12) << "overshoot" << std::endl;
+  report(n, kSampleLinear);
+  report(n, kSampleCubic);
+  report(n/2, kSampleLinear);
+  report(n/2, kSampleCubic);
+  return EXIT_SUCCESS;
+}
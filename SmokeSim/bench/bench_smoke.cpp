@@ -0,0 +1,161 @@
+// ----------------------------------------------------------------------------
+// bench_smoke.cpp
+//
+// Description: Per-stage microbenchmarks of SmokeSolver across resolutions,
+//   written as JSON for tracking regressions. Every stage is warmed up and
+//   then repeated until it has run at least kMinReps times and kMinSeconds;
+//   the median and the 95th percentile of the call times are reported, with
+//   cells/s and the bandwidth of a nominal traffic model (bytes_per_cell:
+//   each grid read or written once per call, 4 bytes per value). Stages
+//   still left as TODO in SmokeSolver are timed but written with
+//   "implemented": false and no throughput, which would be meaningless.
+//
+// Usage: bench_smoke [<output json> [<max res_x>]]
+// ----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include "../src/SmokeAutotune.hpp"
+
+namespace {
+
+const int kWarmup = 3;
+const int kMinReps = 5;
+const int kMaxReps = 1000;
+const double kMinSeconds = 0.5;
+
+struct Stats { int reps; double median, p95; };   // seconds per call
+
+template<typename F>
+Stats measure(F call)
+{
+  for(int r=0; r<kWarmup; ++r) call();
+
+  std::vector<double> t;
+  double total = 0;
+  while(static_cast<int>(t.size())<kMaxReps && (static_cast<int>(t.size())<kMinReps || total<kMinSeconds)) {
+    const auto t0 = std::chrono::steady_clock::now();
+    call();
+    const auto t1 = std::chrono::steady_clock::now();
+    t.push_back(std::chrono::duration<double>(t1 - t0).count());
+    total += t.back();
+  }
+  std::sort(t.begin(), t.end());
+  const Stats s = {
+    static_cast<int>(t.size()), t[t.size()/2],
+    t[std::min(static_cast<std::size_t>(0.95*t.size()), t.size() - 1)] };
+  return s;
+}
+
+class JsonWriter {
+public:
+  explicit JsonWriter(std::ostream &out) : _out(out), _first(true) {}
+
+  void record(
+    const std::string &stage, const int nx, const int ny, const double bytes_per_cell,
+    const Stats &s, const bool implemented=true) {
+    const double cells = static_cast<double>(nx)*ny;
+    _out << (_first ? "\n" : ",\n") << std::setprecision(6)
+         << "    {\"stage\": \"" << stage << "\", \"res_x\": " << nx << ", \"res_y\": " << ny
+         << ", \"reps\": " << s.reps
+         << ", \"median_ms\": " << s.median*1e3 << ", \"p95_ms\": " << s.p95*1e3;
+    if(implemented)
+      _out << ", \"cells_per_s\": " << cells/std::max(s.median, 1e-12)
+           << ", \"bytes_per_cell\": " << bytes_per_cell
+           << ", \"gb_per_s\": " << cells*bytes_per_cell/std::max(s.median, 1e-12)*1e-9 << "}";
+    else
+      _out << ", \"implemented\": false}";
+    _first = false;
+
+    std::cerr << std::setw(28) << stage << std::setw(6) << nx << "x" << std::setw(5) << std::left
+              << ny << std::right << std::fixed << std::setprecision(3)
+              << std::setw(11) << s.median*1e3 << std::setw(11) << s.p95*1e3 << " ms";
+    if(implemented)
+      std::cerr << std::setw(9) << std::setprecision(1)
+                << cells*bytes_per_cell/std::max(s.median, 1e-12)*1e-9 << " GB/s";
+    else
+      std::cerr << "  (TODO stub)";
+    std::cerr << std::defaultfloat << std::endl;
+  }
+
+private:
+  std::ostream &_out;
+  bool _first;
+};
+
+void benchResolution(JsonWriter &json, const int nx, const int ny)
+{
+  SmokeSolver solver;
+  solver.setVerbose(false);
+  const glm::vec2 src_cen(0.5f*nx, 7.f/64.f*ny), src_size(3.f/32.f*nx, 3.f/32.f*nx);
+  solver.initScene(nx, ny, src_cen, src_size);
+
+  // a few steps in, so that the fields are not trivially zero
+  for(int s=0; s<3; ++s) solver.update();
+  Grid2f d = solver.density(), u = solver.velocity_u(), v = solver.velocity_v();
+  Grid2f fx(nx, ny), fy(nx, ny), p(nx, ny);
+  const tReal dt = solver.timestep();
+  const glm::vec2 g(0.0, -9.8);
+  const int iters = solver.pressureIters();
+
+  json.record("addSource", nx, ny, 4, measure([&]() {
+        solver.addSource(d, src_cen, src_size); }));
+  // still TODO in SmokeSolver: set to true once implemented
+  const bool advection = false, forces = false;
+  json.record("advectCentered", nx, ny, 16, measure([&]() {
+        solver.advectCentered(d, u, v, dt); }), advection);
+  json.record("advectStaggered", nx, ny, 16, measure([&]() {
+        solver.advectStaggered(fx, fy, u, v, dt); }), advection);
+  json.record("calculateBuoyancy", nx, ny, 12, measure([&]() {
+        solver.calculateBuoyancy(fx, fy, d, g, 0.2); }), forces);
+  json.record("updateVelocityWithForce", nx, ny, 24, measure([&]() {
+        solver.updateVelocityWithForce(u, v, fx, fy, dt); }), forces);
+  // divergence, then each Jacobi sweep reads p and rhs and writes p
+  json.record("solvePressure", nx, ny, 12 + 12.0*iters, measure([&]() {
+        solver.solvePressure(p, u, v, dt); }));
+  // restore u, v so that every call projects the same field
+  const Grid2f u0 = u, v0 = v;
+  json.record("updateVelocityWithPressure", nx, ny, 20, measure([&]() {
+        u = u0; v = v0; solver.updateVelocityWithPressure(u, v, p, dt); }));
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  const int max_x = (argc>2) ? std::atoi(argv[2]) : 2048;
+
+  std::ofstream file;
+  if(argc>1) file.open(argv[1]);
+  std::ostream &out = (argc>1) ? file : std::cout;
+  if(!out) {
+    std::cerr << "[bench_smoke] Cannot open " << argv[1] << std::endl;
+    return EXIT_FAILURE;
+  }
+
+#ifdef _OPENMP
+  const int threads = omp_get_max_threads();
+#else
+  const int threads = 1;
+#endif
+  out << "{\n  \"benchmark\": \"bench_smoke\",\n  \"host\": \"" << smokeHostName()
+      << "\",\n  \"threads\": " << threads
+      << ",\n  \"warmup\": " << kWarmup << ", \"min_reps\": " << kMinReps
+      << ", \"min_seconds\": " << kMinSeconds
+      << ",\n  \"results\": [";
+
+  std::cerr << std::setw(28) << "stage" << std::setw(11) << "grid"
+            << std::setw(11) << "median" << std::setw(11) << "p95" << std::endl;
+  JsonWriter json(out);
+  for(int nx=32; nx<=max_x; nx*=2) benchResolution(json, nx, 2*nx);
+
+  out << "\n  ]\n}" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,65 @@
+// ----------------------------------------------------------------------------
+// bench_tracers.cpp
+//
+// Description: Tracer particle benchmark; advection and splatting of a full
+//   particle system through a synthetic swirl, per frame
+//
+// Usage: bench_tracers [<particles> [<res_x> <res_y>]]
+// ----------------------------------------------------------------------------
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+
+#include "../src/SmokeTracers.hpp"
+
+int main(int argc, char **argv)
+{
+  const int n = (argc>1) ? std::atoi(argv[1]) : 1<<20;
+  const int nx = (argc>3) ? std::atoi(argv[2]) : 128;
+  const int ny = (argc>3) ? std::atoi(argv[3]) : 256;
+  const tReal dt = 0.01;
+
+  // divergence-free swirl around the grid center
+  Grid2f u(nx, ny), v(nx, ny);
+  for(int j=0; j<ny; ++j)
+    for(int i=0; i<nx; ++i) {
+      u(i, j) = -std::sin(3.14159f*i/nx)*std::cos(3.14159f*(j+0.5f)/ny)*nx;
+      v(i, j) = std::cos(3.14159f*(i+0.5f)/nx)*std::sin(3.14159f*j/ny)*ny;
+    }
+
+  // lifetime long enough for the system to stay full
+  SmokeTracers tracers(n, 1e6);
+  tracers.emit(n, glm::vec2(0.5f*nx, 0.5f*ny), glm::vec2(0.45f*nx, 0.45f*ny));
+
+  double t_adv = 1e30, t_splat = 1e30;
+  for(int f=0; f<20; ++f) {
+    const auto t0 = std::chrono::steady_clock::now();
+    tracers.advect(u, v, dt);
+    const auto t1 = std::chrono::steady_clock::now();
+    tracers.splat(nx, ny, 2);
+    const auto t2 = std::chrono::steady_clock::now();
+    tracers.emit(tracers.capacity() - tracers.alive(),
+                 glm::vec2(0.5f*nx, 0.5f*ny), glm::vec2(0.45f*nx, 0.45f*ny));
+    if(f>1) {                   // warm-up
+      t_adv = std::min(t_adv, std::chrono::duration<double, std::milli>(t1 - t0).count());
+      t_splat = std::min(t_splat, std::chrono::duration<double, std::milli>(t2 - t1).count());
+    }
+  }
+
+#ifdef _OPENMP
+  const int threads = omp_get_max_threads();
+#else
+  const int threads = 1;
+#endif
+  std::cout << tracers.capacity() << " particles on " << nx << "x" << ny
+            << ", " << threads << " thread(s), best of 18 frames" << std::endl
+            << std::fixed << std::setprecision(2)
+            << "  advect " << std::setw(8) << t_adv << " ms  ("
+            << tracers.capacity()/t_adv*1e-3 << " Mparticles/s)" << std::endl
+            << "  splat  " << std::setw(8) << t_splat << " ms" << std::endl
+            << "  frame  " << std::setw(8) << t_adv + t_splat << " ms" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+// ----------------------------------------------------------------------------
+// CellMask.hpp
+//
+// Description: Bit-packed cell types of the smoke grid. Each row is stored as
+//   64-bit words in two bitplanes (fluid, solid); cells in neither are open.
+//   Stencil kernels fetch whole words of neighbour flags and turn them into
+//   coefficients without branching per cell.
+// ----------------------------------------------------------------------------
+
+#ifndef _CELLMASK_HPP_
+#define _CELLMASK_HPP_
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+enum CellType {
+  kCellOpen = 0,                // open boundary (p=0)
+  kCellFluid = 1,
+  kCellSolid = 2                // static obstacle (u.n=0)
+};
+
+class CellMask {
+public:
+  typedef std::uint64_t tWord;
+  enum { kBits = 64 };
+
+  explicit CellMask(const int size_x=0, const int size_y=0) { init(size_x, size_y); }
+
+  // all cells open
+  void init(const int size_x, const int size_y) {
+    _sizeX = size_x;
+    _sizeY = size_y;
+    _words = (size_x + kBits - 1)/kBits;
+    _fluid.assign(_words*size_y, 0);
+    _solid.assign(_words*size_y, 0);
+    _plain.assign(size_y, 0);
+  }
+
+  int operator()(const int i, const int j) const {
+    const int k = j*_words + i/kBits, b = i%kBits;
+    return static_cast<int>((_fluid[k] >> b) & 1) | static_cast<int>(((_solid[k] >> b) & 1) << 1);
+  }
+  void set(const int i, const int j, const int type) {
+    const int k = j*_words + i/kBits;
+    const tWord bit = tWord(1) << (i%kBits);
+    _fluid[k] = (type==kCellFluid) ? (_fluid[k] | bit) : (_fluid[k] & ~bit);
+    _solid[k] = (type==kCellSolid) ? (_solid[k] | bit) : (_solid[k] & ~bit);
+  }
+  bool isFluid(const int i, const int j) const { return (*this)(i, j)==kCellFluid; }
+  bool isSolid(const int i, const int j) const { return (*this)(i, j)==kCellSolid; }
+
+  // word w of row j, i.e., cells [w*64, w*64+64); zero outside of the grid
+  tWord fluidWord(const int j, const int w) const { return word(_fluid, j, w); }
+  tWord solidWord(const int j, const int w) const { return word(_solid, j, w); }
+
+  // bit b set iff the left/right/bottom/top neighbour of cell (w*64+b, j) is
+  // solid
+  void solidNeighbours(
+    const int j, const int w, tWord &l, tWord &r, tWord &d, tWord &u) const {
+    const tWord c = solidWord(j, w);
+    l = (c << 1) | (solidWord(j, w-1) >> (kBits-1));
+    r = (c >> 1) | (solidWord(j, w+1) << (kBits-1));
+    d = solidWord(j-1, w);
+    u = solidWord(j+1, w);
+  }
+  // true iff no solid cell touches the stencils of word w of row j
+  bool solidFree(const int j, const int w) const {
+    return !(solidWord(j, w) | solidWord(j-1, w) | solidWord(j+1, w) |
+             (solidWord(j, w-1) >> (kBits-1)) | (solidWord(j, w+1) << (kBits-1)));
+  }
+
+  // row j is plain if cells [1, resX()-1) are all fluid and no obstacle lies
+  // in rows j-1 to j+1, so the 5-point stencil applies as is; call
+  // updateRowFlags() once the mask has been edited
+  bool plainRow(const int j) const { return _plain[j]; }
+  void updateRowFlags() {
+    for(int j=0; j<_sizeY; ++j) {
+      bool plain = _sizeX>2;
+      for(int i=1; i<_sizeX-1 && plain; ++i) plain = isFluid(i, j);
+      for(int w=0; w<_words && plain; ++w)
+        plain = !(solidWord(j-1, w) | solidWord(j, w) | solidWord(j+1, w));
+      _plain[j] = plain;
+    }
+  }
+
+  // obstacle rasterization (cell centers at integer+0.5, as addSource())
+  void addSolidBox(const float cx, const float cy, const float hx, const float hy) {
+    for(int j=std::max(0, int(cy-hy)); j<std::min(_sizeY, int(cy+hy)+1); ++j)
+      for(int i=std::max(0, int(cx-hx)); i<std::min(_sizeX, int(cx+hx)+1); ++i)
+        if(std::abs(i+0.5f-cx)<=hx && std::abs(j+0.5f-cy)<=hy) set(i, j, kCellSolid);
+  }
+  void addSolidCircle(const float cx, const float cy, const float r) {
+    for(int j=std::max(0, int(cy-r)); j<std::min(_sizeY, int(cy+r)+1); ++j)
+      for(int i=std::max(0, int(cx-r)); i<std::min(_sizeX, int(cx+r)+1); ++i) {
+        const float dx = i+0.5f-cx, dy = j+0.5f-cy;
+        if(dx*dx + dy*dy<=r*r) set(i, j, kCellSolid);
+      }
+  }
+  // a w*h 8-bit image (row 0 at the bottom) stretched over the grid; pixels
+  // above threshold are solid
+  void addSolidImage(
+    const unsigned char *img, const int w, const int h, const unsigned char threshold=127) {
+    for(int j=0; j<_sizeY; ++j)
+      for(int i=0; i<_sizeX; ++i) {
+        const int x = std::min(static_cast<int>((i+0.5f)*w/_sizeX), w-1);
+        const int y = std::min(static_cast<int>((j+0.5f)*h/_sizeY), h-1);
+        if(img[y*w + x]>threshold) set(i, j, kCellSolid);
+      }
+  }
+
+  int resX() const { return _sizeX; }
+  int resY() const { return _sizeY; }
+  int wordsPerRow() const { return _words; }
+  long int size() const { return static_cast<long int>(_sizeX)*_sizeY; }
+  bool hasSolid() const {
+    return std::any_of(_solid.begin(), _solid.end(), [](const tWord x) { return x!=0; });
+  }
+
+private:
+  tWord word(const std::vector<tWord> &plane, const int j, const int w) const {
+    return (j<0 || j>=_sizeY || w<0 || w>=_words) ? 0 : plane[j*_words + w];
+  }
+
+  std::vector<tWord> _fluid, _solid;
+  std::vector<char> _plain;
+  int _sizeX, _sizeY, _words;
+};
+
+#endif  /* _CELLMASK_HPP_ */
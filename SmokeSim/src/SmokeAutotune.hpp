@@ -0,0 +1,272 @@
+// ----------------------------------------------------------------------------
+// SmokeAutotune.hpp
+//
+// Description: Startup calibration of the smoke solver settings. Short runs
+//   of the solver at the requested resolution pick the thread count, the
+//   pressure relaxation scheme and its tiling, and the grid storage (dynamic
+//   or fixed preset); the choice is cached per host and resolution so later
+//   runs start tuned.
+//
+// Cache: $SMOKE_TUNE_DIR (or $HOME, or the working directory) holds one file
+//   .smoke_tune.<hostname> with a line per resolution:
+//
+//   # res_x res_y threads relax tile sweeps_per_tile fixed ms_per_step
+//   128 256 8 1 128 16 1 0.713
+// ----------------------------------------------------------------------------
+
+#ifndef _SMOKEAUTOTUNE_HPP_
+#define _SMOKEAUTOTUNE_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "SmokeSolver.hpp"
+
+struct SmokeTuning {
+  int threads;
+  PressureRelax relax;
+  int tile, sweepsPerTile;
+  bool fixed;                   // SmokeSolverFixed if a preset exists
+  double msPerStep;             // measured with these settings
+};
+
+inline std::string smokeHostName()
+{
+#ifdef _WIN32
+  const char *name = std::getenv("COMPUTERNAME");
+  return name ? name : "unknown";
+#else
+  char name[256] = { 0 };
+  if(gethostname(name, sizeof(name) - 1)) return "unknown";
+  return name;
+#endif
+}
+
+inline std::string smokeTuneFile()
+{
+  const char *dir = std::getenv("SMOKE_TUNE_DIR");
+  if(!dir) dir = std::getenv("HOME");
+  return std::string(dir ? dir : ".") + "/.smoke_tune." + smokeHostName();
+}
+
+// false if the cache has no entry for res_x*res_y
+inline bool loadSmokeTuning(
+  const std::string &filename, const int res_x, const int res_y, SmokeTuning &t)
+{
+  std::ifstream in(filename.c_str());
+  std::string line;
+  while(std::getline(in, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream ls(line);
+    int nx, ny, relax, fixed;
+    SmokeTuning r;
+    if(!(ls >> nx >> ny >> r.threads >> relax >> r.tile >> r.sweepsPerTile >> fixed >> r.msPerStep))
+      continue;
+    if(nx!=res_x || ny!=res_y) continue;
+    r.relax = static_cast<PressureRelax>(relax);
+    r.fixed = fixed!=0;
+    t = r;
+    return true;
+  }
+  return false;
+}
+
+// replaces the entry of res_x*res_y and keeps the others
+inline void saveSmokeTuning(
+  const std::string &filename, const int res_x, const int res_y, const SmokeTuning &t)
+{
+  std::vector<std::string> kept;
+  {
+    std::ifstream in(filename.c_str());
+    std::string line;
+    while(std::getline(in, line)) {
+      std::istringstream ls(line);
+      int nx, ny;
+      if(line.empty() || line[0]=='#') continue;
+      if((ls >> nx >> ny) && nx==res_x && ny==res_y) continue;
+      kept.push_back(line);
+    }
+  }
+
+  std::ofstream out(filename.c_str());
+  if(!out)
+    throw std::ios_base::failure("[SmokeAutotune][saveSmokeTuning] Cannot write " + filename);
+  out << "# res_x res_y threads relax tile sweeps_per_tile fixed ms_per_step\n";
+  for(const std::string &line : kept) out << line << '\n';
+  out << res_x << ' ' << res_y << ' ' << t.threads << ' ' << t.relax << ' ' << t.tile << ' '
+      << t.sweepsPerTile << ' ' << t.fixed << ' ' << t.msPerStep << '\n';
+}
+
+// the thread count is a process-wide setting
+inline void applySmokeTuning(SmokeSolverBase &solver, const SmokeTuning &t)
+{
+#ifdef _OPENMP
+  omp_set_num_threads(t.threads);
+#endif
+  solver.setPressureRelax(t.relax, solver.pressureIters(), t.tile, t.sweepsPerTile);
+}
+
+namespace smoke_autotune {
+
+// median milliseconds per update() over a few batches, after a warm-up that
+// also fills the solver's scratch pool
+inline double timeSteps(
+  const int res_x, const int res_y, const tReal dt, const glm::vec2 &g, const tReal buoy,
+  const SmokeTuning &t)
+{
+#ifdef _OPENMP
+  omp_set_num_threads(t.threads);
+#endif
+  std::shared_ptr<SmokeSolverBase> solver = makeSmokeSolver(res_x, res_y, dt, g, buoy, t.fixed);
+  solver->setVerbose(false);
+  solver->initScene(
+    res_x, res_y, glm::vec2(0.5f*res_x, 7.f/64.f*res_y),
+    glm::vec2(std::max(3*res_x/32, 1), std::max(3*res_x/32, 1)));
+  applySmokeTuning(*solver, t);
+
+  const long int cells = static_cast<long int>(res_x)*res_y;
+  const int steps = std::min(std::max(static_cast<int>((1L << 22)/cells), 2), 50);
+  for(int s=0; s<2; ++s) solver->update();
+
+  std::vector<double> ms(3);
+  for(double &m : ms) {
+    const auto t0 = std::chrono::steady_clock::now();
+    for(int s=0; s<steps; ++s) solver->update();
+    const auto t1 = std::chrono::steady_clock::now();
+    m = std::chrono::duration<double, std::milli>(t1 - t0).count()/steps;
+  }
+  std::sort(ms.begin(), ms.end());
+  return ms[1];
+}
+
+inline void reportLine(std::ostream *report, const SmokeTuning &t)
+{
+  if(!report) return;
+  const std::ios_base::fmtflags flags = report->flags();
+  const std::streamsize precision = report->precision();
+  *report << std::setw(8) << t.threads
+          << std::setw(9) << ((t.relax==kRelaxJacobiBlocked) ? "blocked" : "jacobi")
+          << std::setw(6) << t.tile << std::setw(5) << t.sweepsPerTile
+          << std::setw(9) << (t.fixed ? "fixed" : "dynamic")
+          << std::fixed << std::setprecision(3) << std::setw(12) << t.msPerStep << std::endl;
+  report->flags(flags);
+  report->precision(precision);
+}
+
+}
+
+// Runs the calibration; the knobs are searched one after the other (threads,
+// then relaxation and tiling, then storage), each keeping the best of the
+// previous ones. Every candidate is written to report, if any.
+inline SmokeTuning autotuneSmoke(
+  const int res_x, const int res_y,
+  const tReal dt=0.01, const glm::vec2 g=glm::vec2(0.0, -9.8), const tReal buoy=0.2,
+  std::ostream *report=nullptr)
+{
+  using namespace smoke_autotune;
+
+  SmokeTuning best = { 1, kRelaxJacobi, 128, 16, false, 1e30 };
+  auto trial = [&](SmokeTuning t) {
+    t.msPerStep = timeSteps(res_x, res_y, dt, g, buoy, t);
+    reportLine(report, t);
+    if(t.msPerStep<best.msPerStep) best = t;
+  };
+
+  if(report)
+    *report << "> Autotuning " << res_x << "x" << res_y << " on " << smokeHostName() << std::endl
+            << std::setw(8) << "threads" << std::setw(9) << "relax" << std::setw(6) << "tile"
+            << std::setw(5) << "spt" << std::setw(9) << "storage" << std::setw(12) << "ms/step"
+            << std::endl;
+
+#ifdef _OPENMP
+  const int max_threads = omp_get_max_threads();
+#else
+  const int max_threads = 1;
+#endif
+  std::vector<int> threads;
+  for(int n=1; n<max_threads; n*=2) threads.push_back(n);
+  threads.push_back(max_threads);
+  for(const int n : threads) {
+    SmokeTuning t = best;
+    t.threads = n;
+    trial(t);
+  }
+
+  // tiles no larger than the grid; one that covers it is still worth a try
+  const int extent = std::max(res_x, res_y);
+  const SmokeTuning base = best;
+  for(int tile=32; tile<=256; tile*=2) {
+    for(int spt=4; spt<=16; spt*=2) {
+      SmokeTuning t = base;
+      t.relax = kRelaxJacobiBlocked;
+      t.tile = tile;
+      t.sweepsPerTile = spt;
+      trial(t);
+    }
+    if(tile>=extent) break;
+  }
+
+  // the fixed storage only exists for the preset resolutions
+  std::shared_ptr<SmokeSolverBase> probe = makeSmokeSolver(res_x, res_y);
+  if(!std::dynamic_pointer_cast<SmokeSolver>(probe)) {
+    SmokeTuning t = best;
+    t.fixed = true;
+    trial(t);
+  }
+
+#ifdef _OPENMP
+  omp_set_num_threads(max_threads);
+#endif
+  if(report) {
+    *report << "> Selected" << std::endl;
+    reportLine(report, best);
+  }
+  return best;
+}
+
+// Cached settings of this host for res_x*res_y, calibrated and stored first
+// if there are none yet (or retune is set)
+inline SmokeTuning smokeTuning(
+  const int res_x, const int res_y, const bool retune=false, std::ostream *report=nullptr)
+{
+  const std::string filename = smokeTuneFile();
+  SmokeTuning t;
+  if(!retune && loadSmokeTuning(filename, res_x, res_y, t)) {
+    if(report) *report << "> Tuning of " << res_x << "x" << res_y << " read from " << filename << std::endl;
+    return t;
+  }
+
+  t = autotuneSmoke(res_x, res_y, 0.01, glm::vec2(0.0, -9.8), 0.2, report);
+  try {
+    saveSmokeTuning(filename, res_x, res_y, t);
+    if(report) *report << "> Saved to " << filename << std::endl;
+  } catch(std::exception &e) {
+    std::cerr << e.what() << std::endl;
+  }
+  return t;
+}
+
+// makeSmokeSolver() with the tuned storage, threads and relaxation applied
+inline std::shared_ptr<SmokeSolverBase> makeTunedSmokeSolver(
+  const int res_x, const int res_y,
+  const tReal dt=0.01, const glm::vec2 g=glm::vec2(0.0, -9.8), const tReal buoy=0.2,
+  const bool retune=false, std::ostream *report=nullptr)
+{
+  const SmokeTuning t = smokeTuning(res_x, res_y, retune, report);
+  std::shared_ptr<SmokeSolverBase> solver = makeSmokeSolver(res_x, res_y, dt, g, buoy, t.fixed);
+  applySmokeTuning(*solver, t);
+  return solver;
+}
+
+#endif  /* _SMOKEAUTOTUNE_HPP_ */
@@ -0,0 +1,1021 @@
+// ----------------------------------------------------------------------------
+// SmokeSolver.hpp
+//
+//  Created on: 21 Jan 2021
+//      Author: Kiwon Um
+//        Mail: kiwon.um@telecom-paris.fr
+//
+// Description: IMA904/IG3DA - Practical - Eulerian Smoke Solver
+//   (DO NOT distribute!)
+//
+// Copyright 2021-2023 Kiwon Um
+//
+// The copyright to the computer program(s) herein is the property of Kiwon Um,
+// Telecom Paris, France. The program(s) may be used and/or copied only with
+// the written permission of Kiwon Um or in accordance with the terms and
+// conditions stipulated in the agreement/contract under which the program(s)
+// have been supplied.
+// ----------------------------------------------------------------------------
+
+#ifndef _SMOKESOLVER_HPP_
+#define _SMOKESOLVER_HPP_
+
+#include <glm/glm.hpp>
+
+#include <iostream>
+#include <vector>
+#include <array>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SMOKE_AVX2_DISPATCH
+#define SMOKE_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+
+#include "CellMask.hpp"
+
+typedef float tReal;
+typedef long int tUint;
+
+inline tReal square(const tReal a) { return a*a; }
+inline tReal cube(const tReal a) { return a*a*a; }
+inline tReal clamp(const tReal v, const tReal vmin, const tReal vmax) {
+  if(v<vmin) return vmin;
+  if(v>vmax) return vmax;
+  return v;
+}
+
+// Kernels with an AVX2 version pick it at run time, independently of the
+// flags the rest of the code is compiled with; setSmokeSimdLevel() forces the
+// scalar path, e.g., to compare both
+enum SmokeSimdLevel { kSmokeSimdScalar = 0, kSmokeSimdAvx2 = 1 };
+
+// best level the CPU supports
+inline SmokeSimdLevel detectSmokeSimdLevel() {
+#ifdef SMOKE_AVX2_DISPATCH
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return kSmokeSimdAvx2;
+#endif
+  return kSmokeSimdScalar;
+}
+inline SmokeSimdLevel &smokeSimdLevelRef() {
+  static SmokeSimdLevel l = detectSmokeSimdLevel();
+  return l;
+}
+inline SmokeSimdLevel smokeSimdLevel() { return smokeSimdLevelRef(); }
+// clamped to what the CPU supports
+inline void setSmokeSimdLevel(const SmokeSimdLevel l) {
+  smokeSimdLevelRef() = std::min(l, detectSmokeSimdLevel());
+}
+
+enum SampleMode {
+  kSampleLinear = 0,            // bilinear
+  kSampleCubic                  // Catmull-Rom, clamped to the nearest samples
+};
+
+// Interpolation stencil at one position: clamped sample indices and weights
+// per axis. It depends only on the position and the grid extents, so it is
+// built once and applied to every field sampled at the same point; linear
+// stencils use the middle two taps and have zero outer weights.
+struct SampleStencil {
+  int ix[4], iy[4];
+  tReal wx[4], wy[4];
+  SampleMode mode;
+};
+
+inline void sampleWeights(
+  const SampleMode mode, const tReal t, const int i, const int n, int idx[4], tReal w[4])
+{
+  for(int k=0; k<4; ++k) idx[k] = std::min(std::max(i + k - 1, 0), n-1);
+  if(mode==kSampleCubic) {
+    const tReal t2 = t*t, t3 = t2*t;
+    w[0] = -0.5f*t3 + t2 - 0.5f*t;
+    w[1] = 1.5f*t3 - 2.5f*t2 + 1;
+    w[2] = -1.5f*t3 + 2*t2 + 0.5f*t;
+    w[3] = 0.5f*t3 - 0.5f*t2;
+  } else {
+    w[0] = w[3] = 0;
+    w[1] = 1 - t;
+    w[2] = t;
+  }
+}
+
+// (x, y) in index space, i.e., sample (i, j) is at (i, j); positions outside
+// of the grid take the border values
+inline SampleStencil makeSampleStencil(
+  tReal x, tReal y, const int nx, const int ny, const SampleMode mode=kSampleLinear)
+{
+  SampleStencil s;
+  x = clamp(x, 0, nx-1);
+  y = clamp(y, 0, ny-1);
+  const int i = std::min(static_cast<int>(x), std::max(nx-2, 0));
+  const int j = std::min(static_cast<int>(y), std::max(ny-2, 0));
+  sampleWeights(mode, x - i, i, nx, s.ix, s.wx);
+  sampleWeights(mode, y - j, j, ny, s.iy, s.wy);
+  s.mode = mode;
+  return s;
+}
+
+template<typename T>
+inline tReal sampleLinear(const T *f, const int stride, const SampleStencil &s)
+{
+  const T *r1 = f + s.iy[1]*stride, *r2 = f + s.iy[2]*stride;
+  return s.wy[1]*(s.wx[1]*r1[s.ix[1]] + s.wx[2]*r1[s.ix[2]]) +
+    s.wy[2]*(s.wx[1]*r2[s.ix[1]] + s.wx[2]*r2[s.ix[2]]);
+}
+
+// separable: rows along x, then the row results along y; each 1D result is
+// clamped between its two middle samples, which keeps the cubic monotone (no
+// new extrema) without losing its sharpness
+template<typename T>
+inline tReal sampleCubic(const T *f, const int stride, const SampleStencil &s)
+{
+  tReal r[4];
+  for(int b=0; b<4; ++b) {
+    const T *row = f + s.iy[b]*stride;
+    const tReal a = row[s.ix[1]], c = row[s.ix[2]];
+    const tReal v = s.wx[0]*row[s.ix[0]] + s.wx[1]*a + s.wx[2]*c + s.wx[3]*row[s.ix[3]];
+    r[b] = clamp(v, std::min(a, c), std::max(a, c));
+  }
+  const tReal v = s.wy[0]*r[0] + s.wy[1]*r[1] + s.wy[2]*r[2] + s.wy[3]*r[3];
+  return clamp(v, std::min(r[1], r[2]), std::max(r[1], r[2]));
+}
+
+// field f with rows stride apart at stencil s
+template<typename T>
+inline tReal sampleStencil(const T *f, const int stride, const SampleStencil &s)
+{
+  return (s.mode==kSampleCubic) ? sampleCubic(f, stride, s) : sampleLinear(f, stride, s);
+}
+
+// Stencils of many positions in structure-of-arrays form, so that applying
+// them to a field vectorizes (taps become gathers); all of one mode
+struct SampleStencilBatch {
+  SampleMode mode;
+  std::vector<int> ix[4], iy[4];
+  std::vector<tReal> wx[4], wy[4];
+
+  explicit SampleStencilBatch(const int n=0, const SampleMode m=kSampleLinear) { resize(n, m); }
+
+  void resize(const int n, const SampleMode m) {
+    mode = m;
+    for(int c=0; c<4; ++c) {
+      ix[c].resize(n); iy[c].resize(n);
+      wx[c].resize(n); wy[c].resize(n);
+    }
+  }
+  int size() const { return static_cast<int>(ix[0].size()); }
+
+  // same position convention as makeSampleStencil()
+  void set(const int k, const tReal x, const tReal y, const int nx, const int ny) {
+    const SampleStencil s = makeSampleStencil(x, y, nx, ny, mode);
+    for(int c=0; c<4; ++c) {
+      ix[c][k] = s.ix[c]; iy[c][k] = s.iy[c];
+      wx[c][k] = s.wx[c]; wy[c][k] = s.wy[c];
+    }
+  }
+};
+
+// out[k-k0] = field f (rows stride apart) at stencils [k0, k1) of batch s
+template<typename T>
+inline void sampleStencils(
+  const T *f, const int stride, const SampleStencilBatch &s, const int k0, const int k1,
+  tReal *out)
+{
+  const int *ix0 = s.ix[0].data(), *ix1 = s.ix[1].data(), *ix2 = s.ix[2].data(), *ix3 = s.ix[3].data();
+  const int *iy0 = s.iy[0].data(), *iy1 = s.iy[1].data(), *iy2 = s.iy[2].data(), *iy3 = s.iy[3].data();
+  const tReal *wx0 = s.wx[0].data(), *wx1 = s.wx[1].data(), *wx2 = s.wx[2].data(), *wx3 = s.wx[3].data();
+  const tReal *wy0 = s.wy[0].data(), *wy1 = s.wy[1].data(), *wy2 = s.wy[2].data(), *wy3 = s.wy[3].data();
+
+  if(s.mode==kSampleLinear) {
+#pragma omp simd
+    for(int k=k0; k<k1; ++k) {
+      const T *r1 = f + iy1[k]*stride, *r2 = f + iy2[k]*stride;
+      out[k-k0] = wy1[k]*(wx1[k]*r1[ix1[k]] + wx2[k]*r1[ix2[k]]) +
+        wy2[k]*(wx1[k]*r2[ix1[k]] + wx2[k]*r2[ix2[k]]);
+    }
+    return;
+  }
+
+#pragma omp simd
+  for(int k=k0; k<k1; ++k) {
+    const T *rows[4] = {
+      f + iy0[k]*stride, f + iy1[k]*stride, f + iy2[k]*stride, f + iy3[k]*stride };
+    tReal r[4];
+    for(int b=0; b<4; ++b) {
+      const tReal a = rows[b][ix1[k]], c = rows[b][ix2[k]];
+      const tReal v = wx0[k]*rows[b][ix0[k]] + wx1[k]*a + wx2[k]*c + wx3[k]*rows[b][ix3[k]];
+      r[b] = std::min(std::max(v, std::min(a, c)), std::max(a, c));
+    }
+    const tReal v = wy0[k]*r[0] + wy1[k]*r[1] + wy2[k]*r[2] + wy3[k]*r[3];
+    out[k-k0] = std::min(std::max(v, std::min(r[1], r[2])), std::max(r[1], r[2]));
+  }
+}
+
+#ifdef SMOKE_AVX2_DISPATCH
+// 8 stencils at a time. The x taps of a stencil are contiguous (bilinear
+// unless the grid is one sample wide, cubic away from the left and right
+// borders), so each lane reads its taps of a row with one 2- or 4-float load
+// and the lanes are transposed in registers; this beats vgather on the hosts
+// measured. Blocks with a clamped tap and the remainder take the loop above.
+SMOKE_TARGET_AVX2 inline void sampleStencilsAvx2(
+  const float *f, const int stride, const SampleStencilBatch &s, const int k0, const int k1,
+  float *out)
+{
+  const int *ix0 = s.ix[0].data(), *ix1 = s.ix[1].data(), *ix2 = s.ix[2].data(), *ix3 = s.ix[3].data();
+  const int *iy[4] = { s.iy[0].data(), s.iy[1].data(), s.iy[2].data(), s.iy[3].data() };
+  const float *wx[4] = { s.wx[0].data(), s.wx[1].data(), s.wx[2].data(), s.wx[3].data() };
+  const float *wy[4] = { s.wy[0].data(), s.wy[1].data(), s.wy[2].data(), s.wy[3].data() };
+  const bool cubic = s.mode==kSampleCubic;
+  const int *first = cubic ? ix0 : ix1, *last = cubic ? ix3 : ix2;
+  const __m256i span = _mm256_set1_epi32(cubic ? 3 : 1);
+
+  int k = k0;
+  for(; k+8<=k1; k+=8) {
+    const __m256i d = _mm256_sub_epi32(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(last + k)),
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(first + k)));
+    if(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(d, span)))!=0xff) {
+      sampleStencils<float>(f, stride, s, k, k+8, out + k-k0);
+      continue;
+    }
+
+    if(!cubic) {
+      // per row, lanes (2h, 2h+1) in one register: a a' b b', then split
+      // into the left and the right taps
+      __m256 g[2][2];
+      for(int b=0; b<2; ++b) {
+        __m128 q[4];
+        for(int h=0; h<4; ++h) {
+          const float *p0 = f + iy[1+b][k+2*h]*stride + ix1[k+2*h];
+          const float *p1 = f + iy[1+b][k+2*h+1]*stride + ix1[k+2*h+1];
+          q[h] = _mm_castpd_ps(_mm_loadh_pd(
+                                 _mm_load_sd(reinterpret_cast<const double *>(p0)),
+                                 reinterpret_cast<const double *>(p1)));
+        }
+        const __m256 lo = _mm256_set_m128(q[2], q[0]), hi = _mm256_set_m128(q[3], q[1]);
+        g[b][0] = _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+        g[b][1] = _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1));
+      }
+      const __m256 w1 = _mm256_loadu_ps(wx[1] + k), w2 = _mm256_loadu_ps(wx[2] + k);
+      const __m256 r1 = _mm256_fmadd_ps(w1, g[0][0], _mm256_mul_ps(w2, g[0][1]));
+      const __m256 r2 = _mm256_fmadd_ps(w1, g[1][0], _mm256_mul_ps(w2, g[1][1]));
+      _mm256_storeu_ps(out + k-k0, _mm256_fmadd_ps(
+                         _mm256_loadu_ps(wy[1] + k), r1, _mm256_mul_ps(_mm256_loadu_ps(wy[2] + k), r2)));
+      continue;
+    }
+
+    // per row, the 4x4 block of (lane, tap) pairs of lanes l and l+4 is
+    // transposed into one register per tap
+    __m256 r[4];
+    for(int b=0; b<4; ++b) {
+      __m128 q[8];
+      for(int l=0; l<8; ++l) q[l] = _mm_loadu_ps(f + iy[b][k+l]*stride + ix0[k+l]);
+      const __m256 t0 = _mm256_set_m128(q[4], q[0]), t1 = _mm256_set_m128(q[5], q[1]);
+      const __m256 t2 = _mm256_set_m128(q[6], q[2]), t3 = _mm256_set_m128(q[7], q[3]);
+      const __m256 u0 = _mm256_unpacklo_ps(t0, t1), u1 = _mm256_unpackhi_ps(t0, t1);
+      const __m256 u2 = _mm256_unpacklo_ps(t2, t3), u3 = _mm256_unpackhi_ps(t2, t3);
+      const __m256 g0 = _mm256_shuffle_ps(u0, u2, _MM_SHUFFLE(1, 0, 1, 0));
+      const __m256 g1 = _mm256_shuffle_ps(u0, u2, _MM_SHUFFLE(3, 2, 3, 2));
+      const __m256 g2 = _mm256_shuffle_ps(u1, u3, _MM_SHUFFLE(1, 0, 1, 0));
+      const __m256 g3 = _mm256_shuffle_ps(u1, u3, _MM_SHUFFLE(3, 2, 3, 2));
+      const __m256 v = _mm256_fmadd_ps(_mm256_loadu_ps(wx[0] + k), g0,
+                       _mm256_fmadd_ps(_mm256_loadu_ps(wx[1] + k), g1,
+                       _mm256_fmadd_ps(_mm256_loadu_ps(wx[2] + k), g2,
+                                       _mm256_mul_ps(_mm256_loadu_ps(wx[3] + k), g3))));
+      r[b] = _mm256_min_ps(_mm256_max_ps(v, _mm256_min_ps(g1, g2)), _mm256_max_ps(g1, g2));
+    }
+    const __m256 v = _mm256_fmadd_ps(_mm256_loadu_ps(wy[0] + k), r[0],
+                     _mm256_fmadd_ps(_mm256_loadu_ps(wy[1] + k), r[1],
+                     _mm256_fmadd_ps(_mm256_loadu_ps(wy[2] + k), r[2],
+                                     _mm256_mul_ps(_mm256_loadu_ps(wy[3] + k), r[3]))));
+    _mm256_storeu_ps(out + k-k0, _mm256_min_ps(
+                       _mm256_max_ps(v, _mm256_min_ps(r[1], r[2])), _mm256_max_ps(r[1], r[2])));
+  }
+  if(k<k1) sampleStencils<float>(f, stride, s, k, k1, out + k-k0);
+}
+#endif
+
+// float fields: the AVX2 kernels when the CPU has them
+inline void sampleStencils(
+  const float *f, const int stride, const SampleStencilBatch &s, const int k0, const int k1,
+  float *out)
+{
+#ifdef SMOKE_AVX2_DISPATCH
+  if(smokeSimdLevel()==kSmokeSimdAvx2) {
+    sampleStencilsAvx2(f, stride, s, k0, k1, out);
+    return;
+  }
+#endif
+  sampleStencils<float>(f, stride, s, k0, k1, out);
+}
+
+// 2D Grid
+template<typename T>
+class Grid2 {
+public:
+  enum { D = 2 };
+
+  explicit Grid2(const int size_x=0, const int size_y=0)
+    : _data(size_x*size_y), _sizeX(size_x), _sizeY(size_y) {
+  }
+
+  void init(const int size_x, const int size_y) {
+    _data.assign(size_x*size_y, 0);
+    _sizeX = size_x;
+    _sizeY = size_y;
+  }
+  void fill(const T &v) { _data.assign(size(), v); }
+  void swap(Grid2 &new_grid) {
+    _data.swap(new_grid._data);
+    _sizeX = new_grid._sizeX;
+    _sizeY = new_grid._sizeY;
+  }
+
+  // (x, y) in index space
+  T sampleAt(const tReal x, const tReal y, const SampleMode mode=kSampleLinear) const {
+    return sampleAt(makeSampleStencil(x, y, resX(), resY(), mode));
+  }
+  T sampleAt(const SampleStencil &s) const {
+    return static_cast<T>(sampleStencil(data(), resX(), s));
+  }
+
+  const T& operator()(const int i, const int j) const {
+    return _data[indexTo1D(i, j)];
+  }
+  T& operator()(const int i, const int j) {
+    return const_cast<T &>(static_cast<const Grid2 &>(*this)(i, j));
+  }
+
+  const T* data() const { return _data.data(); }
+  T* data() { return _data.data(); }
+
+  tUint indexTo1D(const int i, const int j) const { return j*_sizeX + i; }
+  tUint size() const { return _sizeX*_sizeY; }
+  int resX() const { return _sizeX; }
+  int resY() const { return _sizeY; }
+
+private:
+  std::vector<T> _data;
+  int _sizeX, _sizeY;
+};
+typedef Grid2<tReal> Grid2f;
+typedef Grid2<int>   Grid2i;
+
+// 2D Grid with compile-time extents; same interface as Grid2, so that loop
+// bounds are constants and the storage lives inside the owner
+template<typename T, int NX, int NY>
+class FixedGrid2 {
+public:
+  enum { D = 2 };
+
+  explicit FixedGrid2(const int size_x=NX, const int size_y=NY) { init(size_x, size_y); }
+
+  void init(const int size_x, const int size_y) {
+    assert(size_x==NX && size_y==NY);
+    _data.fill(0);
+  }
+  void fill(const T &v) { _data.fill(v); }
+  void swap(FixedGrid2 &new_grid) { _data.swap(new_grid._data); }
+
+  T sampleAt(const tReal x, const tReal y, const SampleMode mode=kSampleLinear) const {
+    return sampleAt(makeSampleStencil(x, y, resX(), resY(), mode));
+  }
+  T sampleAt(const SampleStencil &s) const {
+    return static_cast<T>(sampleStencil(data(), resX(), s));
+  }
+
+  const T& operator()(const int i, const int j) const {
+    return _data[indexTo1D(i, j)];
+  }
+  T& operator()(const int i, const int j) {
+    return const_cast<T &>(static_cast<const FixedGrid2 &>(*this)(i, j));
+  }
+
+  const T* data() const { return _data.data(); }
+  T* data() { return _data.data(); }
+
+  tUint indexTo1D(const int i, const int j) const { return j*NX + i; }
+  tUint size() const { return NX*NY; }
+  int resX() const { return NX; }
+  int resY() const { return NY; }
+
+private:
+  std::array<T, NX*NY> _data;
+};
+
+// Heap allocation counter, used to check that SmokeSolver::update() does not
+// allocate once warmed up. It only counts when exactly one translation unit
+// defines SMOKE_ALLOC_COUNTER_IMPLEMENTATION before including this header,
+// which replaces the global operator new/delete. The count is per thread, so
+// that other threads (GUI, drivers running several solvers) do not show up
+// in the check; the worker threads of update()'s own loops are not counted.
+inline unsigned long &smokeAllocCount() {
+  static thread_local unsigned long n = 0;
+  return n;
+}
+
+#ifdef SMOKE_ALLOC_COUNTER_IMPLEMENTATION
+void *operator new(std::size_t n) {
+  ++smokeAllocCount();
+  if(void *p = std::malloc(n ? n : 1)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+#endif
+
+// Pre-sized scratch grids handed out by RAII lease; the grids are allocated
+// once in init(), so that taking a lease never touches the heap
+template<typename G>
+class ScratchPool {
+public:
+  class Lease {
+  public:
+    explicit Lease(ScratchPool &pool) : _pool(&pool), _k(pool.acquire()) {}
+    Lease(Lease &&l) : _pool(l._pool), _k(l._k) { l._pool = nullptr; }
+    ~Lease() { if(_pool) _pool->release(_k); }
+
+    G &operator*() const { return _pool->_grids[_k]; }
+    G *operator->() const { return &_pool->_grids[_k]; }
+
+    Lease(const Lease &) = delete;
+    Lease &operator=(const Lease &) = delete;
+
+  private:
+    ScratchPool *_pool;
+    int _k;
+  };
+
+  void init(const int size_x, const int size_y, const int count) {
+    _grids.resize(count);
+    for(G &g : _grids) g.init(size_x, size_y);
+    _used.assign(count, 0);
+  }
+
+  Lease lease() { return Lease(*this); }
+  int available() const { return std::count(_used.begin(), _used.end(), 0); }
+
+private:
+  int acquire() {
+    const int k = std::find(_used.begin(), _used.end(), 0) - _used.begin();
+    assert(k<static_cast<int>(_used.size()) && "ScratchPool exhausted");
+    _used[k] = 1;
+    return k;
+  }
+  void release(const int k) { _used[k] = 0; }
+
+  std::vector<G> _grids;
+  std::vector<char> _used;
+};
+
+// Per-step diagnostics, gathered while the velocity is being projected
+struct SmokeDiagnostics {
+  tUint step;                   // step count once the step is done
+  tReal time;                   // simulation time
+  tReal divL2, divMax;          // L2 and Linf norms of the projected divergence
+  tReal mass;                   // total density
+  tReal kinetic;                // kinetic energy, 1/2 sum of the face velocities^2
+  tReal maxSpeed;               // max |u| or |v| over all faces
+  tReal cfl;                    // maxSpeed*dt/dx
+};
+
+inline void writeDiagnosticsHeader(std::ostream &out) {
+  out << "step,time,div_l2,div_max,mass,kinetic,max_speed,cfl\n";
+}
+inline void writeDiagnostics(std::ostream &out, const SmokeDiagnostics &d) {
+  out << d.step << ',' << d.time << ',' << d.divL2 << ',' << d.divMax << ','
+      << d.mass << ',' << d.kinetic << ',' << d.maxSpeed << ',' << d.cfl << '\n';
+}
+
+// Fixed-capacity history keeping the most recent records; [0] is the oldest
+template<typename T>
+class RingBuffer {
+public:
+  explicit RingBuffer(const int capacity=0) : _data(capacity), _head(0), _size(0) {}
+
+  void push(const T &v) {
+    _data[(_head + _size)%capacity()] = v;
+    if(_size<capacity()) ++_size; else _head = (_head + 1)%capacity();
+  }
+  void clear() { _head = _size = 0; }
+
+  const T &operator[](const int k) const { return _data[(_head + k)%capacity()]; }
+  const T &back() const { return (*this)[_size-1]; }
+  int size() const { return _size; }
+  int capacity() const { return static_cast<int>(_data.size()); }
+  bool empty() const { return _size==0; }
+
+private:
+  std::vector<T> _data;
+  int _head, _size;
+};
+
+// grids smaller than this are not worth waking up a thread team for
+const tUint kOmpMinCells = 128*128;
+
+// Relaxation schemes for the pressure Poisson equation
+enum PressureRelax {
+  kRelaxJacobi = 0,             // one full-grid sweep at a time
+  kRelaxJacobiBlocked           // several sweeps per cache-resident tile
+};
+
+// Resolution-independent handle on a solver, as returned by makeSmokeSolver();
+// fields are stored row by row (index j*resX()+i)
+class SmokeSolverBase {
+public:
+  virtual ~SmokeSolverBase() {}
+
+  virtual void initScene(
+    const int res_x, const int res_y,
+    const glm::vec2 &src_cen, const glm::vec2 &src_size) = 0;
+  virtual void update() = 0;
+
+  virtual const tReal *densityData() const = 0;
+  virtual const tReal *velocityUData() const = 0;
+  virtual const tReal *velocityVData() const = 0;
+
+  virtual tReal timestep() const = 0;
+  virtual int resX() const = 0;
+  virtual int resY() const = 0;
+
+  virtual void setPressureRelax(
+    const PressureRelax relax, const int iters, const int tile=128,
+    const int sweeps_per_tile=16) = 0;
+  virtual int pressureIters() const = 0;
+  virtual void setVerbose(const bool verbose) = 0;
+};
+
+// The solver is written once against the grid interface; GridF is either
+// the dynamic Grid2 or a FixedGrid2 of a preset resolution
+template<typename GridF>
+class SmokeSolverT final : public SmokeSolverBase {
+public:
+  typedef GridF tGridF;
+
+  explicit SmokeSolverT(
+    const tReal dt=0.01, const glm::vec2 g=glm::vec2(0.0, -9.8), const tReal buoy=0.2)
+    : _verbose(true), _diagSink(nullptr), _step(0), _dt(dt), _g(g), _buoy(buoy),
+      _pRelax(kRelaxJacobi), _pIters(80), _pTile(128), _pSweepsPerTile(16) {
+  }
+
+  // assume a grid with the size of res_x*res_y; a smoke mass is at f_cen with
+  // the size of f_size
+  void initScene(
+    const int res_x, const int res_y,
+    const glm::vec2 &src_cen, const glm::vec2 &src_size) override {
+    _c.init(res_x, res_y);      // cell type
+    _u.init(res_x, res_y);      // velocity u
+    _v.init(res_x, res_y);      // velocity v
+    _fx.init(res_x, res_y);     // force in x
+    _fy.init(res_x, res_y);     // force in y
+    _p.init(res_x, res_y);      // pressure
+    _d.init(res_x, res_y);      // density
+
+    _scratch.init(res_x, res_y, kScratchGrids);
+    reserveTileBuffers();
+    _step = 0;
+
+    _srcCen = src_cen;
+    _srcSize = src_size;
+
+    // cell types: open boundary around fluid
+    for(int j=1; j<res_y-1; ++j)
+      for(int i=1; i<res_x-1; ++i) _c.set(i, j, kCellFluid);
+    _c.updateRowFlags();
+
+    addSource(_d, _srcCen, _srcSize);
+  }
+
+  void addSource(GridF &d, const glm::vec2 &src_cen, const glm::vec2 &src_size) const {
+    // smoke mass (NOTE: centered grid)
+    for(int j=0; j<resY(); ++j) {
+      for(int i=0; i<resX(); ++i) {
+        if(i>(src_cen.x-0.5 - src_size.x) &&
+           i<(src_cen.x-0.5 + src_size.x) &&
+           j>(src_cen.y-0.5 - src_size.y) &&
+           j<(src_cen.y-0.5 + src_size.y)) // if inside of the given box
+          d(i, j) = 1.0;                   // fill it up with smoke density
+      }
+    }
+  }
+
+  void advectCentered(
+    GridF &f, const GridF &u, const GridF &v, const tReal dt) const {
+    // TODO:
+  }
+
+  void advectStaggered(
+    GridF &fu, GridF &fv,
+    const GridF &u, const GridF &v, const tReal dt) const {
+    // TODO:
+  }
+
+  void calculateBuoyancy(
+    GridF &fx, GridF &fy,
+    const GridF &d, const glm::vec2 &g, const tReal coef) const {
+    // TODO:
+  }
+
+  void updateVelocityWithForce(
+    GridF &u, GridF &v,
+    const GridF &fx, const GridF &fy, const tReal dt) const {
+    // TODO:
+  }
+
+  void solvePressure(
+    GridF &p, const GridF &u, const GridF &v, const tReal dt) const {
+    const typename ScratchPool<GridF>::Lease div = _scratch.lease(), tmp = _scratch.lease();
+
+    // right-hand side: divergence of the staggered velocity over dt (dx=1);
+    // faces against obstacles do not move
+    const tReal over_dt = 1e0/dt;
+    for(int j=0; j<resY(); ++j) {
+      for(int i=0; i<resX(); ++i) {
+        if(_c(i, j)!=kCellFluid) { (*div)(i, j) = 0; continue; }
+        const tReal ul = _c.isSolid(i-1, j) ? 0 : u(i, j);
+        const tReal ur = _c.isSolid(i+1, j) ? 0 : u(i+1, j);
+        const tReal vd = _c.isSolid(i, j-1) ? 0 : v(i, j);
+        const tReal vu = _c.isSolid(i, j+1) ? 0 : v(i, j+1);
+        (*div)(i, j) = over_dt*(ur - ul + vu - vd);
+      }
+    }
+
+    if(_pRelax==kRelaxJacobiBlocked)
+      relaxPressureBlocked(p, *tmp, *div, _pIters, _pTile, _pSweepsPerTile);
+    else
+      relaxPressure(p, *tmp, *div, _pIters);
+  }
+
+  // plain Jacobi: each sweep streams the whole grid; tmp is a same-sized
+  // back buffer
+  void relaxPressure(
+    GridF &p, GridF &tmp, const GridF &rhs, const int sweeps) const {
+    tmp = p;                    // the open boundary is never touched below
+    // ping-pong without swapping, which would copy a FixedGrid2
+    for(int s=0; s+1<sweeps; s+=2) {
+      jacobiSweep(tmp, p, rhs);
+      jacobiSweep(p, tmp, rhs);
+    }
+    if(sweeps%2) {
+      jacobiSweep(tmp, p, rhs);
+      p = tmp;
+    }
+  }
+
+  void jacobiSweep(GridF &dst, const GridF &src, const GridF &rhs) const {
+#pragma omp parallel for if(gridSize()>=kOmpMinCells)
+    for(int j=1; j<resY()-1; ++j)
+      jacobiRow(&dst(0, j), &src(0, j), 0, resX(), &rhs(0, j), j, 1, resX()-1);
+  }
+
+  // Jacobi update of cells [i0, i1) of row j; src and dst point at cell
+  // (off, j) of rows that are stride apart (off: the first column of a tile,
+  // so that no pointer leaves its buffer). Fluid cells average their
+  // non-solid neighbours (open ones hold p=0); the others are copied.
+  // Coefficients come from the mask a 64-cell word at a time, with a plain
+  // 5-point path for rows and words that no obstacle touches.
+  void jacobiRow(
+    tReal *dst, const tReal *src, const int off, const int stride, const tReal *rhs,
+    const int j, const int i0, const int i1) const {
+    if(_c.plainRow(j)) {
+      for(int i=i0; i<i1; ++i) {
+        const tReal *c = src + (i - off);
+        dst[i-off] = 0.25f*(c[-1] + c[1] + c[-stride] + c[stride] - rhs[i]);
+      }
+      return;
+    }
+
+    for(int w=i0/CellMask::kBits; w*CellMask::kBits<i1; ++w) {
+      const int a = std::max(i0, w*CellMask::kBits);
+      const int b = std::min(i1, (w+1)*CellMask::kBits);
+      const CellMask::tWord fl = _c.fluidWord(j, w);
+
+      // bits of [a, b) within the word
+      const CellMask::tWord range =
+        ((b-a==CellMask::kBits) ? ~CellMask::tWord(0) : ((CellMask::tWord(1) << (b-a)) - 1))
+        << (a%CellMask::kBits);
+
+      if(_c.solidFree(j, w) && (fl & range)==range) {
+        for(int i=a; i<b; ++i) {
+          const tReal *c = src + (i - off);
+          dst[i-off] = 0.25f*(c[-1] + c[1] + c[-stride] + c[stride] - rhs[i]);
+        }
+      } else if(_c.solidFree(j, w)) {
+        for(int i=a; i<b; ++i) {
+          const tReal *c = src + (i - off);
+          const tReal pn = 0.25f*(c[-1] + c[1] + c[-stride] + c[stride] - rhs[i]);
+          dst[i-off] = ((fl >> (i%CellMask::kBits)) & 1) ? pn : c[0];
+        }
+      } else {
+        CellMask::tWord sl, sr, sd, su;
+        _c.solidNeighbours(j, w, sl, sr, sd, su);
+        for(int i=a; i<b; ++i) {
+          const int k = i%CellMask::kBits;
+          const tReal kl = 1 - ((sl >> k) & 1), kr = 1 - ((sr >> k) & 1);
+          const tReal kd = 1 - ((sd >> k) & 1), ku = 1 - ((su >> k) & 1);
+          const tReal n = kl + kr + kd + ku;
+          const tReal *c = src + (i - off);
+          const tReal pn = (kl*c[-1] + kr*c[1] + kd*c[-stride] + ku*c[stride] - rhs[i])/
+            std::max(n, tReal(1));
+          dst[i-off] = ((fl >> k) & 1) ? pn : c[0];
+        }
+      }
+    }
+  }
+
+  // temporally blocked Jacobi: each tile is copied with a halo as wide as the
+  // number of sweeps it runs, relaxed in place while the valid region shrinks
+  // by one cell per sweep (trapezoid), and only its core is written back;
+  // gives the same result as relaxPressure() at a fraction of the DRAM traffic,
+  // which pays off once the grid no longer fits in the last-level cache
+  void relaxPressureBlocked(
+    GridF &p, GridF &tmp, const GridF &rhs, const int sweeps,
+    const int tile, const int sweeps_per_tile) const {
+    const int nx = (resX() + tile - 1)/tile;
+    const int ny = (resY() + tile - 1)/tile;
+
+    for(int s0=0; s0<sweeps; s0+=sweeps_per_tile) {
+      const int ns = std::min(sweeps_per_tile, sweeps - s0);
+      const int w = tile + 2*ns;
+      // the buffers are reserved by initScene() and setPressureRelax(); a
+      // team larger than they allow (thread count raised since) is capped
+      // rather than growing them inside update()
+      if(_tileBuf.size()<static_cast<std::size_t>(2*w*w)) reserveTileBuffers(w);
+#ifdef _OPENMP
+      const int nt = std::min<int>(omp_get_max_threads(), _tileBuf.size()/(2*w*w));
+#endif
+
+#pragma omp parallel num_threads(nt)
+      {
+#ifdef _OPENMP
+        tReal *a = &_tileBuf[2*w*w*omp_get_thread_num()];
+#else
+        tReal *a = &_tileBuf[0];
+#endif
+        tReal *b = a + w*w;
+
+#pragma omp for collapse(2) schedule(static)
+        for(int ty=0; ty<ny; ++ty) {
+          for(int tx=0; tx<nx; ++tx) {
+            // core [ci0, ci1)x[cj0, cj1) and its halo [i0, i1)x[j0, j1)
+            const int ci0 = tx*tile, ci1 = std::min(ci0 + tile, resX());
+            const int cj0 = ty*tile, cj1 = std::min(cj0 + tile, resY());
+            const int i0 = std::max(ci0 - ns, 0), i1 = std::min(ci1 + ns, resX());
+            const int j0 = std::max(cj0 - ns, 0), j1 = std::min(cj1 + ns, resY());
+            const int lw = i1 - i0;
+
+            for(int j=j0; j<j1; ++j)
+              std::copy(&p(i0, j), &p(i0, j) + lw, &a[(j-j0)*lw]);
+            std::copy(a, a + lw*(j1-j0), b);
+
+            for(int s=1; s<=ns; ++s) {
+              // shrink only the sides cut from the neighbouring tiles
+              // (the outermost grid cells are open and never updated)
+              const int si0 = (i0>0) ? i0+s : 1, si1 = (i1<resX()) ? i1-s : i1-1;
+              const int sj0 = (j0>0) ? j0+s : 1, sj1 = (j1<resY()) ? j1-s : j1-1;
+              for(int j=sj0; j<sj1; ++j)
+                jacobiRow(&b[(j-j0)*lw], &a[(j-j0)*lw], i0, lw, &rhs(0, j), j, si0, si1);
+              std::swap(a, b);
+            }
+
+            for(int j=cj0; j<cj1; ++j)
+              std::copy(&a[(j-j0)*lw + ci0-i0], &a[(j-j0)*lw + ci1-i0], &tmp(ci0, j));
+          }
+        }
+      }
+      p.swap(tmp);
+    }
+  }
+
+  // subtract the pressure gradient from every face next to a fluid cell; when
+  // diag is given, also measure the result in the same pass (see below)
+  void updateVelocityWithPressure(
+    GridF &u, GridF &v, const GridF &p, const tReal dt,
+    SmokeDiagnostics *diag=nullptr) const {
+    const int nx = resX(), ny = resY();
+    if(!diag) {
+      for(int j=0; j<ny; ++j)
+        for(int i=0; i<nx; ++i) projectFaces(u, v, p, dt, i, j);
+      return;
+    }
+
+    // a cell's divergence is final as soon as its top face is updated, so
+    // the divergence of row j-1 is taken while row j is being updated
+    double div2 = 0, ke = 0, mass = 0;
+    tReal div_max = 0, speed_max = 0;
+    for(int j=0; j<ny; ++j) {
+      for(int i=0; i<nx; ++i) {
+        projectFaces(u, v, p, dt, i, j);
+
+        if(j>0 && _c(i, j-1)==kCellFluid) {
+          const tReal div = u(i+1, j-1) - u(i, j-1) + v(i, j) - v(i, j-1);
+          div2 += div*div;
+          div_max = std::max(div_max, std::abs(div));
+        }
+        ke += u(i, j)*u(i, j) + v(i, j)*v(i, j);
+        speed_max = std::max(speed_max, std::max(std::abs(u(i, j)), std::abs(v(i, j))));
+        mass += _d(i, j);
+      }
+    }
+
+    diag->divL2 = std::sqrt(div2);
+    diag->divMax = div_max;
+    diag->kinetic = 0.5*ke;
+    diag->maxSpeed = speed_max;
+    diag->cfl = speed_max*dt;
+    diag->mass = mass;
+  }
+
+  // left and bottom faces of cell (i, j): closed next to an obstacle,
+  // otherwise pushed by the pressure gradient if they border the fluid
+  void projectFaces(
+    GridF &u, GridF &v, const GridF &p, const tReal dt, const int i, const int j) const {
+    const int c = _c(i, j);
+    if(i>0) {
+      const int cl = _c(i-1, j);
+      if(c==kCellSolid || cl==kCellSolid) u(i, j) = 0;
+      else if(c==kCellFluid || cl==kCellFluid) u(i, j) -= dt*(p(i, j) - p(i-1, j));
+    }
+    if(j>0) {
+      const int cd = _c(i, j-1);
+      if(c==kCellSolid || cd==kCellSolid) v(i, j) = 0;
+      else if(c==kCellFluid || cd==kCellFluid) v(i, j) -= dt*(p(i, j) - p(i, j-1));
+    }
+  }
+
+  void update() override {
+    if(_verbose) std::cout << '.' << std::flush;
+#ifndef NDEBUG
+    const unsigned long n_alloc = smokeAllocCount();
+#endif
+    addSource(_d, _srcCen, _srcSize);
+
+    advectCentered(_d, _u, _v, _dt);
+    advectStaggered(_u, _v, _u, _v, _dt);
+    calculateBuoyancy(_fx, _fy, _d, _g, _buoy);
+    updateVelocityWithForce(_u, _v, _fx, _fy, _dt);
+    solvePressure(_p, _u, _v, _dt);
+
+    if(_diagHist.capacity()) {
+      SmokeDiagnostics rec;
+      updateVelocityWithPressure(_u, _v, _p, _dt, &rec);
+      rec.step = _step + 1;
+      rec.time = rec.step*_dt;
+      _diagHist.push(rec);
+      if(_diagSink) writeDiagnostics(*_diagSink, rec);
+    } else {
+      updateVelocityWithPressure(_u, _v, _p, _dt);
+    }
+
+#ifndef NDEBUG
+    assert((_step<kWarmupSteps || smokeAllocCount()==n_alloc) &&
+           "heap allocation inside SmokeSolver::update()");
+#endif
+    ++_step;
+  }
+
+  const CellMask &cells() const { return _c; }
+
+  // static obstacles, rasterized into the cell mask after initScene(); the
+  // smoke and pressure inside are cleared (coordinates in cells)
+  void addObstacleBox(const glm::vec2 &cen, const glm::vec2 &half_size) {
+    _c.addSolidBox(cen.x, cen.y, half_size.x, half_size.y);
+    clearSolids();
+  }
+  void addObstacleCircle(const glm::vec2 &cen, const tReal radius) {
+    _c.addSolidCircle(cen.x, cen.y, radius);
+    clearSolids();
+  }
+  void addObstacleImage(
+    const unsigned char *img, const int w, const int h, const unsigned char threshold=127) {
+    _c.addSolidImage(img, w, h, threshold);
+    clearSolids();
+  }
+  const GridF &density() const { return _d; }
+  const GridF &velocity_u() const { return _u; }
+  const GridF &velocity_v() const { return _v; }
+
+  const tReal *densityData() const override { return _d.data(); }
+  const tReal *velocityUData() const override { return _u.data(); }
+  const tReal *velocityVData() const override { return _v.data(); }
+
+  tReal timestep() const override { return _dt; }
+
+  // pressure relaxation: scheme, total sweeps, tile edge (cells) and sweeps
+  // run on a tile before it is written back
+  void setPressureRelax(
+    const PressureRelax relax, const int iters, const int tile=128,
+    const int sweeps_per_tile=16) override {
+    _pRelax = relax;
+    _pIters = iters;
+    _pTile = std::max(tile, 1);
+    _pSweepsPerTile = std::max(sweeps_per_tile, 1);
+    reserveTileBuffers();
+  }
+  int pressureIters() const override { return _pIters; }
+
+  int resX() const override { return _d.resX(); }
+  int resY() const override { return _d.resY(); }
+  tUint gridSize() const { return _d.size(); }
+
+  tUint stepCount() const { return _step; }
+
+  // print a dot per step
+  void setVerbose(const bool verbose) override { _verbose = verbose; }
+
+  // keep the diagnostics of the last `history` steps (0 turns them off) and
+  // optionally stream every record as a CSV row to sink
+  void enableDiagnostics(const int history, std::ostream *sink=nullptr) {
+    _diagHist = RingBuffer<SmokeDiagnostics>(history);
+    _diagSink = history ? sink : nullptr;
+    if(_diagSink) writeDiagnosticsHeader(*_diagSink);
+  }
+  const RingBuffer<SmokeDiagnostics> &diagnostics() const { return _diagHist; }
+
+private:
+  enum { kScratchGrids = 4, kWarmupSteps = 2 };
+
+  // called after the obstacles changed
+  void clearSolids() {
+    _c.updateRowFlags();
+    for(int j=0; j<resY(); ++j)
+      for(int i=0; i<resX(); ++i)
+        if(_c.isSolid(i, j)) _d(i, j) = _p(i, j) = _u(i, j) = _v(i, j) = 0;
+  }
+
+  // two w*w tile buffers per thread for relaxPressureBlocked(); only grows,
+  // i.e., allocates when the tiling or thread count changes, never per step
+  void reserveTileBuffers(int w=0) const {
+    if(!w) w = _pTile + 2*_pSweepsPerTile;
+#ifdef _OPENMP
+    const tUint n = 2*w*w*omp_get_max_threads();
+#else
+    const tUint n = 2*w*w;
+#endif
+    if(static_cast<tUint>(_tileBuf.size())<n) _tileBuf.resize(n);
+  }
+
+  glm::vec2  _srcCen, _srcSize; // smoke source (a box)
+
+  CellMask _c;                  // cell type
+  GridF _u, _v;                 // velocity u and v
+  GridF _fx, _fy;               // force in x and y
+  GridF _p, _d;                 // pressure and smoke marker density
+
+  mutable ScratchPool<GridF> _scratch; // temporary grids for the stages
+  mutable std::vector<tReal> _tileBuf; // per-thread tiles for blocked relaxation
+
+  bool _verbose;
+
+  RingBuffer<SmokeDiagnostics> _diagHist; // recent per-step diagnostics
+  std::ostream *_diagSink;                // CSV output of the diagnostics
+
+  // simulation
+  tUint _step;                  // step count
+  tReal _dt;                    // time step
+
+  glm::vec2  _g;                // gravity
+  tReal _buoy;                  // buoyancy factor
+
+  // pressure solver
+  PressureRelax _pRelax;        // relaxation scheme
+  int _pIters;                  // relaxation sweeps per solve
+  int _pTile, _pSweepsPerTile;  // temporal blocking parameters
+};
+
+typedef SmokeSolverT<Grid2f> SmokeSolver;
+
+template<int NX, int NY>
+using SmokeSolverFixed = SmokeSolverT< FixedGrid2<tReal, NX, NY> >;
+
+// Returns a solver specialized for res_x*res_y if it is one of the presets
+// (and allow_fixed), and the dynamic SmokeSolver otherwise; initScene() still
+// has to be called
+inline std::shared_ptr<SmokeSolverBase> makeSmokeSolver(
+  const int res_x, const int res_y,
+  const tReal dt=0.01, const glm::vec2 g=glm::vec2(0.0, -9.8), const tReal buoy=0.2,
+  const bool allow_fixed=true)
+{
+#define SMOKE_FIXED_PRESET(NX, NY)                                      \
+  if(allow_fixed && res_x==NX && res_y==NY)                             \
+    return std::make_shared< SmokeSolverFixed<NX, NY> >(dt, g, buoy)
+  SMOKE_FIXED_PRESET(32, 64);
+  SMOKE_FIXED_PRESET(64, 64);
+  SMOKE_FIXED_PRESET(64, 128);
+  SMOKE_FIXED_PRESET(128, 128);
+  SMOKE_FIXED_PRESET(128, 256);
+#undef SMOKE_FIXED_PRESET
+  return std::make_shared<SmokeSolver>(dt, g, buoy);
+}
+
+#endif  /* _SMOKESOLVER_HPP_ */
@@ -0,0 +1,260 @@
+// ----------------------------------------------------------------------------
+// SmokeTracers.hpp
+//
+// Description: Passive tracer particles for flow visualization. Particles are
+//   stored as structure-of-arrays, advected with midpoint RK2 through the
+//   staggered velocity in blocks of kLanes (AVX2 when the CPU has it), and
+//   splatted in parallel into an accumulation image to be drawn as a texture.
+//   Dead particles go to a preallocated free list and are reused by emit(),
+//   so nothing is allocated once the system is constructed.
+// ----------------------------------------------------------------------------
+
+#ifndef _SMOKETRACERS_HPP_
+#define _SMOKETRACERS_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "SmokeSolver.hpp"
+
+class SmokeTracers {
+public:
+  enum { kLanes = 8 };          // particles per SIMD block
+
+  // positions are in cells (cell centers at integer+0.5, as addSource());
+  // particles die after lifetime seconds or when they leave the grid
+  explicit SmokeTracers(const int capacity=1<<20, const tReal lifetime=5) :
+    _lifetime(lifetime), _seed(0x9e3779b9u), _alive(0), _imgX(0), _imgY(0) {
+    const int n = (capacity + kLanes - 1)/kLanes*kLanes;
+    _x.assign(n, 0);
+    _y.assign(n, 0);
+    _age.assign(n, 0);
+    _live.assign(n, 0);
+    _died.assign(n/kLanes, 0);
+    _free.resize(n);
+    for(int k=0; k<n; ++k) _free[k] = n-1-k; // pops 0, 1, 2, ...
+  }
+
+  // up to count particles uniformly in the box cen +/- half_size; returns how
+  // many were emitted
+  int emit(const int count, const glm::vec2 &cen, const glm::vec2 &half_size) {
+    const int n = std::min(count, static_cast<int>(_free.size()));
+    for(int e=0; e<n; ++e) {
+      const int k = _free.back();
+      _free.pop_back();
+      _x[k] = cen.x + half_size.x*(2*random() - 1);
+      _y[k] = cen.y + half_size.y*(2*random() - 1);
+      _age[k] = 0;
+      _live[k] = 1;
+    }
+    _alive += n;
+    return n;
+  }
+
+  // one RK2 step through the staggered u, v (u(i, j) at (i, j+0.5) and
+  // v(i, j) at (i+0.5, j)); dead lanes are computed too and discarded
+  template<typename GridF>
+  void advect(const GridF &u, const GridF &v, const tReal dt) {
+    const int nx = u.resX(), ny = u.resY();
+    const tReal *pu = u.data(), *pv = v.data();
+    const int blocks = static_cast<int>(_died.size());
+    tReal *x = _x.data(), *y = _y.data(), *age = _age.data();
+    std::uint8_t *live = _live.data(), *died = _died.data();
+    const tReal life = _lifetime;
+#ifdef SMOKE_AVX2_DISPATCH
+    const bool avx2 = smokeSimdLevel()==kSmokeSimdAvx2;
+#endif
+
+#pragma omp parallel for schedule(static)
+    for(int b=0; b<blocks; ++b) {
+#ifdef SMOKE_AVX2_DISPATCH
+      if(avx2) {
+        died[b] = advectBlockAvx2(pu, pv, nx, ny, dt, b*kLanes);
+        continue;
+      }
+#endif
+      std::uint8_t dead = 0;
+#pragma omp simd reduction(|:dead)
+      for(int l=0; l<kLanes; ++l) {
+        const int k = b*kLanes + l;
+        const tReal x0 = x[k], y0 = y[k];
+        const tReal xm = x0 + 0.5f*dt*sample(pu, nx, ny, x0, y0 - 0.5f);
+        const tReal ym = y0 + 0.5f*dt*sample(pv, nx, ny, x0 - 0.5f, y0);
+        const tReal x1 = x0 + dt*sample(pu, nx, ny, xm, ym - 0.5f);
+        const tReal y1 = y0 + dt*sample(pv, nx, ny, xm - 0.5f, ym);
+        const tReal a = age[k] + dt;
+        const std::uint8_t was = live[k];
+        const std::uint8_t is = was & (x1>=0) & (x1<nx) & (y1>=0) & (y1<ny) & (a<life);
+        x[k] = x1;
+        y[k] = y1;
+        age[k] = a;
+        live[k] = is;
+        dead |= static_cast<std::uint8_t>((was & ~is & 1) << l);
+      }
+      died[b] = dead;
+    }
+
+    // one byte per block, so the scan is short next to the advection
+    for(int b=0; b<blocks; ++b) {
+      if(!died[b]) continue;
+      for(int l=0; l<kLanes; ++l)
+        if((died[b] >> l) & 1) { _free.push_back(b*kLanes + l); --_alive; }
+    }
+  }
+
+  // accumulates gain per particle into an image of upres times the grid
+  // resolution, bilinearly; per-thread images are summed at the end
+  void splat(const int res_x, const int res_y, const int upres=2, const tReal gain=0.05) {
+    _imgX = res_x*upres;
+    _imgY = res_y*upres;
+    const int np = _imgX*_imgY;
+#ifdef _OPENMP
+    const int nt = omp_get_max_threads();
+#else
+    const int nt = 1;
+#endif
+    if(_image.size()<static_cast<std::size_t>(np)) _image.resize(np);
+    if(_accum.size()<static_cast<std::size_t>(np)*nt) _accum.resize(static_cast<std::size_t>(np)*nt);
+
+    const int n = static_cast<int>(_x.size());
+    const tReal scale = static_cast<tReal>(upres);
+#pragma omp parallel num_threads(nt)
+    {
+      // the team may be smaller than nt (nested, OMP_DYNAMIC): only its
+      // images are zeroed, so only they are summed
+#ifdef _OPENMP
+      tReal *img = &_accum[static_cast<std::size_t>(np)*omp_get_thread_num()];
+      const int team = omp_get_num_threads();
+#else
+      tReal *img = &_accum[0];
+      const int team = 1;
+#endif
+      std::fill(img, img + np, tReal(0));
+#pragma omp for schedule(static)
+      for(int k=0; k<n; ++k) {
+        if(!_live[k]) continue;
+        // pixel centers at integer+0.5 as well
+        const tReal px = clamp(_x[k]*scale - 0.5f, 0, _imgX-1.001f);
+        const tReal py = clamp(_y[k]*scale - 0.5f, 0, _imgY-1.001f);
+        const int i = static_cast<int>(px), j = static_cast<int>(py);
+        const tReal s = px - i, t = py - j;
+        tReal *p = img + j*_imgX + i;
+        p[0] += gain*(1-s)*(1-t);
+        p[1] += gain*s*(1-t);
+        p[_imgX] += gain*(1-s)*t;
+        p[_imgX+1] += gain*s*t;
+      }
+      // implicit barrier above; every thread then sums a range of pixels
+#pragma omp for schedule(static)
+      for(int q=0; q<np; ++q) {
+        tReal sum = 0;
+        for(int th=0; th<team; ++th) sum += _accum[static_cast<std::size_t>(np)*th + q];
+        _image[q] = sum;
+      }
+    }
+  }
+
+  // the last splat(), row by row from the bottom
+  const tReal *image() const { return _image.data(); }
+  int imageResX() const { return _imgX; }
+  int imageResY() const { return _imgY; }
+
+  int alive() const { return _alive; }
+  int capacity() const { return static_cast<int>(_x.size()); }
+
+private:
+  // bilinear lookup of a row-major nx*ny field at (x, y) in its own index
+  // space, clamped to the border samples
+  static tReal sample(const tReal *f, const int nx, const int ny, tReal x, tReal y) {
+    x = std::min(std::max(x, tReal(0)), nx - 1.001f);
+    y = std::min(std::max(y, tReal(0)), ny - 1.001f);
+    const int i = static_cast<int>(x), j = static_cast<int>(y);
+    const tReal s = x - i, t = y - j;
+    const int k = j*nx + i;
+    return (1-t)*((1-s)*f[k] + s*f[k+1]) + t*((1-s)*f[k+nx] + s*f[k+nx+1]);
+  }
+
+#ifdef SMOKE_AVX2_DISPATCH
+  // sample() in 8 lanes; the two taps of a row are one 2-float load per lane
+  SMOKE_TARGET_AVX2 static __m256 sample8(
+    const float *f, const int nx, const int ny, __m256 x, __m256 y) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_setzero_ps()), _mm256_set1_ps(nx - 1.001f));
+    y = _mm256_min_ps(_mm256_max_ps(y, _mm256_setzero_ps()), _mm256_set1_ps(ny - 1.001f));
+    const __m256i i = _mm256_cvttps_epi32(x), j = _mm256_cvttps_epi32(y);
+    const __m256 s = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i)), t = _mm256_sub_ps(y, _mm256_cvtepi32_ps(j));
+    alignas(32) int k[8];
+    _mm256_store_si256(reinterpret_cast<__m256i *>(k),
+                       _mm256_add_epi32(_mm256_mullo_epi32(j, _mm256_set1_epi32(nx)), i));
+
+    // per row, lanes (2h, 2h+1) in one register, then split into the taps
+    __m256 g[2][2];
+    for(int r=0; r<2; ++r) {
+      __m128 q[4];
+      for(int h=0; h<4; ++h)
+        q[h] = _mm_castpd_ps(_mm_loadh_pd(
+                               _mm_load_sd(reinterpret_cast<const double *>(f + k[2*h] + r*nx)),
+                               reinterpret_cast<const double *>(f + k[2*h+1] + r*nx)));
+      const __m256 lo = _mm256_set_m128(q[2], q[0]), hi = _mm256_set_m128(q[3], q[1]);
+      g[r][0] = _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+      g[r][1] = _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1));
+    }
+    const __m256 one = _mm256_set1_ps(1);
+    const __m256 s1 = _mm256_sub_ps(one, s), t1 = _mm256_sub_ps(one, t);
+    const __m256 r0 = _mm256_fmadd_ps(s1, g[0][0], _mm256_mul_ps(s, g[0][1]));
+    const __m256 r1 = _mm256_fmadd_ps(s1, g[1][0], _mm256_mul_ps(s, g[1][1]));
+    return _mm256_fmadd_ps(t1, r0, _mm256_mul_ps(t, r1));
+  }
+
+  // the block of the scalar loop in advect() starting at particle k0; returns
+  // its lanes that died
+  SMOKE_TARGET_AVX2 std::uint8_t advectBlockAvx2(
+    const float *pu, const float *pv, const int nx, const int ny, const tReal dt, const int k0) {
+    const __m256 half = _mm256_set1_ps(0.5f), hdt = _mm256_set1_ps(0.5f*dt), vdt = _mm256_set1_ps(dt);
+    const __m256 x0 = _mm256_loadu_ps(&_x[k0]), y0 = _mm256_loadu_ps(&_y[k0]);
+    const __m256 xm = _mm256_fmadd_ps(hdt, sample8(pu, nx, ny, x0, _mm256_sub_ps(y0, half)), x0);
+    const __m256 ym = _mm256_fmadd_ps(hdt, sample8(pv, nx, ny, _mm256_sub_ps(x0, half), y0), y0);
+    const __m256 x1 = _mm256_fmadd_ps(vdt, sample8(pu, nx, ny, xm, _mm256_sub_ps(ym, half)), x0);
+    const __m256 y1 = _mm256_fmadd_ps(vdt, sample8(pv, nx, ny, _mm256_sub_ps(xm, half), ym), y0);
+    const __m256 a = _mm256_add_ps(_mm256_loadu_ps(&_age[k0]), vdt);
+    _mm256_storeu_ps(&_x[k0], x1);
+    _mm256_storeu_ps(&_y[k0], y1);
+    _mm256_storeu_ps(&_age[k0], a);
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 in = _mm256_and_ps(
+      _mm256_and_ps(_mm256_cmp_ps(x1, zero, _CMP_GE_OQ), _mm256_cmp_ps(x1, _mm256_set1_ps(nx), _CMP_LT_OQ)),
+      _mm256_and_ps(
+        _mm256_and_ps(_mm256_cmp_ps(y1, zero, _CMP_GE_OQ), _mm256_cmp_ps(y1, _mm256_set1_ps(ny), _CMP_LT_OQ)),
+        _mm256_cmp_ps(a, _mm256_set1_ps(_lifetime), _CMP_LT_OQ)));
+    const int mask = _mm256_movemask_ps(in);
+    std::uint8_t dead = 0;
+    for(int l=0; l<kLanes; ++l) {
+      const std::uint8_t was = _live[k0 + l];
+      const std::uint8_t is = was & ((mask >> l) & 1);
+      _live[k0 + l] = is;
+      dead |= static_cast<std::uint8_t>((was & ~is & 1) << l);
+    }
+    return dead;
+  }
+#endif
+
+  // xorshift32 in [0, 1); emission is serial
+  tReal random() {
+    _seed ^= _seed << 13;
+    _seed ^= _seed >> 17;
+    _seed ^= _seed << 5;
+    return (_seed >> 8)*(1.f/16777216.f);
+  }
+
+  std::vector<tReal> _x, _y, _age;       // per particle (SoA)
+  std::vector<std::uint8_t> _live;       // 1 if alive
+  std::vector<std::uint8_t> _died;       // lanes that died in the last advect()
+  std::vector<int> _free;                // dead slots, capacity never exceeded
+  std::vector<tReal> _accum, _image;     // per-thread and summed splats
+  tReal _lifetime;
+  std::uint32_t _seed;
+  int _alive, _imgX, _imgY;
+};
+
+#endif  /* _SMOKETRACERS_HPP_ */
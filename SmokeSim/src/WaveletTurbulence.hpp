@@ -0,0 +1,164 @@
+// ----------------------------------------------------------------------------
+// WaveletTurbulence.hpp
+//
+// Description: Up-resolution of a coarse smoke density with wavelet noise
+//   (Cook and DeRose 2005; Kim et al. 2008). The coarse density is resampled
+//   at a displaced position, where the displacement is band-limited noise
+//   scaled by the local coarse kinetic energy and extrapolated over a few
+//   octaves along the Kolmogorov -5/3 spectrum.
+// ----------------------------------------------------------------------------
+
+#ifndef _WAVELETTURBULENCE_HPP_
+#define _WAVELETTURBULENCE_HPP_
+
+#include <vector>
+#include <random>
+#include <cmath>
+
+#include "SmokeSolver.hpp"
+
+class WaveletTurbulence {
+public:
+  enum { kTileSize = 128 };     // noise tile edge; must be even
+
+  explicit WaveletTurbulence(
+    const int upres=4, const tReal strength=0.05, const int octaves=3) :
+    _upres(upres), _strength(strength), _octaves(octaves) {}
+
+  // fine gets upres times the resolution of d; u and v are the coarse
+  // staggered velocities
+  template<typename GridF>
+  void apply(Grid2f &fine, const GridF &d, const GridF &u, const GridF &v) const
+  {
+    const int nx = d.resX(), ny = d.resY();
+    const int fx = nx*_upres, fy = ny*_upres;
+    if(fine.resX()!=fx || fine.resY()!=fy) fine.init(fx, fy);
+
+    const std::vector<tReal> &tile = noiseTile();
+    const tReal over_up = 1e0/_upres;
+
+#pragma omp parallel for schedule(static)
+    for(int J=0; J<fy; ++J) {
+      for(int I=0; I<fx; ++I) {
+        // position in coarse cell units (cell centers at integers)
+        const tReal x = (I + 0.5f)*over_up - 0.5f;
+        const tReal y = (J + 0.5f)*over_up - 0.5f;
+
+        // local energy from the coarse velocity at cell centers
+        const int i = std::min(std::max(static_cast<int>(x + 0.5f), 0), nx-1);
+        const int j = std::min(std::max(static_cast<int>(y + 0.5f), 0), ny-1);
+        const tReal uc = 0.5f*(u(i, j) + u(std::min(i+1, nx-1), j));
+        const tReal vc = 0.5f*(v(i, j) + v(i, std::min(j+1, ny-1)));
+        const tReal amp = _strength*std::sqrt(uc*uc + vc*vc);
+
+        // two decorrelated noise channels, summed over the octaves with
+        // Kolmogorov falloff 2^(-5/6 per octave) in amplitude, starting from
+        // the coarse grid frequency
+        tReal dx = 0, dy = 0, scale = over_up, weight = 1;
+        for(int o=0; o<_octaves; ++o) {
+          const tReal px = I*scale, py = J*scale;
+          dx += weight*evalNoise(tile, px, py);
+          dy += weight*evalNoise(tile, px + kTileSize/2, py + kTileSize/3);
+          scale *= 2;
+          weight *= 0.5612310241546865f; // 2^(-5/6)
+        }
+
+        fine(I, J) = d.sampleAt(x + amp*dx, y + amp*dy);
+      }
+    }
+  }
+
+  // the noise tile is generated on first use and shared afterwards
+  static const std::vector<tReal> &noiseTile()
+  {
+    static const std::vector<tReal> tile = generateTile(kTileSize);
+    return tile;
+  }
+
+  int upres() const { return _upres; }
+
+private:
+  static int wrap(const int i, const int n) { const int m = i%n; return (m<0) ? m+n : m; }
+
+  // quadratic B-spline evaluation of the periodic tile
+  static tReal evalNoise(const std::vector<tReal> &tile, const tReal x, const tReal y)
+  {
+    const int n = kTileSize;
+    tReal wx[3], wy[3];
+    const int mx = static_cast<int>(std::ceil(x - 0.5f));
+    const int my = static_cast<int>(std::ceil(y - 0.5f));
+    const tReal tx = mx - (x - 0.5f), ty = my - (y - 0.5f);
+    wx[0] = 0.5f*tx*tx; wx[2] = 0.5f*(1-tx)*(1-tx); wx[1] = 1 - wx[0] - wx[2];
+    wy[0] = 0.5f*ty*ty; wy[2] = 0.5f*(1-ty)*(1-ty); wy[1] = 1 - wy[0] - wy[2];
+
+    tReal r = 0;
+    for(int g=0; g<3; ++g) {
+      const int row = wrap(my + g - 1, n)*n;
+      for(int f=0; f<3; ++f)
+        r += wy[g]*wx[f]*tile[row + wrap(mx + f - 1, n)];
+    }
+    return r;
+  }
+
+  // one line of the analysis/synthesis filters (stride in elements)
+  static void downsample(const tReal *from, tReal *to, const int n, const int stride)
+  {
+    static const tReal a[32] = {
+      0.000334, -0.001528, 0.000410, 0.003545, -0.000938, -0.008233, 0.002172, 0.019120,
+      -0.005040, -0.044412, 0.011655, 0.103311, -0.025936, -0.243780, 0.033979, 0.655340,
+      0.655340, 0.033979, -0.243780, -0.025936, 0.103311, 0.011655, -0.044412, -0.005040,
+      0.019120, 0.002172, -0.008233, -0.000938, 0.003546, 0.000410, -0.001528, 0.000334 };
+    for(int i=0; i<n/2; ++i) {
+      tReal r = 0;
+      for(int k=2*i-16; k<2*i+16; ++k) r += a[k-2*i+16]*from[wrap(k, n)*stride];
+      to[i*stride] = r;
+    }
+  }
+  static void upsample(const tReal *from, tReal *to, const int n, const int stride)
+  {
+    static const tReal p[4] = { 0.25, 0.75, 0.75, 0.25 };
+    for(int i=0; i<n; ++i) {
+      tReal r = 0;
+      for(int k=i/2; k<=i/2+1; ++k) r += p[i-2*k+2]*from[wrap(k, n/2)*stride];
+      to[i*stride] = r;
+    }
+  }
+
+  // band-limited noise: white noise minus its own coarse approximation,
+  // normalized to unit variance
+  static std::vector<tReal> generateTile(const int n)
+  {
+    std::vector<tReal> noise(n*n), t1(n*n), t2(n*n);
+    std::mt19937 rng(0x5eed);
+    std::normal_distribution<tReal> gauss(0, 1);
+    for(tReal &x : noise) x = gauss(rng);
+
+    for(int j=0; j<n; ++j) {    // along x
+      downsample(&noise[j*n], &t1[j*n], n, 1);
+      upsample(&t1[j*n], &t2[j*n], n, 1);
+    }
+    for(int i=0; i<n; ++i) {    // along y
+      downsample(&t2[i], &t1[i], n, n);
+      upsample(&t1[i], &t2[i], n, n);
+    }
+    for(int k=0; k<n*n; ++k) noise[k] -= t2[k];
+
+    // avoid the even/odd variance difference with an odd-offset copy
+    int offset = n/2;
+    if(offset%2==0) ++offset;
+    for(int j=0; j<n; ++j)
+      for(int i=0; i<n; ++i) t1[j*n + i] = noise[wrap(j+offset, n)*n + wrap(i+offset, n)];
+    double var = 0;
+    for(int k=0; k<n*n; ++k) { noise[k] += t1[k]; var += noise[k]*noise[k]; }
+
+    const tReal s = 1e0/std::sqrt(var/(n*n));
+    for(tReal &x : noise) x *= s;
+    return noise;
+  }
+
+  int _upres;                   // resolution multiplier
+  tReal _strength;              // displacement (cells) per unit coarse speed
+  int _octaves;                 // noise octaves added above the coarse grid
+};
+
+#endif  /* _WAVELETTURBULENCE_HPP_ */
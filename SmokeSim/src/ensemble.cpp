@@ -0,0 +1,197 @@
+// ----------------------------------------------------------------------------
+// ensemble.cpp
+//
+// Description: Batch driver running a parameter sweep of independent smoke
+//   simulations in parallel, without any window
+//
+// Usage: smoke_ensemble <sweep file> [<output csv>]
+//
+// The sweep file lists one parameter per line followed by its values; every
+// combination of res, dt, buoy and src is simulated. Lines starting with '#'
+// are ignored. Example:
+//
+//   res    32x64 64x128 128x256
+//   dt     0.01 0.005
+//   buoy   0.1 0.2 0.4
+//   src    3x3 6x6        # source half-size in cells
+//   steps  400            # steps per run
+//   every  10             # metric sampling period in steps
+//
+// The source is centered horizontally at 7/64 of the height, as in tpSmoke.
+// ----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "SmokeSolver.hpp"
+
+namespace {
+
+struct Run {
+  int resX, resY;
+  tReal dt, buoy;
+  glm::vec2 srcSize;
+};
+
+struct Sweep {
+  std::vector<glm::ivec2> res;
+  std::vector<tReal> dt, buoy;
+  std::vector<glm::vec2> src;
+  int steps = 200, every = 10;
+};
+
+bool parsePair(const std::string &s, float &a, float &b)
+{
+  return std::sscanf(s.c_str(), "%fx%f", &a, &b)==2;
+}
+
+Sweep loadSweep(const std::string &filename)
+{
+  std::ifstream in(filename.c_str());
+  if(!in)
+    throw std::ios_base::failure("[Ensemble][loadSweep] Cannot open " + filename);
+
+  Sweep sw;
+  std::string line;
+  while(std::getline(in, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream ls(line);
+    std::string key, val;
+    if(!(ls >> key)) continue;
+    while(ls >> val) {
+      float a, b;
+      if(key=="res" && parsePair(val, a, b)) sw.res.push_back(glm::ivec2(a, b));
+      else if(key=="src" && parsePair(val, a, b)) sw.src.push_back(glm::vec2(a, b));
+      else if(key=="dt") sw.dt.push_back(std::atof(val.c_str()));
+      else if(key=="buoy") sw.buoy.push_back(std::atof(val.c_str()));
+      else if(key=="steps") sw.steps = std::atoi(val.c_str());
+      else if(key=="every") sw.every = std::max(std::atoi(val.c_str()), 1);
+      else throw std::runtime_error("[Ensemble][loadSweep] Bad entry: " + key + " " + val);
+    }
+  }
+
+  // defaults of tpSmoke for anything left unspecified
+  if(sw.res.empty()) sw.res.push_back(glm::ivec2(32, 64));
+  if(sw.dt.empty()) sw.dt.push_back(0.01);
+  if(sw.buoy.empty()) sw.buoy.push_back(0.2);
+  if(sw.src.empty()) sw.src.push_back(glm::vec2(3, 3));
+  return sw;
+}
+
+// summary metrics of the current state, appended as one CSV row
+void sample(
+  std::ostream &out, const int run_id, const Run &r, const SmokeSolverBase &solver,
+  const int step)
+{
+  const int nx = solver.resX(), ny = solver.resY();
+  const tReal *d = solver.densityData();
+  const tReal *u = solver.velocityUData();
+  const tReal *v = solver.velocityVData();
+
+  tReal mass = 0, max_speed2 = 0;
+  int plume = 0;                // highest row holding visible smoke
+  for(int j=0; j<ny; ++j) {
+    for(int i=0; i<nx; ++i) {
+      const int k = j*nx + i;
+      mass += d[k];
+      if(d[k]>0.01f) plume = j;
+      const tReal uc = 0.5f*(u[k] + u[(i<nx-1) ? k+1 : k]);
+      const tReal vc = 0.5f*(v[k] + v[(j<ny-1) ? k+nx : k]);
+      max_speed2 = std::max(max_speed2, uc*uc + vc*vc);
+    }
+  }
+
+  out << run_id << ',' << r.resX << ',' << r.resY << ',' << r.dt << ',' << r.buoy << ','
+      << r.srcSize.x << ',' << r.srcSize.y << ',' << step << ',' << step*r.dt << ','
+      << static_cast<tReal>(plume)/ny << ',' << mass << ',' << std::sqrt(max_speed2) << '\n';
+}
+
+}
+
+int main(int argc, char **argv)
+{
+  if(argc<2) {
+    std::cerr << "Usage: " << argv[0] << " <sweep file> [<output csv>]" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Sweep sw;
+  try {
+    sw = loadSweep(argv[1]);
+  } catch(std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Run> runs;
+  for(const glm::ivec2 &res : sw.res)
+    for(const tReal dt : sw.dt)
+      for(const tReal buoy : sw.buoy)
+        for(const glm::vec2 &src : sw.src) {
+          const Run r = { res.x, res.y, dt, buoy, src };
+          runs.push_back(r);
+        }
+
+  // largest first, so that the small runs fill in the gaps at the end
+  std::vector<int> order(runs.size());
+  for(int k=0; k<static_cast<int>(order.size()); ++k) order[k] = k;
+  std::stable_sort(order.begin(), order.end(), [&runs](const int a, const int b) {
+      return runs[a].resX*runs[a].resY > runs[b].resX*runs[b].resY; });
+
+  std::ofstream file;
+  if(argc>2) {
+    file.open(argv[2]);
+    if(!file) {
+      std::cerr << "[Ensemble] Cannot open " << argv[2] << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  std::ostream &out = (argc>2) ? file : std::cout;
+  out << "run,res_x,res_y,dt,buoy,src_w,src_h,step,time,plume_height,total_density,max_speed\n";
+
+  std::cerr << "> " << runs.size() << " runs of " << sw.steps << " steps" << std::endl;
+  const auto t0 = std::chrono::steady_clock::now();
+  int done = 0;
+
+  // one run per thread at a time; the solvers' own parallel loops are nested
+  // and stay serial, so small grids pack one per core instead of fighting
+  // over all of them
+#pragma omp parallel for schedule(dynamic, 1)
+  for(int n=0; n<static_cast<int>(order.size()); ++n) {
+    const int id = order[n];
+    const Run &r = runs[id];
+
+    std::shared_ptr<SmokeSolverBase> solver = makeSmokeSolver(
+      r.resX, r.resY, r.dt, glm::vec2(0.0, -9.8), r.buoy);
+    solver->setVerbose(false);
+    solver->initScene(
+      r.resX, r.resY, glm::vec2(0.5f*r.resX, 7.f/64.f*r.resY), r.srcSize);
+
+    std::ostringstream rows;
+    sample(rows, id, r, *solver, 0);
+    for(int s=1; s<=sw.steps; ++s) {
+      solver->update();
+      if(s%sw.every==0) sample(rows, id, r, *solver, s);
+    }
+
+#pragma omp critical
+    {
+      out << rows.str() << std::flush;
+      std::cerr << "\r> " << ++done << "/" << runs.size() << std::flush;
+    }
+  }
+
+  const auto t1 = std::chrono::steady_clock::now();
+  std::cerr << std::endl << "> Done in "
+            << std::chrono::duration<double>(t1 - t0).count() << " s" << std::endl;
+  return EXIT_SUCCESS;
+}
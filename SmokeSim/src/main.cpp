@@ -24,10 +24,19 @@
 
 #include <iostream>
 #include <sstream>
+#include <string>
 #include <iomanip>
 #include <vector>
 #include <cmath>
 
+#ifndef NDEBUG
+#define SMOKE_ALLOC_COUNTER_IMPLEMENTATION
+#endif
+#include "SmokeSolver.hpp"
+#include "WaveletTurbulence.hpp"
+#include "SmokeAutotune.hpp"
+#include "SmokeTracers.hpp"
+
 // window parameters
 GLFWwindow *gWindow = nullptr;
 int gWindowWidth = 1024;
@@ -38,195 +47,23 @@ float gAppTimer = 0.0;
 float gAppTimerLastClockTime;
 bool gAppTimerStoppedP = true;
 
-typedef float tReal;
-typedef long int tUint;
-
 const int kViewScale = 10;
 
-inline tReal square(const tReal a) { return a*a; }
-inline tReal cube(const tReal a) { return a*a*a; }
-inline tReal clamp(const tReal v, const tReal vmin, const tReal vmax) {
-  if(v<vmin) return vmin;
-  if(v>vmax) return vmax;
-  return v;
-}
-
-// 2D Grid
-template<typename T>
-class Grid2 {
-public:
-  enum { D = 2 };
-
-  explicit Grid2(const int size_x=0, const int size_y=0)
-    : _data(size_x*size_y), _sizeX(size_x), _sizeY(size_y) {
-  }
-
-  void init(const int size_x, const int size_y) {
-    _data.assign(size_x*size_y, 0);
-    _sizeX = size_x;
-    _sizeY = size_y;
-  }
-  void fill(const T &v) { _data.assign(size(), v); }
-  void swap(Grid2 &new_grid) {
-    _data.swap(new_grid._data);
-    _sizeX = new_grid._sizeX;
-    _sizeY = new_grid._sizeY;
-  }
-
-  T sampleAt(const tReal x, const tReal y) const {
-    // TODO:
-    const int i0 = clamp(static_cast<int>(x), 0, resX()-1);
-    const int j0 = clamp(static_cast<int>(y), 0, resY()-1);
-    std::cout<<x<<', '<<y<<std::endl;
-    return (*this)(i0, j0);
-  }
-
-  const T& operator()(const int i, const int j) const {
-    return _data[indexTo1D(i, j)];
-  }
-  T& operator()(const int i, const int j) {
-    return const_cast<T &>(static_cast<const Grid2 &>(*this)(i, j));
-  }
-
-  tUint indexTo1D(const int i, const int j) const { return j*_sizeX + i; }
-  tUint size() const { return _sizeX*_sizeY; }
-  int resX() const { return _sizeX; }
-  int resY() const { return _sizeY; }
-
-private:
-  std::vector<T> _data;
-  int _sizeX, _sizeY;
-};
-typedef Grid2<tReal> Grid2f;
-typedef Grid2<int>   Grid2i;
-
-class SmokeSolver {
-public:
-  explicit SmokeSolver(
-    const tReal dt=0.01, const glm::vec2 g=glm::vec2(0.0, -9.8), const tReal buoy=0.2)
-    : _dt(dt), _g(g), _buoy(buoy) {
-  }
-
-  // assume a grid with the size of res_x*res_y; a smoke mass is at f_cen with
-  // the size of f_size
-  void initScene(
-    const int res_x, const int res_y,
-    const glm::vec2 &src_cen, const glm::vec2 &src_size) {
-    _resX = res_x;
-    _resY = res_y;
-
-    _c.init(res_x, res_y);      // cell type
-    _u.init(res_x, res_y);      // velocity u
-    _v.init(res_x, res_y);      // velocity v
-    _fx.init(res_x, res_y);     // force in x
-    _fy.init(res_x, res_y);     // force in y
-    _p.init(res_x, res_y);      // pressure
-    _d.init(res_x, res_y);      // density
-
-    _srcCen = src_cen;
-    _srcSize = src_size;
-
-    // cell types: 0=open boundary; 1=fluid
-    _c.fill(1);
-    for(int j=0; j<res_y; ++j) {
-      for(int i=0; i<res_x; ++i) {
-        if(i==0) _c(i, j) = 0;
-        if(i==res_x-1) _c(i, j) = 0;
-        if(j==0) _c(i, j) = 0;
-        if(j==res_y-1) _c(i, j) = 0;
-      }
-    }
-
-    addSource(_d, _srcCen, _srcSize);
-  }
-
-  void addSource(Grid2f &d, const glm::vec2 &src_cen, const glm::vec2 &src_size) const {
-    // smoke mass (NOTE: centered grid)
-    for(int j=0; j<resY(); ++j) {
-      for(int i=0; i<resX(); ++i) {
-        if(i>(src_cen.x-0.5 - src_size.x) &&
-           i<(src_cen.x-0.5 + src_size.x) &&
-           j>(src_cen.y-0.5 - src_size.y) &&
-           j<(src_cen.y-0.5 + src_size.y)) // if inside of the given box
-          d(i, j) = 1.0;                   // fill it up with smoke density
-      }
-    }
-  }
-
-  void advectCentered(
-    Grid2f &f, const Grid2f &u, const Grid2f &v, const tReal dt) const {
-    // TODO:
-  }
-
-  void advectStaggered(
-    Grid2f &fu, Grid2f &fv,
-    const Grid2f &u, const Grid2f &v, const tReal dt) const {
-    // TODO:
-  }
-
-  void calculateBuoyancy(
-    Grid2f &fx, Grid2f &fy,
-    const Grid2f &d, const glm::vec2 &g, const tReal coef) const {
-    // TODO:
-  }
-
-  void updateVelocityWithForce(
-    Grid2f &u, Grid2f &v,
-    const Grid2f &fx, const Grid2f &fy, const tReal dt) const {
-    // TODO:
-  }
-
-  void solvePressure(
-    Grid2f &p, const Grid2f &u, const Grid2f &v, const tReal dt) const {
-    // TODO:
-  }
-
-  void updateVelocityWithPressure(
-    Grid2f &u, Grid2f &v, const Grid2f &p, const tReal dt) const {
-    // TODO:
-  }
-
-  void update() {
-    std::cout << '.' << std::flush;
-    addSource(_d, _srcCen, _srcSize);
-
-    // TODO:
-  }
-
-  const Grid2i &cells() const { return _c; }
-  const Grid2f &density() const { return _d; }
-  const Grid2f &velocity_u() const { return _u; }
-  const Grid2f &velocity_v() const { return _v; }
-
-  tReal timestep() const { return _dt; }
-
-  int resX() const { return _resX; }
-  int resY() const { return _resY; }
-  tUint gridSize() const { return _resX*_resY; }
-
-private:
-  int _resX, _resY;             // grid resolution
-
-  glm::vec2  _srcCen, _srcSize; // smoke source (a box)
-
-  Grid2i _c;                    // cell type
-  Grid2f _u, _v;                // velocity u and v
-  Grid2f _fx, _fy;              // force in x and y
-  Grid2f _p, _d;                // pressure and smoke marker density
-
-  // simulation
-  tReal _dt;                    // time step
-
-  glm::vec2  _g;                // gravity
-  tReal _buoy;                  // buoyancy factor
-};
-
 SmokeSolver gSolver;
 bool gPause = true;
 bool gSaveFile = false;
 bool gShowGrid = true;
 bool gShowVel = true;
+bool gShowTurb = false;
+WaveletTurbulence gTurb(4);
+Grid2f gTurbDens;               // up-resolved density for display
+SampleMode gSampleMode = kSampleLinear; // density display
+bool gShowTracers = false;
+const tReal kTracerLife = 5;    // seconds
+SmokeTracers gTracers(1<<20, kTracerLife);
+GLuint gTracerTex = 0;
 int gSavedCnt = 0;
+int gTune = 0;                  // 1: cached or calibrated settings, 2: recalibrate
 
 void printHelp()
 {
@@ -237,6 +74,9 @@ void printHelp()
     "    * P: toggle simulation" << std::endl <<
     "    * G: toggle grid rendering" << std::endl <<
     "    * V: toggle velocity rendering" << std::endl <<
+    "    * T: toggle wavelet turbulence up-resolution" << std::endl <<
+    "    * R: toggle tracer particle rendering" << std::endl <<
+    "    * C: toggle bilinear/monotone cubic density display" << std::endl <<
     "    * S: save current frame into a file" << std::endl <<
     "    * Q: quit the program" << std::endl;
 }
@@ -265,6 +105,12 @@ void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods
     gShowGrid = !gShowGrid;
   } else if(action == GLFW_PRESS && key == GLFW_KEY_V) {
     gShowVel = !gShowVel;
+  } else if(action == GLFW_PRESS && key == GLFW_KEY_T) {
+    gShowTurb = !gShowTurb;
+  } else if(action == GLFW_PRESS && key == GLFW_KEY_R) {
+    gShowTracers = !gShowTracers;
+  } else if(action == GLFW_PRESS && key == GLFW_KEY_C) {
+    gSampleMode = (gSampleMode==kSampleLinear) ? kSampleCubic : kSampleLinear;
   } else if(action == GLFW_PRESS && key == GLFW_KEY_P) {
     gAppTimerStoppedP = !gAppTimerStoppedP;
     if(!gAppTimerStoppedP)
@@ -347,11 +193,21 @@ void initOpenGL()
   glOrtho(0.0, 1.0, 0.0, 1.0, 0.0, 1.0);
   glMatrixMode(GL_MODELVIEW);
   glLoadIdentity();
+
+  glGenTextures(1, &gTracerTex);
+  glBindTexture(GL_TEXTURE_2D, gTracerTex);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_2D, 0);
 }
 
 void init()
 {
   gSolver.initScene(32, 64, glm::vec2(16, 7), glm::vec2(3, 3));
+  if(gTune)                     // gSolver keeps its dynamic storage
+    applySmokeTuning(gSolver, smokeTuning(gSolver.resX(), gSolver.resY(), gTune>1, &std::cout));
 
   initGLFW();                   // Windowing system
   initOpenGL();
@@ -359,6 +215,7 @@ void init()
 
 void clear()
 {
+  if(gTracerTex) glDeleteTextures(1, &gTracerTex);
   glfwDestroyWindow(gWindow);
   glfwTerminate();
 }
@@ -375,19 +232,43 @@ void render()
   // render everyhing in the range of [0, 1] per axis
 
   // density field
-  const Grid2f &dens = gSolver.density();
+  if(gShowTurb)
+    gTurb.apply(gTurbDens, gSolver.density(), gSolver.velocity_u(), gSolver.velocity_v());
+  const Grid2f &dens = gShowTurb ? gTurbDens : gSolver.density();
   glBegin(GL_POINTS);
   for(int j=0; j<gWindowHeight; ++j) {
     for(int i=0; i<gWindowWidth; ++i) {
       const tReal px = static_cast<tReal>(i)*over_w; // [0, 1]
       const tReal py = static_cast<tReal>(j)*over_h; // [0, 1]
-      const tReal d = dens.sampleAt(px*gSolver.resX()-0.5, py*gSolver.resY()-0.5);
+      const tReal d = dens.sampleAt(px*dens.resX()-0.5, py*dens.resY()-0.5, gSampleMode);
       glColor3f(d, d, d);
       glVertex2f(px, py);
     }
   }
   glEnd();
 
+  // tracer particles, added on top of the density
+  if(gShowTracers) {
+    gTracers.splat(gSolver.resX(), gSolver.resY(), kViewScale/2);
+    glBindTexture(GL_TEXTURE_2D, gTracerTex);
+    glTexImage2D(
+      GL_TEXTURE_2D, 0, GL_LUMINANCE, gTracers.imageResX(), gTracers.imageResY(), 0,
+      GL_LUMINANCE, GL_FLOAT, gTracers.image());
+    glEnable(GL_TEXTURE_2D);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glColor3f(0.4, 0.7, 1.0);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 0); glVertex2f(0, 0);
+    glTexCoord2f(1, 0); glVertex2f(1, 0);
+    glTexCoord2f(1, 1); glVertex2f(1, 1);
+    glTexCoord2f(0, 1); glVertex2f(0, 1);
+    glEnd();
+    glDisable(GL_BLEND);
+    glDisable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+
   // grid guides
   if(gShowGrid) {
     glBegin(GL_LINES);
@@ -459,12 +340,29 @@ void update(const float currentTime)
     // <---- Update here what needs to be animated over time ---->
 
     // solve 10 steps
-    for(int i=0; i<10; ++i) gSolver.update();
+    for(int i=0; i<10; ++i) {
+      gSolver.update();
+      if(gShowTracers) {        // steady state of a full system
+        const int rate = static_cast<int>(gTracers.capacity()*gSolver.timestep()/kTracerLife);
+        gTracers.emit(rate, glm::vec2(16, 7), glm::vec2(3, 3));
+        gTracers.advect(gSolver.velocity_u(), gSolver.velocity_v(), gSolver.timestep());
+      }
+    }
   }
 }
 
 int main(int argc, char **argv)
 {
+  for(int a=1; a<argc; ++a) {
+    const std::string arg = argv[a];
+    if(arg=="--autotune") gTune = std::max(gTune, 1);
+    else if(arg=="--retune") gTune = 2;
+    else {
+      std::cerr << "Usage: " << argv[0] << " [--autotune | --retune]" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
   init();
   while(!glfwWindowShouldClose(gWindow)) {
     update(static_cast<float>(glfwGetTime()));